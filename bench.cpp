@@ -0,0 +1,402 @@
+#include "query.hpp"
+#include <chrono>
+#include <array>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+/*!
+ * Benchmark of every from() operation over the container matrix used by test.cpp.
+ *
+ * Output is CSV, one row per (operation, container, size, selectivity):
+ *   operation,container,size,selectivity,ns_per_element,baseline_ns_per_element,allocations,peak_bytes
+ * Baseline is a hand-written loop doing the same work, empty if there is none.
+ *
+ * Usage: bench [size...]
+ */
+
+namespace bench {
+namespace memory {
+
+size_t allocations = 0;
+size_t live_bytes  = 0;
+size_t peak_bytes  = 0;
+
+/// Every allocation is prefixed with its size, so live and peak bytes are exact.
+constexpr size_t header_size = alignof(std::max_align_t);
+
+void* allocate(size_t size) {
+  auto* block = static_cast<unsigned char*>(std::malloc(size + header_size));
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  *reinterpret_cast<size_t*>(block) = size;
+  ++allocations;
+  live_bytes += size;
+  peak_bytes = std::max(peak_bytes, live_bytes);
+  return block + header_size;
+}
+
+void deallocate(void* pointer) noexcept {
+  if (pointer == nullptr) {
+    return;
+  }
+  auto* block = static_cast<unsigned char*>(pointer) - header_size;
+  live_bytes -= *reinterpret_cast<size_t*>(block);
+  std::free(block);
+}
+
+struct snapshot {
+  size_t allocations;
+  size_t peak_bytes;
+};
+
+snapshot reset() {
+  peak_bytes = live_bytes;
+  return {allocations, live_bytes};
+}
+
+} // namespace memory
+} // namespace bench
+
+void* operator new  (size_t size) { return bench::memory::allocate(size); }
+void* operator new[](size_t size) { return bench::memory::allocate(size); }
+void  operator delete  (void* pointer) noexcept { bench::memory::deallocate(pointer); }
+void  operator delete[](void* pointer) noexcept { bench::memory::deallocate(pointer); }
+void  operator delete  (void* pointer, size_t) noexcept { bench::memory::deallocate(pointer); }
+void  operator delete[](void* pointer, size_t) noexcept { bench::memory::deallocate(pointer); }
+
+namespace bench {
+
+template <typename T>
+void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct measurement {
+  double ns_per_element;
+  size_t allocations;
+  size_t peak_bytes;
+};
+
+/// Best of several runs, repeated until at least 20ms of total work
+template <typename Operation>
+measurement measure(size_t elements, Operation operation) {
+  using clock = std::chrono::steady_clock;
+  double best = std::numeric_limits<double>::max();
+  const auto memory_before = memory::reset();
+  operation();
+  const measurement result_memory{
+    0,
+    memory::allocations - memory_before.allocations,
+    memory::peak_bytes  - memory_before.peak_bytes
+  };
+  const auto deadline = clock::now() + std::chrono::milliseconds(20);
+  for (size_t run = 0; run < 3 || clock::now() < deadline; ++run) {
+    const auto start = clock::now();
+    operation();
+    const auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    best = std::min(best, elapsed);
+  }
+  return {best / static_cast<double>(std::max<size_t>(elements, 1)), result_memory.allocations, result_memory.peak_bytes};
+}
+
+void report(std::string_view operation, std::string_view container, size_t size, double selectivity,
+            const measurement& result, std::optional<measurement> baseline = std::nullopt) {
+  std::cout << operation << ',' << container << ',' << size << ',' << selectivity << ',' << result.ns_per_element << ',';
+  if (baseline) {
+    std::cout << baseline->ns_per_element;
+  }
+  std::cout << ',' << result.allocations << ',' << result.peak_bytes << '\n';
+}
+
+template <typename Container>
+Container make_sequence(size_t size) {
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> distribution(0, 999);
+  Container container;
+  for (size_t i = 0; i < size; ++i) {
+    if constexpr (std::is_same_v<Container, std::forward_list<int>>) {
+      container.push_front(distribution(random));
+    } else {
+      query::container_traits::any_push(container, distribution(random));
+    }
+  }
+  return container;
+}
+
+template <typename Container>
+Container make_associative(size_t size) {
+  Container container;
+  for (size_t i = 0; i < size; ++i) {
+    query::container_traits::any_push(container, static_cast<int>(i), static_cast<int>(i % 1000));
+  }
+  return container;
+}
+
+template <typename Container>
+constexpr bool is_orderable =
+  std::is_same_v<Container, std::vector<int>> ||
+  std::is_same_v<Container, std::deque<int>>  ||
+  std::is_same_v<Container, std::list<int>>;
+
+template <typename Container>
+constexpr bool is_sorted_source =
+  std::is_same_v<Container, std::set<int>> ||
+  std::is_same_v<Container, std::multiset<int>>;
+
+template <typename Container>
+void sequence_suite(std::string_view name, size_t size) {
+  const Container source = make_sequence<Container>(size);
+  const Container other  = make_sequence<Container>(size / 2);
+
+  if constexpr (!std::is_same_v<Container, std::forward_list<int>>) {
+    for (const double selectivity : { 0.01, 0.5, 1.0 }) {
+      const int threshold = static_cast<int>(selectivity * 1000);
+      const auto result = measure(size, [&] {
+        do_not_optimize(query::from(source).where([&](int v) { return v < threshold; }).to(Container{}));
+      });
+      const auto baseline = measure(size, [&] {
+        Container selected;
+        for (int v : source) {
+          if (v < threshold) {
+            query::container_traits::any_push(selected, v);
+          }
+        }
+        do_not_optimize(selected);
+      });
+      report("where", name, size, selectivity, result, baseline);
+    }
+
+    report("where_batched", name, size, 0.5, measure(size, [&] {
+      do_not_optimize(query::from(source).batch().where([](int v) { return v < 500; }).where([](int v) { return v % 2 == 0; }).to(Container{}));
+    }));
+
+    report("where_small_buffer", name, size, 0.001, measure(size, [&] {
+      using small_query = query::from<Container, query::small_vector<int, 16>>;
+      do_not_optimize(small_query(source).where([](int v) { return v == 7; }).take(8).where([](int) { return true; }).sum());
+    }));
+
+    report("where_gate", name, size, 0.5, measure(size, [&] {
+      do_not_optimize(query::from(source).where(query::gate(std::less<>{}, 500)).to(Container{}));
+    }));
+
+    report("merge", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).merge(other).to(Container{}));
+    }));
+
+    report("shared_scan_8", name, size, 0.1, measure(size, [&] {
+      std::array<size_t, 8> counts{};
+      query::shared_scan scan(source);
+      for (int q = 0; q < 8; ++q) {
+        scan.add([q](int v) { return v / 100 == q; }, query::count_into(counts[q]));
+      }
+      scan.run();
+      do_not_optimize(counts);
+    }), measure(size, [&] {
+      std::array<size_t, 8> counts{};
+      for (int v : source) {
+        for (int q = 0; q < 8; ++q) {
+          counts[q] += v / 100 == q;
+        }
+      }
+      do_not_optimize(counts);
+    }));
+
+    report("sample", name, size, 0.01, measure(size, [&] {
+      do_not_optimize(query::from(source).sample(size / 100).to(Container{}));
+    }));
+
+    report("sample_fraction", name, size, 0.01, measure(size, [&] {
+      do_not_optimize(query::from(source).sample_fraction(0.01).to(Container{}));
+    }));
+
+    report("partition_by_8", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).partition_by(8));
+    }), measure(size, [&] {
+      std::vector<Container> parts(8);
+      for (int v : source) {
+        query::container_traits::any_push(parts[std::hash<int>{}(v) % 8], v);
+      }
+      do_not_optimize(parts);
+    }));
+
+    report("sum", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).sum());
+    }), measure(size, [&] {
+      int sum = 0;
+      for (int v : source) {
+        sum += v;
+      }
+      do_not_optimize(sum);
+    }));
+
+    report("min", name, size, 1.0, measure(size, [&] { do_not_optimize(query::from(source).min()); }));
+    report("max", name, size, 1.0, measure(size, [&] { do_not_optimize(query::from(source).max()); }));
+  }
+
+  if constexpr (is_orderable<Container>) {
+    report("sort", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).sort().to(Container{}));
+    }));
+    report("reverse_sort", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).reverse_sort().to(Container{}));
+    }));
+    report("external_sort", name, size, 1.0, measure(size, [&] {
+      Container sorted;
+      query::from(source).sort_to([&](int&& v) { query::container_traits::any_push(sorted, v); },
+                                  query::external{ size * sizeof(int) / 8 });
+      do_not_optimize(sorted);
+    }));
+    report("reverse", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).reverse().to(Container{}));
+    }));
+  }
+
+  if constexpr (is_sorted_source<Container>) {
+    report("union_with", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).union_with(other).to(Container{}));
+    }));
+    report("intersect_with", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).intersect_with(other).to(Container{}));
+    }));
+    report("difference_with", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(query::from(source).difference_with(other).to(Container{}));
+    }));
+    using prefiltered = query::from<Container, Container, query::where, query::prefiltered_set_operation>;
+    report("prefiltered_difference_with", name, size, 1.0, measure(size, [&] {
+      do_not_optimize(prefiltered(source).difference_with(other).to(Container{}));
+    }));
+  }
+
+  report("to_vector", name, size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).to(std::vector<int>{}));
+  }), measure(size, [&] {
+    do_not_optimize(std::vector<int>(source.begin(), source.end()));
+  }));
+  report("to_string", name, size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).to(std::string{}));
+  }));
+}
+
+template <typename Container>
+void associative_suite(std::string_view name, size_t size) {
+  const Container source = make_associative<Container>(size);
+  const Container other  = make_associative<Container>(size / 2);
+
+  for (const double selectivity : { 0.01, 0.5, 1.0 }) {
+    const int threshold = static_cast<int>(selectivity * 1000);
+    report("where_value", name, size, selectivity, measure(size, [&] {
+      do_not_optimize(query::from(source).where_value(query::gate(std::less<>{}, threshold)).to(Container{}));
+    }), measure(size, [&] {
+      Container selected;
+      for (const auto&[k, v] : source) {
+        if (v < threshold) {
+          query::container_traits::any_push(selected, k, v);
+        }
+      }
+      do_not_optimize(selected);
+    }));
+  }
+
+  report("merge", name, size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).merge(other).to(Container{}));
+  }));
+  report("to_vector", name, size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).to(std::vector<int>{}));
+  }));
+  report("to_string", name, size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).to(std::string{}));
+  }));
+}
+
+std::vector<std::string> make_strings(size_t size) {
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::uniform_int_distribution<size_t> length(8, 64);
+  std::vector<std::string> strings(size);
+  for (std::string& value : strings) {
+    value.resize(length(random));
+    for (char& c : value) {
+      c = static_cast<char>(letter(random));
+    }
+  }
+  return strings;
+}
+
+void string_suite(size_t size) {
+  const std::vector<std::string> source = make_strings(size);
+
+  report("where_contains", "vector<string>", size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).where(query::contains("query")).to());
+  }), measure(size, [&] {
+    std::vector<std::string> selected;
+    for (const std::string& value : source) {
+      if (value.find("query") != std::string::npos) {
+        selected.push_back(value);
+      }
+    }
+    do_not_optimize(selected);
+  }));
+  report("where_starts_with", "vector<string>", size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).where(query::starts_with("qu")).to());
+  }));
+  report("where_equals_ci", "vector<string>", size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).where(query::equals_ci("ABCDEFGHIJ")).to());
+  }));
+  report("where_in_set", "vector<string>", size, 1.0, measure(size, [&] {
+    do_not_optimize(query::from(source).where(query::in_set({ "abcdefgh", "query", "xyzxyzxyz" })).to());
+  }));
+
+  // Low-cardinality column, plain strings as baseline for dictionary codes
+  std::vector<std::string> statuses(size);
+  for (size_t i = 0; i < size; ++i) {
+    statuses[i] = "status_" + std::to_string(source[i].size() % 16);
+  }
+  const query::dictionary_column<> column(statuses);
+  report("dictionary_where", "vector<string>", size, 1.0 / 16, measure(size, [&] {
+    do_not_optimize(column.decode(query::from(column.codes()).where(column.translate(query::gate(std::equal_to<>{}, std::string("status_7")))).to()));
+  }), measure(size, [&] {
+    do_not_optimize(query::from(statuses).where(query::gate(std::equal_to<>{}, std::string("status_7"))).to());
+  }));
+  report("dictionary_sort", "vector<string>", size, 1.0, measure(size, [&] {
+    do_not_optimize(column.decode(query::from(column.codes()).sort().to()));
+  }), measure(size, [&] {
+    do_not_optimize(query::from(statuses).sort().to());
+  }));
+}
+
+void run(size_t size) {
+  sequence_suite<std::vector<int>>      ("vector",       size);
+  sequence_suite<std::deque<int>>       ("deque",        size);
+  sequence_suite<std::list<int>>        ("list",         size);
+  sequence_suite<std::forward_list<int>>("forward_list", size);
+  sequence_suite<std::set<int>>         ("set",          size);
+  sequence_suite<std::multiset<int>>    ("multiset",     size);
+
+  associative_suite<std::map<int, int>>               ("map",                size);
+  associative_suite<std::multimap<int, int>>          ("multimap",           size);
+  associative_suite<std::unordered_map<int, int>>     ("unordered_map",      size);
+  associative_suite<std::unordered_multimap<int, int>>("unordered_multimap", size);
+  associative_suite<query::flat_map<int, int>>        ("flat_map",           size);
+  associative_suite<query::flat_multimap<int, int>>   ("flat_multimap",      size);
+
+  string_suite(size);
+}
+
+} // namespace bench
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(std::stoul(argv[i]));
+  }
+  if (sizes.empty()) {
+    sizes = { 1'000, 100'000 };
+  }
+  std::cout << "operation,container,size,selectivity,ns_per_element,baseline_ns_per_element,allocations,peak_bytes\n";
+  for (const size_t size : sizes) {
+    bench::run(size);
+  }
+}
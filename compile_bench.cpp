@@ -0,0 +1,48 @@
+#include "query.hpp"
+#include <string>
+
+/*!
+ * Compile-time benchmark: a translation unit using typical queries over the containers
+ * listed in `QUERY_COMMON_INSTANTIATIONS`. It is only compiled, never run, see compile_bench.sh
+ * comparing compile time of it with and without QUERY_EXTERN_TEMPLATES.
+ */
+
+namespace compile_bench {
+
+std::vector<int> ints(const std::vector<int>& values, const std::vector<int>& others) {
+  return query::from(values)
+    .where(query::gate(std::greater<>{}, 10))
+    .merge(others)
+    .where([](int v) { return v % 3 != 0; })
+    .distinct()
+    .sort()
+    .to();
+}
+
+std::vector<std::string> strings(const std::vector<std::string>& values) {
+  return query::from(values)
+    .where(query::starts_with("a"))
+    .reverse_sort()
+    .to();
+}
+
+int deque_sum(const std::deque<int>& values) {
+  return query::from(values).where([](int v) { return v > 0; }).sum();
+}
+
+std::set<int> set_operations(const std::set<int>& values, const std::set<int>& others) {
+  return query::from(values).union_with(others).difference_with(std::set<int>{ 1, 2, 3 }).to();
+}
+
+std::map<int, int> map_where(const std::map<int, int>& values, const std::map<int, int>& others) {
+  return query::from(values)
+    .where_value(query::gate(std::less<>{}, 100))
+    .merge(others)
+    .to();
+}
+
+std::string render(const std::vector<double>& values) {
+  return query::from(values).where(query::gate(std::greater_equal<>{}, 0.5)).to(std::string{});
+}
+
+} // namespace compile_bench
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Compile time of compile_bench.cpp with and without QUERY_EXTERN_TEMPLATES.
+#
+# Runs are interleaved, so machine noise hits both modes alike, and the median is reported.
+# Extern mode also pays for query_instantiations.cpp once per program, which is not included,
+# since that object is compiled once and shared by every translation unit.
+#
+# Usage: compile_bench.sh [runs] [compiler flags...]
+#   CXX  compiler to use, c++ by default
+
+set -e
+
+runs=${1:-7}
+[ $# -gt 0 ] && shift
+flags=${*:--O0}
+cxx=${CXX:-c++}
+cd "$(dirname "$0")"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+elapsed() {
+  start=$(date +%s.%N)
+  $cxx -std=c++20 $flags "$@" -c compile_bench.cpp -o "$out/compile_bench.o"
+  end=$(date +%s.%N)
+  awk "BEGIN { print $end - $start }"
+}
+
+median() {
+  sort -n | awk '{ value[NR] = $1 } END { print (NR % 2) ? value[(NR + 1) / 2] : (value[NR / 2] + value[NR / 2 + 1]) / 2 }'
+}
+
+: > "$out/header_only"
+: > "$out/extern"
+run=0
+while [ $run -lt "$runs" ]; do
+  elapsed >> "$out/header_only"
+  elapsed -DQUERY_EXTERN_TEMPLATES >> "$out/extern"
+  run=$((run + 1))
+done
+
+echo "flags: $flags, runs: $runs"
+echo "header-only               $(median < "$out/header_only")s"
+echo "QUERY_EXTERN_TEMPLATES    $(median < "$out/extern")s"
@@ -5,6 +5,7 @@
 #include <vector>
 #include <list>
 #include <queue>
+#include <deque>
 #include <stack>
 #include <forward_list>
 #include <set>
@@ -13,21 +14,57 @@
 #include <optional>
 #include <cassert>
 #include <functional>
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+#include <span>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <typeindex>
+#include <thread>
+#include <tuple>
+#include <stdexcept>
+#include <cmath>
+#include <bit>
+#include <random>
+#include <utility>
+#include <cstdio>
+#include <string>
+#include <ranges>
+#include <limits>
+#include <numeric>
+#include <new>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace query {
+
+template <typename T, size_t N>
+class small_vector;
+
+template <typename Key, typename Value, bool Multi>
+class basic_flat_map;
+
+template <typename Container>
+class versioned;
+
 namespace container_traits {
 /*!
  * Check if type has `iterator` typename
  * @tparam Container type
+ * @note   traits are requires-expressions rather than overloaded SFINAE probes,
+ *         so checking one costs a single instantiation
  */
-template<typename T>
+template <typename T>
 class has_iterator final {
-private:
-  template<typename C> static constexpr std::true_type  test_for_iterator(typename C::iterator*);
-  template<typename  > static constexpr std::false_type test_for_iterator(...);
-
 public:
-  static constexpr bool value = decltype(test_for_iterator<T>(nullptr))::value;
+  static constexpr bool value = requires { typename T::iterator; };
 };
 /*!
  * Check if type has `mapped_type` typename
@@ -35,12 +72,8 @@ public:
  */
 template <typename T>
 class has_mapped_type final {
-private:
-  template<typename C> static constexpr std::true_type  test_for_mapped_type(typename C::mapped_type*);
-  template<typename  > static constexpr std::false_type test_for_mapped_type(...);
-
 public:
-  static constexpr bool value = decltype(test_for_mapped_type<T>(nullptr))::value;
+  static constexpr bool value = requires { typename T::mapped_type; };
 };
 /*!
  * Check if type has `traits_type` typename
@@ -49,44 +82,28 @@ public:
  */
 template <typename T>
 class has_traits_type final {
-private:
-  template<typename C> static constexpr std::true_type  test_for_traits_type(typename C::traits_type*);
-  template<typename  > static constexpr std::false_type test_for_traits_type(...);
-
 public:
-  static constexpr bool value = decltype(test_for_traits_type<T>(nullptr))::value;
+  static constexpr bool value = requires { typename T::traits_type; };
 };
 /*!
  * Check if `<=>` operator in namespace std on type exists
  */
 template <typename T>
 class has_three_way_comparator final {
-private:
-  template <typename C> static constexpr auto check_for_operator(C*) -> typename
-    std::is_same<
-      decltype(std::operator<=>(std::declval<C>(), std::declval<C>())),
-      std::strong_ordering
-    >::type;
-  template <typename> static constexpr std::false_type check_for_operator(...);
-
 public:
-  static constexpr bool value = decltype(check_for_operator<T>(nullptr))::value;
+  static constexpr bool value = requires (const T& value) {
+    { std::operator<=>(value, value) } -> std::same_as<std::strong_ordering>;
+  };
 };
 /*!
  * Check if `+` operator in namespace std on type exists
  */
 template <typename T>
 class has_plus_operator final {
-private:
-  template <typename C> static constexpr auto check_for_operator(C*) -> typename
-  std::is_same<
-    decltype(std::operator+(std::declval<C>(), std::declval<C>())),
-    C
-  >::type;
-  template <typename> static constexpr std::false_type check_for_operator(...);
-
 public:
-  static constexpr bool value = decltype(check_for_operator<T>(nullptr))::value;
+  static constexpr bool value = requires (const T& value) {
+    { std::operator+(value, value) } -> std::same_as<T>;
+  };
 };
 
 template <typename T>
@@ -107,15 +124,35 @@ struct is_basic_string final : std::integral_constant<
   has_iterator   <T>::value &&
   has_traits_type<T>::value > {};
 
+/*!
+ * Check if container keeps its elements in ascending order by `operator<`
+ */
+template <typename T>
+struct is_ordered_container final : std::integral_constant<
+  bool,
+  requires { requires std::is_same_v<typename T::key_compare, std::less<typename T::key_type>>; } ||
+  requires { requires std::is_same_v<typename T::key_compare, std::less<>>; } > {};
+
 template <typename... Args> struct need_emplace_param                         final : std::false_type {};
 template <typename... Args> struct need_emplace_param<std::vector<Args...>>   final : std:: true_type {};
 template <typename... Args> struct need_emplace_param<std::list<Args...>>     final : std:: true_type {};
 template <typename... Args> struct need_emplace_param<std::deque<Args...>>    final : std:: true_type {};
 
+template <typename T, size_t N> struct need_emplace_param<small_vector<T, N>> final : std:: true_type {};
+
+template <typename... Args> struct is_small_vector                            final : std::false_type {};
+template <typename T, size_t N> struct is_small_vector<small_vector<T, N>>    final : std:: true_type {};
+
+template <typename... Args> struct is_flat_associative                        final : std::false_type {};
+template <typename K, typename V, bool M> struct is_flat_associative<basic_flat_map<K, V, M>> final : std::true_type {};
+
 template <typename... Args> struct has_not_clear_method                       final : std::false_type {};
 template <typename... Args> struct has_not_clear_method<std::stack<Args...>>  final : std:: true_type {};
 template <typename... Args> struct has_not_clear_method<std::queue<Args...>>  final : std:: true_type {};
 
+template <typename... Args> struct is_appendable                              final : std:: true_type {};
+template <typename... Args> struct is_appendable<std::forward_list<Args...>>  final : std::false_type {};
+
 template <typename... Args> struct need_push_back final : std::false_type {};
 template <typename... Args> struct need_push_back<std::basic_string<Args...>> final : std::true_type {};
 
@@ -148,727 +185,6195 @@ void any_clear(Container& container) noexcept {
 
 namespace query {
 /*!
- * Container cast implemented on next type categories:
- *    Sequence ->    Sequence
- *    Sequence ->      String
- * Associative ->      String
- * Associative -> Associative
- * Associative ->    Sequence
+ * Sequence container keeping up to N elements inline, without heap allocation.
+ * Grows to heap storage like std::vector when N is exceeded. Usable as Buffer
+ * of `from`, so queries with few result rows do not allocate.
  */
-template <typename From, typename To>
-class cast final {
+template <typename T, size_t N>
+class small_vector final {
 public:
-  using from_type = From;
-  using   to_type = To;
+  using value_type      = T;
+  using size_type       = size_t;
+  using difference_type = ptrdiff_t;
+  using reference       = T&;
+  using const_reference = const T&;
+  using pointer         = T*;
+  using const_pointer   = const T*;
+  using iterator        = T*;
+  using const_iterator  = const T*;
 
-  static_assert(
-    container_traits::is_sequence_container   <from_type>::value ||
-    container_traits::is_associative_container<from_type>::value  ,
-    "Source type is not container");
-  static_assert(
-    container_traits::is_sequence_container   <to_type>::value   ||
-    container_traits::is_associative_container<to_type>::value   ||
-    container_traits::is_basic_string         <to_type>::value    ,
-    "Target type is neither container nor string");
+  static constexpr size_type inline_capacity = N;
 
-  to_type operator()(const from_type& from)
-    requires (
-      container_traits::is_sequence_container<from_type>::value &&
-      container_traits::is_sequence_container<  to_type>::value &&
-     !container_traits::is_basic_string      <  to_type>::value
-    ) || (
-      container_traits::is_associative_container<from_type>::value &&
-      container_traits::is_associative_container<  to_type>::value &&
-     !container_traits::is_basic_string         <  to_type>::value )
-  { return same_to_same(from); }
+  small_vector() noexcept = default;
 
-  to_type operator()(const from_type& from)
-    requires (
-      container_traits::is_sequence_container<from_type>::value &&
-      container_traits::is_basic_string      <  to_type>::value )
-  { return seq_to_string(from); }
+  small_vector(std::initializer_list<T> elements) : small_vector(elements.begin(), elements.end()) {}
 
-  to_type operator()(const from_type& from)
-    requires (
-      container_traits::is_associative_container<from_type>::value &&
-      container_traits::is_sequence_container   <  to_type>::value &&
-     !container_traits::is_basic_string         <  to_type>::value )
-  { return ass_to_seq(from); }
+  template <typename Iterator>
+    requires (!std::is_integral_v<Iterator>)
+  small_vector(Iterator first, Iterator last) {
+    if constexpr (std::forward_iterator<Iterator>) {
+      reserve(std::distance(first, last));
+    }
+    for (; first != last; ++first) {
+      emplace_back(*first);
+    }
+  }
 
-  to_type operator()(const from_type& from)
-    requires (
-      container_traits::is_associative_container<from_type>::value &&
-      container_traits::is_basic_string         <  to_type>::value )
-  { return ass_to_string(from); }
+  small_vector(const small_vector& other) : small_vector(other.begin(), other.end()) {}
 
-private:
-  template <typename T>
-  auto to_string(const T& element) {
-    std::string output;
-    if constexpr (std::is_integral_v<std::decay_t<T>>) {
-      output += std::to_string(element);
-    } else {
-      output += element;
+  small_vector(small_vector&& other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+    take(std::move(other));
+  }
+
+  small_vector& operator=(const small_vector& other) {
+    if (this != &other) {
+      small_vector copy(other);
+      clear();
+      release();
+      take(std::move(copy));
     }
-    return output;
+    return *this;
   }
 
-  to_type same_to_same(const from_type& sequence) {
-    return {std::begin(sequence), std::end(sequence)};
+  small_vector& operator=(small_vector&& other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+    if (this != &other) {
+      clear();
+      release();
+      take(std::move(other));
+    }
+    return *this;
   }
 
-  auto seq_to_string(const from_type& sequence) {
-    std::string result;
-    for (auto&& element : sequence) {
-      result += to_string(element) += ' ';
+  ~small_vector() {
+    clear();
+    release();
+  }
+
+  iterator        begin()       noexcept { return data_; }
+  iterator        end  ()       noexcept { return data_ + size_; }
+  const_iterator  begin() const noexcept { return data_; }
+  const_iterator  end  () const noexcept { return data_ + size_; }
+  const_iterator cbegin() const noexcept { return data_; }
+  const_iterator cend  () const noexcept { return data_ + size_; }
+
+  T*              data()        noexcept { return data_; }
+  const T*        data()  const noexcept { return data_; }
+  size_type       size()  const noexcept { return size_; }
+  size_type   capacity()  const noexcept { return capacity_; }
+  bool           empty()  const noexcept { return size_ == 0; }
+  /// Elements are stored inline, no heap memory is owned
+  bool       is_inline()  const noexcept { return data_ == inline_data(); }
+
+  reference       operator[](size_type i)       noexcept { return data_[i]; }
+  const_reference operator[](size_type i) const noexcept { return data_[i]; }
+  reference       front()       noexcept { return data_[0]; }
+  const_reference front() const noexcept { return data_[0]; }
+  reference       back ()       noexcept { return data_[size_ - 1]; }
+  const_reference back () const noexcept { return data_[size_ - 1]; }
+
+  void reserve(size_type capacity) {
+    if (capacity <= capacity_) {
+      return;
     }
-    if (!result.empty()) {
-      result.pop_back();
+    T* storage = std::allocator<T>().allocate(capacity);
+    for (size_type i = 0; i < size_; ++i) {
+      ::new (storage + i) T(std::move_if_noexcept(data_[i]));
+      data_[i].~T();
     }
-    return result;
+    release();
+    data_     = storage;
+    capacity_ = capacity;
   }
 
-  to_type ass_to_seq(const from_type& associative) {
-    to_type result;
-    for (auto&&[k, v] : associative) {
-      container_traits::any_push(result, k);
-      container_traits::any_push(result, v);
+  template <typename... Args>
+  reference emplace_back(Args&&... args) {
+    if (size_ == capacity_) {
+      // Argument may refer to an element, so it is constructed before elements are moved
+      T element(std::forward<Args>(args)...);
+      reserve(std::max<size_type>(capacity_ * 2, 1));
+      ::new (data_ + size_) T(std::move(element));
+    } else {
+      ::new (data_ + size_) T(std::forward<Args>(args)...);
     }
-    return result;
+    return data_[size_++];
   }
 
-  auto ass_to_string(const from_type& associative) {
-    std::string result;
-    for (const auto&[k, v] : associative) {
-      result += '(';
-      result += to_string(k);
-      result += ", ";
-      result += to_string(v);
-      result += ')';
-    }
-    return result;
+  void push_back(const T& element) { emplace_back(element); }
+  void push_back(T&& element)      { emplace_back(std::move(element)); }
+
+  template <typename... Args>
+  iterator emplace(const_iterator position, Args&&... args) {
+    const size_type index = position - data_;
+    emplace_back(std::forward<Args>(args)...);
+    std::rotate(data_ + index, data_ + size_ - 1, data_ + size_);
+    return data_ + index;
   }
-};
 
-} // namespace query
+  iterator insert(const_iterator position, const T& element) { return emplace(position, element); }
+  iterator insert(const_iterator position, T&& element)      { return emplace(position, std::move(element)); }
 
-namespace query {
-/*!
- * Container merge implemented on next type categories:
- *    Sequence ->    Sequence
- * Associative -> Associative
- */
-template <typename Target, typename ToMerge>
-class merge final {
-public:
-  using   target_type = Target;
-  using to_merge_type = ToMerge;
+  iterator erase(const_iterator first, const_iterator last) {
+    T* target = data_ + (first - data_);
+    if (first == last) {
+      return target;
+    }
+    T* new_end = std::move(data_ + (last - data_), end(), target);
+    for (T* it = new_end; it != end(); ++it) {
+      it->~T();
+    }
+    size_ = new_end - data_;
+    return target;
+  }
 
-  static_assert(
-    (
-      container_traits::is_sequence_container<  target_type>::value &&
-      container_traits::is_sequence_container<to_merge_type>::value
-    ) || (
-      container_traits::is_associative_container<  target_type>::value &&
-      container_traits::is_associative_container<to_merge_type>::value
-    ),
-    "Both sequence or associative containers expected"
-  );
+  iterator erase(const_iterator position) {
+    return erase(position, position + 1);
+  }
 
-  void operator()(target_type& target, const to_merge_type& to_merge)
-    requires (
-      container_traits::is_sequence_container<  target_type>::value &&
-      container_traits::is_sequence_container<to_merge_type>::value )
-  { merge_sequence(target, to_merge); }
+  void pop_back() noexcept {
+    data_[--size_].~T();
+  }
 
-  void operator()(target_type& target, const to_merge_type& to_merge)
-    requires (
-      container_traits::is_associative_container<  target_type>::value &&
-      container_traits::is_associative_container<to_merge_type>::value )
-  { merge_associative(target, to_merge); }
+  void clear() noexcept {
+    std::destroy(begin(), end());
+    size_ = 0;
+  }
+
+  bool operator==(const small_vector& other) const {
+    return std::equal(begin(), end(), other.begin(), other.end());
+  }
 
 private:
-  void merge_sequence(target_type& target, const to_merge_type& to_merge) {
-    for (const auto& value : to_merge) {
-      container_traits::any_push(target, value);
+  T*       inline_data()       noexcept { return reinterpret_cast<T*>(inline_); }
+  const T* inline_data() const noexcept { return reinterpret_cast<const T*>(inline_); }
+
+  void release() noexcept {
+    if (!is_inline()) {
+      std::allocator<T>().deallocate(data_, capacity_);
+      data_     = inline_data();
+      capacity_ = N;
     }
   }
 
-  void merge_associative(target_type& target, const to_merge_type& to_merge) {
-    for (const auto&[key, value] : to_merge) {
-      container_traits::any_push(target, key, value);
+  /// Move elements of other into empty this, stealing its heap storage if it has one
+  void take(small_vector&& other) {
+    if (other.is_inline()) {
+      for (size_type i = 0; i < other.size_; ++i) {
+        ::new (data_ + i) T(std::move(other.data_[i]));
+      }
+      size_ = other.size_;
+      other.clear();
+    } else {
+      data_           = other.data_;
+      size_           = other.size_;
+      capacity_       = other.capacity_;
+      other.data_     = other.inline_data();
+      other.size_     = 0;
+      other.capacity_ = N;
     }
   }
+
+  alignas(T) unsigned char inline_[N * sizeof(T)];
+  T*        data_     = inline_data();
+  size_type size_     = 0;
+  size_type capacity_ = N;
 };
 
 } // namespace query
 
 namespace query {
 /*!
- * Actually to rework...
+ * Reference to element of flat map: key and mapped value living in separate arrays.
+ * Behaves like `std::pair<const Key&, Value&>`, converts to pair and compares with pairs.
  */
-template <typename Comparator, typename T>
-class gate final {
-public:
-  using      value_type = T;
-  using comparator_type = Comparator;
-
-  static_assert(std::is_move_constructible_v<value_type>, "T requires to be move constructible");
-
-  constexpr explicit gate(comparator_type comparator, value_type left, value_type right) noexcept(std::is_nothrow_constructible_v<comparator_type>)
-    : comparator_   (std::forward<Comparator>(comparator))
-    , left_         (std::move(left))
-    , right_        (std::move(right))
-    , logical_value_(comparator_(left_, right_)) {}
+template <typename Key, typename Value>
+struct flat_reference {
+  const Key& first;
+  Value&     second;
 
-  constexpr explicit gate(comparator_type comparator, value_type value) noexcept(std::is_nothrow_constructible_v<comparator_type>)
-    : comparator_   (std::forward<comparator_type>(comparator))
-    , left_         (std::move(value))
-    , right_        ()
-    , logical_value_(false) {}
+  template <typename First, typename Second>
+  operator std::pair<First, Second>() const {
+    return { first, second };
+  }
 
-  constexpr explicit operator bool() const noexcept(is_noexcept_comparator_) {
-    return logical_value_;
+  template <typename OtherValue>
+  friend bool operator==(const flat_reference& lhs, const flat_reference<Key, OtherValue>& rhs) {
+    return lhs.first == rhs.first && lhs.second == rhs.second;
   }
 
-  constexpr bool operator &&(const gate& other) const noexcept(is_noexcept_comparator_) {
-    return logical_value_ && other.logical_value_;
+  template <typename OtherValue>
+  friend auto operator<=>(const flat_reference& lhs, const flat_reference<Key, OtherValue>& rhs) {
+    return std::tie(lhs.first, lhs.second) <=> std::tie(rhs.first, rhs.second);
   }
 
-  constexpr bool operator ||(const gate& other) const noexcept(is_noexcept_comparator_) {
-    return logical_value_ || other.logical_value_;
+  template <typename First, typename Second>
+  friend bool operator==(const flat_reference& lhs, const std::pair<First, Second>& rhs) {
+    return lhs.first == rhs.first && lhs.second == rhs.second;
   }
 
-  constexpr bool compare_with(const T& value) const noexcept(is_noexcept_comparator_) {
-    return comparator_(value, left_);
+  template <typename First, typename Second>
+  friend auto operator<=>(const flat_reference& lhs, const std::pair<First, Second>& rhs) {
+    return std::tie(lhs.first, lhs.second) <=> std::tie(rhs.first, rhs.second);
   }
+};
+
+/*!
+ * Random access iterator over flat map yielding `flat_reference` by value.
+ */
+template <typename Key, typename Value>
+class flat_iterator final {
+public:
+  using iterator_category = std::random_access_iterator_tag;
+  using iterator_concept  = std::random_access_iterator_tag;
+  using value_type        = std::pair<const Key, std::remove_const_t<Value>>;
+  using difference_type   = ptrdiff_t;
+  using reference         = flat_reference<Key, Value>;
+
+  /// operator-> needs an address, so reference is kept alive by proxy
+  struct pointer {
+    reference element;
+    const reference* operator->() const noexcept { return &element; }
+  };
+
+  flat_iterator() noexcept = default;
+  flat_iterator(const Key* key, Value* value) noexcept : key_(key), value_(value) {}
+
+  /// Mutable iterator converts to const one
+  template <typename Other>
+    requires (std::is_same_v<const Other, Value> && !std::is_same_v<Other, Value>)
+  flat_iterator(const flat_iterator<Key, Other>& other) noexcept : key_(other.key()), value_(other.value()) {}
+
+  reference operator* () const noexcept { return { *key_, *value_ }; }
+  pointer   operator->() const noexcept { return { **this }; }
+  reference operator[](difference_type n) const noexcept { return { key_[n], value_[n] }; }
+
+  flat_iterator& operator++() noexcept { ++key_; ++value_; return *this; }
+  flat_iterator& operator--() noexcept { --key_; --value_; return *this; }
+  flat_iterator  operator++(int) noexcept { flat_iterator old = *this; ++*this; return old; }
+  flat_iterator  operator--(int) noexcept { flat_iterator old = *this; --*this; return old; }
+  flat_iterator& operator+=(difference_type n) noexcept { key_ += n; value_ += n; return *this; }
+  flat_iterator& operator-=(difference_type n) noexcept { key_ -= n; value_ -= n; return *this; }
+
+  friend flat_iterator operator+(flat_iterator it, difference_type n) noexcept { return it += n; }
+  friend flat_iterator operator+(difference_type n, flat_iterator it) noexcept { return it += n; }
+  friend flat_iterator operator-(flat_iterator it, difference_type n) noexcept { return it -= n; }
+  friend difference_type operator-(const flat_iterator& lhs, const flat_iterator& rhs) noexcept { return lhs.key_ - rhs.key_; }
+
+  friend bool operator== (const flat_iterator& lhs, const flat_iterator& rhs) noexcept { return lhs.key_ ==  rhs.key_; }
+  friend auto operator<=>(const flat_iterator& lhs, const flat_iterator& rhs) noexcept { return lhs.key_ <=> rhs.key_; }
+
+  const Key* key()   const noexcept { return key_; }
+  Value*     value() const noexcept { return value_; }
 
 private:
-  static constexpr bool is_noexcept_comparator_ = noexcept(comparator_type()(std::declval<T>(), std::declval<T>()));
-  const comparator_type comparator_;
-  const T               left_;
-  const T               right_;
-  bool                  logical_value_;
+  const Key* key_   = nullptr;
+  Value*     value_ = nullptr;
 };
 
-} // namespace query
-
-namespace query {
 /*!
- * Implementation of something similar to SELECT from SQL.
+ * Sorted associative container keeping keys and mapped values in two contiguous arrays,
+ * so scans over keys or values are sequential and entries cost no node allocation.
+ * Ranges are inserted in bulk: appended, sorted and merged with existing entries once.
+ * Duplicate keys are dropped unless Multi, keeping the earliest inserted entry like std::map.
+ * Iterators yield `flat_reference` proxies and are invalidated by insertion and erasure.
  */
-template <typename Buffer>
-class where final {
+template <typename Key, typename Value, bool Multi>
+class basic_flat_map final {
 public:
-  using buffer_type = Buffer;
+  using key_type        = Key;
+  using mapped_type     = Value;
+  using value_type      = std::pair<const Key, Value>;
+  using key_compare     = std::less<Key>;
+  using size_type       = size_t;
+  using difference_type = ptrdiff_t;
+  using reference       = flat_reference<Key, Value>;
+  using const_reference = flat_reference<Key, const Value>;
+  using iterator        = flat_iterator<Key, Value>;
+  using const_iterator  = flat_iterator<Key, const Value>;
+  /// Unsorted entries collected before bulk insertion
+  using staging_type    = std::vector<std::pair<Key, Value>>;
 
-  static_assert(
-    container_traits::is_sequence_container   <buffer_type>::value ||
-    container_traits::is_associative_container<buffer_type>::value  ,
-    "Both sequence or associative containers expected");
+  basic_flat_map() = default;
+
+  basic_flat_map(std::initializer_list<std::pair<Key, Value>> entries) {
+    insert(entries.begin(), entries.end());
+  }
 
-  enum struct select_policy { by_key, by_value, none };
+  template <typename Iterator>
+  basic_flat_map(Iterator first, Iterator last) {
+    insert(first, last);
+  }
+
+  iterator        begin()       noexcept { return { keys_.data(), values_.data() }; }
+  iterator        end  ()       noexcept { return { keys_.data() + keys_.size(), values_.data() + values_.size() }; }
+  const_iterator  begin() const noexcept { return { keys_.data(), values_.data() }; }
+  const_iterator  end  () const noexcept { return { keys_.data() + keys_.size(), values_.data() + values_.size() }; }
+  const_iterator cbegin() const noexcept { return begin(); }
+  const_iterator cend  () const noexcept { return end(); }
 
-  explicit where(buffer_type& buffer, ssize_t to_take) : buffer_(buffer), to_take_(to_take) {}
+  size_type size () const noexcept { return keys_.size(); }
+  bool      empty() const noexcept { return keys_.empty(); }
 
-  template <typename Gate>
-  void by_gate(const Gate& logical_gate) {
-    where_sequence([&](const auto& element) { return logical_gate.compare_with(element); });
+  std::span<const Key>   keys()   const noexcept { return keys_; }
+  std::span<const Value> values() const noexcept { return values_; }
+
+  void reserve(size_type capacity) {
+    keys_.reserve(capacity);
+    values_.reserve(capacity);
   }
 
-  template <typename Field, typename Gate>
-  void by_gate(Field field, const Gate& logical_gate) {
-    where_sequence([&](const auto& element) { return logical_gate.compare_with(element.*field); });
+  void clear() noexcept {
+    keys_.clear();
+    values_.clear();
   }
 
-  template <typename Lambda>
-  void by_lambda(Lambda lambda) {
-    where_sequence([&](const auto& element) { return lambda(element); });
+  /*!
+   * Insert one entry. Appending in key order is O(1), otherwise entries after it are shifted.
+   * @return position of entry with the key and whether entry was inserted
+   */
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Args&&... args) {
+    std::pair<Key, Value> entry(std::forward<Args>(args)...);
+    size_type position = keys_.size();
+    if (!keys_.empty() && entry.first < keys_.back()) {
+      position = Multi ? upper_index(entry.first) : lower_index(entry.first);
+    } else if (!Multi && !keys_.empty() && !(keys_.back() < entry.first)) {
+      position = keys_.size() - 1;
+    }
+    if (!Multi && position < keys_.size() && !(entry.first < keys_[position])) {
+      return { begin() + position, false };
+    }
+    keys_.insert(keys_.begin() + position, std::move(entry.first));
+    values_.insert(values_.begin() + position, std::move(entry.second));
+    return { begin() + position, true };
   }
 
-  template <typename Field, typename Lambda>
-  void by_lambda(Field field, Lambda lambda) {
-    where_sequence([&](const auto& element) { return lambda(element.*field); });
+  template <typename Entry>
+    requires (!std::input_or_output_iterator<std::remove_cvref_t<Entry>>)
+  iterator insert(const_iterator, Entry&& entry) {
+    return emplace(std::forward<Entry>(entry)).first;
   }
 
-  template <typename Gate>
-  void by_gate(enum select_policy policy, const Gate& logical_gate) {
-    where_associative([&](const auto& key, const auto& value) {
-      return logical_gate.compare_with((policy == select_policy::by_key) ? key : value);
-    });
+  template <typename Entry>
+  std::pair<iterator, bool> insert(Entry&& entry) {
+    return emplace(std::forward<Entry>(entry));
   }
 
-  template <typename Field, typename Gate>
-  void by_gate(enum select_policy policy, Field field, const Gate& logical_gate) {
-    where_associative([&](const auto& key, const auto& value) {
-      return logical_gate.compare_with((policy == select_policy::by_key) ? key.*field : value.*field);
-    });
+  /*!
+   * Bulk insertion: entries are appended, new ones sorted by key and merged with old ones.
+   */
+  template <typename Iterator>
+  void insert(Iterator first, Iterator last) {
+    const size_type old_size = keys_.size();
+    for (; first != last; ++first) {
+      std::pair<Key, Value> entry(*first);
+      keys_.push_back(std::move(entry.first));
+      values_.push_back(std::move(entry.second));
+    }
+    normalize(old_size);
   }
 
-  template <typename Lambda>
-  void by_lambda(enum select_policy policy, Lambda lambda) {
-    where_associative([&](const auto& key, const auto& value) {
-      return (policy == select_policy::by_key) ? lambda(key) : lambda(value);
-    });
+  iterator find(const Key& key) {
+    const size_type position = lower_index(key);
+    return position < size() && !(key < keys_[position]) ? begin() + position : end();
   }
 
-  template <typename Field, typename Lambda>
-  void by_lambda(enum select_policy policy, Field field, Lambda lambda) {
-    where_associative([&](const auto& key, const auto& value) {
-      return (policy == select_policy::by_key) ? lambda(key.*field) : lambda(value.*field);
-    });
+  const_iterator find(const Key& key) const {
+    const size_type position = lower_index(key);
+    return position < size() && !(key < keys_[position]) ? begin() + position : end();
   }
 
-private:
-  template <typename Comparator>
-  void where_sequence(Comparator comparator) {
-    Buffer new_buffer;
-    ssize_t total_found = 0;
-    for (const auto& element : buffer_) {
-      if (total_found == to_take_) {
-        break;
-      }
-      if (comparator(element)) {
-        container_traits::any_push(new_buffer, element);
-        ++total_found;
-      }
+  size_type count(const Key& key) const {
+    return upper_index(key) - lower_index(key);
+  }
+
+  bool contains(const Key& key) const {
+    return find(key) != end();
+  }
+
+  iterator       lower_bound(const Key& key)       { return begin() + lower_index(key); }
+  const_iterator lower_bound(const Key& key) const { return begin() + lower_index(key); }
+  iterator       upper_bound(const Key& key)       { return begin() + upper_index(key); }
+  const_iterator upper_bound(const Key& key) const { return begin() + upper_index(key); }
+
+  std::pair<iterator, iterator> equal_range(const Key& key) {
+    return { lower_bound(key), upper_bound(key) };
+  }
+
+  std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+    return { lower_bound(key), upper_bound(key) };
+  }
+
+  Value& operator[](const Key& key) requires (!Multi) {
+    return (*emplace(key, Value{}).first).second;
+  }
+
+  Value& at(const Key& key) requires (!Multi) {
+    const auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("basic_flat_map::at");
     }
-    buffer_ = std::move(new_buffer);
+    return (*it).second;
   }
 
-  template <typename Comparator>
-  void where_associative(Comparator comparator) {
-    Buffer new_buffer;
-    ssize_t total_found = 0;
-    for (const auto&[key, value] : buffer_) {
-      if (total_found == to_take_) {
-        break;
-      }
-      if (comparator(key, value)) {
-        container_traits::any_push(new_buffer, key, value);
-        ++total_found;
-      }
+  const Value& at(const Key& key) const requires (!Multi) {
+    const auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("basic_flat_map::at");
     }
-    buffer_ = std::move(new_buffer);
+    return (*it).second;
   }
 
-  buffer_type& buffer_;
-  ssize_t      to_take_;
-};
+  iterator erase(const_iterator first, const_iterator last) {
+    const auto from = first.key() - keys_.data();
+    const auto to   = last.key()  - keys_.data();
+    keys_.erase(keys_.begin() + from, keys_.begin() + to);
+    values_.erase(values_.begin() + from, values_.begin() + to);
+    return begin() + from;
+  }
 
-} // namespace query
+  iterator erase(const_iterator position) {
+    return erase(position, position + 1);
+  }
+
+  bool operator==(const basic_flat_map& other) const {
+    return keys_ == other.keys_ && values_ == other.values_;
+  }
+
+private:
+  size_type lower_index(const Key& key) const {
+    return std::lower_bound(keys_.begin(), keys_.end(), key) - keys_.begin();
+  }
+
+  size_type upper_index(const Key& key) const {
+    return std::upper_bound(keys_.begin(), keys_.end(), key) - keys_.begin();
+  }
+
+  /*!
+   * Restore order after entries were appended past sorted prefix of given size:
+   * appended entries are stable sorted by key through a permutation and merged after
+   * old ones on equal keys, then duplicates after the first are dropped unless Multi.
+   */
+  void normalize(size_type sorted_size) {
+    const size_type total = keys_.size();
+    const auto less = [this](size_type lhs, size_type rhs) { return keys_[lhs] < keys_[rhs]; };
+    bool ordered = true;
+    for (size_type i = std::max<size_type>(sorted_size, 1); i < total && ordered; ++i) {
+      ordered = Multi ? !(keys_[i] < keys_[i - 1]) : keys_[i - 1] < keys_[i];
+    }
+    if (ordered) {
+      return;
+    }
+    std::vector<size_type> order(total);
+    for (size_type i = 0; i < total; ++i) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin() + sorted_size, order.end(), less);
+    std::inplace_merge(order.begin(), order.begin() + sorted_size, order.end(), less);
+    std::vector<Key>   keys;
+    std::vector<Value> values;
+    keys.reserve(total);
+    values.reserve(total);
+    for (const size_type i : order) {
+      if (!Multi && !keys.empty() && !(keys.back() < keys_[i])) {
+        continue;
+      }
+      keys.push_back(std::move(keys_[i]));
+      values.push_back(std::move(values_[i]));
+    }
+    keys_   = std::move(keys);
+    values_ = std::move(values);
+  }
+
+  std::vector<Key>   keys_;
+  std::vector<Value> values_;
+};
+
+template <typename Key, typename Value>
+using flat_map = basic_flat_map<Key, Value, false>;
+
+template <typename Key, typename Value>
+using flat_multimap = basic_flat_map<Key, Value, true>;
+
+} // namespace query
 
 namespace query {
+namespace format {
 /*!
- * Set operation implementation (union, intersect, difference)
- * \todo Make something with insert iterators
+ * Normalize element to a type accepted by std::to_chars.
+ * Small integers and bool are printed as numbers, like std::to_string does.
  */
-template <typename Buffer>
-class set_operation final {
-public:
-  using buffer_type = Buffer;
+template <typename T>
+constexpr auto printable(T value) noexcept {
+  if constexpr (std::is_same_v<T, bool> || sizeof(T) < sizeof(int)) {
+    return static_cast<int>(value);
+  } else {
+    return value;
+  }
+}
 
-  explicit set_operation(buffer_type& buffer) : buffer_(buffer) {}
+template <typename T>
+constexpr size_t integral_length(T value) noexcept {
+  using unsigned_type = std::make_unsigned_t<T>;
+  size_t        length    = 1;
+  unsigned_type magnitude = static_cast<unsigned_type>(value);
+  if constexpr (std::is_signed_v<T>) {
+    if (value < 0) {
+      magnitude = unsigned_type(0) - magnitude;
+      ++length;
+    }
+  }
+  for (; magnitude >= 100; magnitude /= 100) {
+    length += 2;
+  }
+  return length + (magnitude >= 10);
+}
 
-  static_assert(
-    container_traits::is_sequence_container   <buffer_type>::value ||
-    container_traits::is_associative_container<buffer_type>::value,
-    "Both sequence or associative containers expected"
-  );
+/*!
+ * Exact text length for integers and strings, upper bound for floating point
+ */
+template <typename T>
+constexpr size_t length(const T& element) noexcept {
+  if constexpr (std::is_integral_v<T>) {
+    return integral_length(printable(element));
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return 32;
+  } else {
+    return std::string_view(element).size();
+  }
+}
 
-  template <typename Target>
-  void union_with(const Target& with) {
-    buffer_type new_buffer;
-    std::set_union(buffer_.begin(), buffer_.end(), with.begin(), with.end(), std::inserter(new_buffer, new_buffer.end()));
-    buffer_ = std::move(new_buffer);
+/*!
+ * Append textual representation of element to output.
+ * @tparam Output type with `append(const char*, size_t)`
+ */
+template <typename Output, typename T>
+void append(Output& output, const T& element) {
+  if constexpr (std::is_arithmetic_v<T>) {
+    char buffer[64];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), printable(element));
+    output.append(buffer, static_cast<size_t>(result.ptr - buffer));
+  } else {
+    const std::string_view view(element);
+    output.append(view.data(), view.size());
   }
+}
 
-  template <typename Target>
-  void intersect_with(const Target& with) {
-    buffer_type new_buffer;
-    std::set_intersection(buffer_.begin(), buffer_.end(), with.begin(), with.end(),  std::inserter(new_buffer, new_buffer.end()));
-    buffer_ = std::move(new_buffer);
+/*!
+ * Fixed-size staging buffer in front of a sink, so sink is called once per chunk
+ * instead of once per element. Last chunk is written by explicit `flush()`, destructor
+ * never calls the sink, since a throwing sink must not run during unwinding.
+ * @tparam Sink either std::ostream or callable with `std::string_view`
+ */
+template <typename Sink, size_t ChunkSize = 4096>
+class chunked_writer final {
+public:
+  explicit chunked_writer(Sink& sink) noexcept : sink_(sink), used_(0) {}
+
+  chunked_writer(const chunked_writer&) = delete;
+  chunked_writer& operator=(const chunked_writer&) = delete;
+
+  void append(const char* data, size_t size) {
+    if (used_ + size > ChunkSize) {
+      flush();
+      if (size > ChunkSize) {
+        emit(data, size);
+        return;
+      }
+    }
+    std::copy(data, data + size, chunk_ + used_);
+    used_ += size;
   }
 
-  template <typename Target>
-  void difference_with(const Target& with) {
-    buffer_type new_buffer;
-    std::set_difference(buffer_.begin(), buffer_.end(), with.begin(), with.end(),  std::inserter(new_buffer, new_buffer.end()));
-    buffer_ = std::move(new_buffer);
+  void flush() {
+    if (used_ > 0) {
+      emit(chunk_, used_);
+      used_ = 0;
+    }
   }
 
 private:
-  buffer_type& buffer_;
+  void emit(const char* data, size_t size) {
+    if constexpr (std::is_base_of_v<std::ostream, Sink>) {
+      sink_.write(data, static_cast<std::streamsize>(size));
+    } else {
+      sink_(std::string_view(data, size));
+    }
+  }
+
+  Sink&  sink_;
+  size_t used_;
+  char   chunk_[ChunkSize];
 };
 
-} // namespace query
+}// namespace format
+}// namespace query
 
 namespace query {
 /*!
- * Numeric operations (min, max, sum) implementation
+ * Container cast implemented on next type categories:
+ *    Sequence ->    Sequence
+ *    Sequence ->      String
+ * Associative ->      String
+ * Associative -> Associative
+ * Associative ->    Sequence
  */
-template <typename Buffer>
-class numeric final {
+template <typename From, typename To>
+class cast final {
 public:
-  using buffer_type = Buffer;
-  using  value_type = typename Buffer::value_type;
+  using from_type = From;
+  using   to_type = To;
 
   static_assert(
-    container_traits::is_sequence_container<buffer_type>::value ||
-    container_traits::is_basic_string      <buffer_type>::value ,
-    "Sequence container or string expected"
-  );
+    container_traits::is_sequence_container   <from_type>::value ||
+    container_traits::is_associative_container<from_type>::value  ,
+    "Source type is not container");
+  static_assert(
+    container_traits::is_sequence_container   <to_type>::value   ||
+    container_traits::is_associative_container<to_type>::value   ||
+    container_traits::is_basic_string         <to_type>::value    ,
+    "Target type is neither container nor string");
 
-  explicit numeric(const buffer_type& buffer) : buffer_(buffer) {}
+  to_type operator()(const from_type& from)
+    requires (
+      container_traits::is_sequence_container<from_type>::value &&
+      container_traits::is_sequence_container<  to_type>::value &&
+     !container_traits::is_basic_string      <  to_type>::value
+    ) || (
+      container_traits::is_associative_container<from_type>::value &&
+      container_traits::is_associative_container<  to_type>::value &&
+     !container_traits::is_basic_string         <  to_type>::value )
+  { return same_to_same(from); }
 
-  value_type min() requires (container_traits::has_three_way_comparator<value_type>::value) {
-    value_type min = *buffer_.begin();
-    for (const auto& element : buffer_) {
-      if (element < min) {
-        min = element;
-      }
+  /// Source is expiring: elements are moved instead of copied
+  to_type operator()(from_type&& from)
+    requires (
+      container_traits::is_sequence_container<from_type>::value &&
+      container_traits::is_sequence_container<  to_type>::value &&
+     !container_traits::is_basic_string      <  to_type>::value
+    ) || (
+      container_traits::is_associative_container<from_type>::value &&
+      container_traits::is_associative_container<  to_type>::value &&
+     !container_traits::is_basic_string         <  to_type>::value )
+  { return same_to_same(std::move(from)); }
+
+  to_type operator()(const from_type& from)
+    requires (
+      container_traits::is_sequence_container<from_type>::value &&
+      container_traits::is_basic_string      <  to_type>::value )
+  { return seq_to_string(from); }
+
+  to_type operator()(const from_type& from)
+    requires (
+      container_traits::is_associative_container<from_type>::value &&
+      container_traits::is_sequence_container   <  to_type>::value &&
+     !container_traits::is_basic_string         <  to_type>::value )
+  { return ass_to_seq(from); }
+
+  to_type operator()(const from_type& from)
+    requires (
+      container_traits::is_associative_container<from_type>::value &&
+      container_traits::is_basic_string         <  to_type>::value )
+  { return ass_to_string(from); }
+
+  /*!
+   * Render same text as string conversion straight into sink, without building the whole string.
+   * @param sink std::ostream or callable with `std::string_view`, receives text in chunks
+   */
+  template <typename Sink>
+  static void write(const from_type& from, Sink& sink) {
+    cast caster;
+    format::chunked_writer<Sink> writer(sink);
+    if constexpr (container_traits::is_associative_container<from_type>::value) {
+      caster.ass_to_text(from, writer);
+    } else {
+      caster.seq_to_text(from, writer);
     }
-    return min;
+    writer.flush();
   }
 
-  value_type max() requires (container_traits::has_three_way_comparator<value_type>::value) {
-    value_type min = *buffer_.begin();
-    for (const auto& element : buffer_) {
-      if (element > min) {
-        min = element;
+private:
+  to_type same_to_same(const from_type& sequence) {
+    return {std::begin(sequence), std::end(sequence)};
+  }
+
+  to_type same_to_same(from_type&& sequence) {
+    if constexpr (std::is_same_v<from_type, to_type>) {
+      return std::move(sequence);
+    } else {
+      return {std::make_move_iterator(std::begin(sequence)), std::make_move_iterator(std::end(sequence))};
+    }
+  }
+
+  auto seq_to_string(const from_type& sequence) {
+    size_t length = 0;
+    for (const auto& element : sequence) {
+      length += format::length(element) + 1;
+    }
+    std::string result;
+    result.reserve(length);
+    seq_to_text(sequence, result);
+    return result;
+  }
+
+  template <typename Output>
+  void seq_to_text(const from_type& sequence, Output& output) {
+    bool first = true;
+    for (const auto& element : sequence) {
+      if (!first) {
+        output.append(" ", 1);
       }
+      format::append(output, element);
+      first = false;
     }
-    return min;
   }
 
-  value_type sum() requires (container_traits::has_plus_operator<value_type>::value) {
-    value_type sum;
-    for (const auto& element : buffer_) {
-      sum = sum + element;
+  to_type ass_to_seq(const from_type& associative) {
+    to_type result;
+    for (auto&&[k, v] : associative) {
+      container_traits::any_push(result, k);
+      container_traits::any_push(result, v);
     }
-    return sum;
+    return result;
   }
 
-private:
-  const buffer_type& buffer_;
+  auto ass_to_string(const from_type& associative) {
+    size_t length = 0;
+    for (const auto&[k, v] : associative) {
+      length += format::length(k) + format::length(v) + 4;
+    }
+    std::string result;
+    result.reserve(length);
+    ass_to_text(associative, result);
+    return result;
+  }
+
+  template <typename Output>
+  void ass_to_text(const from_type& associative, Output& output) {
+    for (const auto&[k, v] : associative) {
+      output.append("(", 1);
+      format::append(output, k);
+      output.append(", ", 2);
+      format::append(output, v);
+      output.append(")", 1);
+    }
+  }
 };
 
 } // namespace query
 
 namespace query {
 /*!
- * Ordering operations implementation (sort, reverse sort, reverse)
+ * Container merge implemented on next type categories:
+ *    Sequence ->    Sequence
+ * Associative -> Associative
  */
-template <typename Buffer, typename T = typename Buffer::value_type>
-  requires
-    (std::is_same_v<Buffer, std::vector      <T>>) ||
-    (std::is_same_v<Buffer, std::deque       <T>>) ||
-    (std::is_same_v<Buffer, std::list        <T>>) ||
-    (std::is_same_v<Buffer, std::forward_list<T>>) ||
-    (std::is_same_v<Buffer, std::set         <T>>) ||
-    (std::is_same_v<Buffer, std::multiset    <T>>)
-class order final {
+template <typename Target, typename ToMerge>
+class merge final {
 public:
-  using buffer_type = Buffer;
+  using   target_type = Target;
+  using to_merge_type = ToMerge;
+
+  static_assert(
+    (
+      container_traits::is_sequence_container<  target_type>::value &&
+      container_traits::is_sequence_container<to_merge_type>::value
+    ) || (
+      container_traits::is_associative_container<  target_type>::value &&
+      container_traits::is_associative_container<to_merge_type>::value
+    ),
+    "Both sequence or associative containers expected"
+  );
+
+  void operator()(target_type& target, const to_merge_type& to_merge)
+    requires (
+      container_traits::is_sequence_container<  target_type>::value &&
+      container_traits::is_sequence_container<to_merge_type>::value )
+  { merge_sequence(target, to_merge); }
+
+  void operator()(target_type& target, const to_merge_type& to_merge)
+    requires (
+      container_traits::is_associative_container<  target_type>::value &&
+      container_traits::is_associative_container<to_merge_type>::value )
+  { merge_associative(target, to_merge); }
+
+  /// Source is expiring: elements (mapped values for associative containers) are moved
+  void operator()(target_type& target, to_merge_type&& to_merge)
+    requires (
+      container_traits::is_sequence_container<  target_type>::value &&
+      container_traits::is_sequence_container<to_merge_type>::value )
+  { merge_sequence(target, std::move(to_merge)); }
+
+  void operator()(target_type& target, to_merge_type&& to_merge)
+    requires (
+      container_traits::is_associative_container<  target_type>::value &&
+      container_traits::is_associative_container<to_merge_type>::value )
+  { merge_associative(target, std::move(to_merge)); }
+
+private:
+  void merge_sequence(target_type& target, const to_merge_type& to_merge) {
+    for (const auto& value : to_merge) {
+      container_traits::any_push(target, value);
+    }
+  }
+
+  void merge_associative(target_type& target, const to_merge_type& to_merge) {
+    if constexpr (container_traits::is_flat_associative<target_type>::value) {
+      // Bulk sort and merge instead of insertion of every entry into sorted arrays
+      target.insert(std::begin(to_merge), std::end(to_merge));
+      return;
+    }
+    for (const auto&[key, value] : to_merge) {
+      container_traits::any_push(target, key, value);
+    }
+  }
+
+  void merge_sequence(target_type& target, to_merge_type&& to_merge) {
+    if constexpr (std::is_same_v<target_type, to_merge_type> && requires { target.splice(target.end(), to_merge); }) {
+      // Nodes are relinked, nothing is allocated
+      target.splice(target.end(), to_merge);
+      return;
+    }
+    for (auto& value : to_merge) {
+      container_traits::any_push(target, std::move(value));
+    }
+  }
+
+  void merge_associative(target_type& target, to_merge_type&& to_merge) {
+    if constexpr (std::is_same_v<target_type, to_merge_type> && requires { target.merge(to_merge); }) {
+      // Nodes are relinked, keys already present stay in expiring source like with emplace
+      target.merge(to_merge);
+      return;
+    }
+    if constexpr (container_traits::is_flat_associative<target_type>::value) {
+      target.insert(std::make_move_iterator(std::begin(to_merge)), std::make_move_iterator(std::end(to_merge)));
+      return;
+    }
+    for (auto&&[key, value] : to_merge) {
+      container_traits::any_push(target, key, std::move(value));
+    }
+  }
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Actually to rework...
+ */
+template <typename Comparator, typename T>
+class gate final {
+public:
+  using      value_type = T;
+  using comparator_type = Comparator;
+
+  static_assert(std::is_move_constructible_v<value_type>, "T requires to be move constructible");
+
+  constexpr explicit gate(comparator_type comparator, value_type left, value_type right) noexcept(
+    is_nothrow_movable_ && is_noexcept_comparator_)
+    : comparator_   (std::forward<Comparator>(comparator))
+    , left_         (std::move(left))
+    , right_        (std::move(right))
+    , logical_value_(comparator_(left_, right_)) {}
+
+  constexpr explicit gate(comparator_type comparator, value_type value) noexcept(is_nothrow_movable_ && std::is_nothrow_default_constructible_v<T>)
+    : comparator_   (std::forward<comparator_type>(comparator))
+    , left_         (std::move(value))
+    , right_        ()
+    , logical_value_(false) {}
+
+  constexpr explicit operator bool() const noexcept(is_noexcept_comparator_) {
+    return logical_value_;
+  }
+
+  constexpr bool operator &&(const gate& other) const noexcept(is_noexcept_comparator_) {
+    return logical_value_ && other.logical_value_;
+  }
+
+  constexpr bool operator ||(const gate& other) const noexcept(is_noexcept_comparator_) {
+    return logical_value_ || other.logical_value_;
+  }
+
+  constexpr bool compare_with(const T& value) const noexcept(is_noexcept_comparator_) {
+    return comparator_(value, left_);
+  }
+
+  /*!
+   * Compare value of other type without converting it to T, e.g. `std::string` with a set of strings.
+   */
+  template <typename U>
+    requires (!std::is_convertible_v<const U&, const T&> && std::is_invocable_r_v<bool, const comparator_type&, const U&, const T&>)
+  constexpr bool compare_with(const U& value) const noexcept(std::is_nothrow_invocable_v<const comparator_type&, const U&, const T&>) {
+    return comparator_(value, left_);
+  }
+
+  constexpr const T& value() const noexcept {
+    return left_;
+  }
+
+private:
+  /// False rather than ill-formed for comparators that are not default constructible or compare T with other type
+  static constexpr bool is_noexcept_comparator_ = std::is_nothrow_invocable_v<const comparator_type&, const T&, const T&>;
+  static constexpr bool is_nothrow_movable_     = std::is_nothrow_move_constructible_v<comparator_type> &&
+                                                  std::is_nothrow_move_constructible_v<T>;
+  const comparator_type comparator_;
+  const T               left_;
+  const T               right_;
+  bool                  logical_value_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Decision of a selector about scanned element.
+ */
+enum struct selection { keep, skip, stop };
+
+/// Result of selecting one batch: number of rows left in selection vector and whether scan ends
+struct batch_selection {
+  size_t count;
+  bool   stop;
+};
+
+/*!
+ * Implementation of something similar to SELECT from SQL.
+ *
+ * `from` records where stages as selectors and drives its WherePolicy only through:
+ * - `WherePolicy(buffer_type& buffer)`, output buffer to append selected rows to
+ * - `bool append(Source&& source, Selector& selector)`, scan source element by element,
+ *   selector returns `selection` for each element; false if it stopped the scan
+ * - `bool append_batches(Source&& source, BatchSelector& selector, size_t batch_size)`, optional,
+ *   used by `batch()` scans, which run element by element without it; selector narrows
+ *   selection vector of row pointers and returns `batch_selection`
+ * - `void retain(Selector& selector)`, optional, filters the buffer in place; without it buffer is
+ *   rebuilt through `append`
+ */
+template <typename Buffer>
+class where final {
+public:
+  using buffer_type = Buffer;
+
+  static_assert(
+    container_traits::is_sequence_container   <buffer_type>::value ||
+    container_traits::is_associative_container<buffer_type>::value  ,
+    "Both sequence or associative containers expected");
+
+  explicit where(buffer_type& buffer) noexcept : buffer_(buffer) {}
+
+  /*!
+   * Append to buffer elements of source accepted by selector. Elements of expiring source are moved.
+   * @return false if selector stopped the scan
+   */
+  template <typename Source, typename Selector>
+  bool append(Source&& source, Selector& selector) {
+    if constexpr (!std::is_lvalue_reference_v<Source> && relinkable<std::remove_cvref_t<Source>>) {
+      return relink(source, selector);
+    }
+    return appending([&](auto& output) {
+      for (auto&& element : source) {
+        switch (selector(element)) {
+        case selection::keep:
+          if constexpr (std::is_lvalue_reference_v<Source>) {
+            container_traits::any_push(output, element);
+          } else {
+            container_traits::any_push(output, std::move(element));
+          }
+          break;
+        case selection::skip:
+          break;
+        case selection::stop:
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+
+  /*!
+   * Same as `append`, but source is selected in batches of rows: selector gets row pointers
+   * of a batch with selection vector of row numbers and narrows the selection in place,
+   * so every filter runs a tight loop over the whole batch.
+   */
+  template <typename Source, typename BatchSelector>
+  bool append_batches(Source&& source, BatchSelector& selector, size_t batch_size) {
+    using row_type = std::remove_reference_t<decltype(*std::begin(source))>;
+    std::vector<row_type*> rows;
+    std::vector<uint32_t>  selected(batch_size);
+    rows.reserve(batch_size);
+    return appending([&](auto& output) {
+      for (auto it = std::begin(source); it != std::end(source);) {
+        rows.clear();
+        for (; it != std::end(source) && rows.size() < batch_size; ++it) {
+          rows.push_back(&*it);
+        }
+        for (uint32_t row = 0; row < rows.size(); ++row) {
+          selected[row] = row;
+        }
+        const batch_selection batch = selector(rows.data(), selected.data(), rows.size());
+        for (size_t i = 0; i < batch.count; ++i) {
+          if constexpr (std::is_lvalue_reference_v<Source>) {
+            container_traits::any_push(output, *rows[selected[i]]);
+          } else {
+            container_traits::any_push(output, std::move(*rows[selected[i]]));
+          }
+        }
+        if (batch.stop) {
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+
+  /*!
+   * Remove from buffer elements not accepted by selector, and every element after selector
+   * stopped, without rebuilding it: node containers unlink nodes, contiguous ones compact.
+   */
+  template <typename Selector>
+    requires requires (buffer_type& buffer) { std::erase_if(buffer, [](const auto&) { return true; }); }
+  void retain(Selector& selector) {
+    bool stopped = false;
+    std::erase_if(buffer_, [&](const auto& element) {
+      if (stopped) {
+        return true;
+      }
+      switch (selector(element)) {
+      case selection::keep:
+        return false;
+      case selection::skip:
+        return true;
+      case selection::stop:
+        break;
+      }
+      stopped = true;
+      return true;
+    });
+  }
+
+private:
+  /// Nodes of expiring source of buffer type can be moved into buffer without allocation
+  template <typename Source>
+  static constexpr bool relinkable = std::is_same_v<Source, buffer_type> && (
+    requires (Source& source) { source.splice(source.end(), source, source.begin()); } ||
+    requires (Source& source) { source.insert(source.extract(source.begin())); });
+
+  /*!
+   * Append accepted elements of expiring source by moving their nodes: splice for lists,
+   * extract and insert of node handles for associative containers.
+   */
+  template <typename Source, typename Selector>
+  bool relink(Source& source, Selector& selector) {
+    for (auto it = source.begin(); it != source.end();) {
+      const auto next = std::next(it);
+      switch (selector(*it)) {
+      case selection::keep:
+        if constexpr (requires { source.splice(source.end(), source, it); }) {
+          buffer_.splice(buffer_.end(), source, it);
+        } else {
+          buffer_.insert(source.extract(it));
+        }
+        break;
+      case selection::skip:
+        break;
+      case selection::stop:
+        return false;
+      }
+      it = next;
+    }
+    return true;
+  }
+
+  /*!
+   * Run scan appending to output. Flat associative buffers get everything appended by
+   * scan in one bulk insertion instead of element-wise insertion into sorted arrays.
+   */
+  template <typename Scan>
+  bool appending(Scan scan) {
+    if constexpr (container_traits::is_flat_associative<buffer_type>::value) {
+      typename buffer_type::staging_type staged;
+      const bool completed = scan(staged);
+      buffer_.insert(std::make_move_iterator(staged.begin()), std::make_move_iterator(staged.end()));
+      return completed;
+    } else {
+      return scan(buffer_);
+    }
+  }
+
+  buffer_type& buffer_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Set operation implementation (union, intersect, difference)
+ * \todo Make something with insert iterators
+ */
+template <typename Buffer>
+class set_operation final {
+public:
+  using buffer_type = Buffer;
+
+  explicit set_operation(buffer_type& buffer) : buffer_(buffer) {}
+
+  static_assert(
+    container_traits::is_sequence_container   <buffer_type>::value ||
+    container_traits::is_associative_container<buffer_type>::value,
+    "Both sequence or associative containers expected"
+  );
+
+  template <typename Target>
+  void union_with(const Target& with) {
+    buffer_type new_buffer;
+    std::set_union(buffer_.begin(), buffer_.end(), with.begin(), with.end(), std::inserter(new_buffer, new_buffer.end()));
+    buffer_ = std::move(new_buffer);
+  }
+
+  template <typename Target>
+  void intersect_with(const Target& with) {
+    buffer_type new_buffer;
+    std::set_intersection(buffer_.begin(), buffer_.end(), with.begin(), with.end(),  std::inserter(new_buffer, new_buffer.end()));
+    buffer_ = std::move(new_buffer);
+  }
+
+  template <typename Target>
+  void difference_with(const Target& with) {
+    buffer_type new_buffer;
+    std::set_difference(buffer_.begin(), buffer_.end(), with.begin(), with.end(),  std::inserter(new_buffer, new_buffer.end()));
+    buffer_ = std::move(new_buffer);
+  }
+
+private:
+  buffer_type& buffer_;
+};
+
+} // namespace query
+
+namespace query {
+namespace detail {
+
+/// Finalizer of MurmurHash3, std::hash of integers is identity on common implementations
+inline uint64_t mix_hash(uint64_t hash) noexcept {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+} // namespace detail
+
+/*!
+ * Blocked Bloom filter. Every element sets one bit in each 64-bit word of a single
+ * cache-line sized block, so a probe touches one cache line and its eight word tests
+ * have no early exit and are vectorized by compiler.
+ *
+ * False negatives are impossible, so filter can reject elements before an exact
+ * set operation or be passed to where (`where(std::cref(filter))`) as a semi-join.
+ */
+template <typename T, typename Hash = std::hash<T>>
+class blocked_bloom_filter final {
+public:
+  using value_type = T;
+
+  /*!
+   * @param expected_elements number of elements to be inserted
+   * @param bits_per_element  memory spent per element, 10 bits give about 1% false positives
+   */
+  explicit blocked_bloom_filter(size_t expected_elements, size_t bits_per_element = 10)
+    : blocks_(std::max<size_t>(1, (expected_elements * bits_per_element + block_bits - 1) / block_bits)) {}
+
+  template <typename Range>
+  static blocked_bloom_filter of(const Range& range, size_t bits_per_element = 10) {
+    blocked_bloom_filter filter(std::distance(std::begin(range), std::end(range)), bits_per_element);
+    for (const auto& element : range) {
+      filter.insert(element);
+    }
+    return filter;
+  }
+
+  void insert(const value_type& element) noexcept {
+    const uint64_t hash = detail::mix_hash(Hash{}(element));
+    block& target = blocks_[block_index(hash)];
+    const block bits = mask(static_cast<uint32_t>(hash));
+    for (size_t i = 0; i < words; ++i) {
+      target.words[i] |= bits.words[i];
+    }
+  }
+
+  bool may_contain(const value_type& element) const noexcept {
+    const uint64_t hash = detail::mix_hash(Hash{}(element));
+    const block& target = blocks_[block_index(hash)];
+    const block bits = mask(static_cast<uint32_t>(hash));
+    uint64_t missing = 0;
+    for (size_t i = 0; i < words; ++i) {
+      missing |= bits.words[i] & ~target.words[i];
+    }
+    return missing == 0;
+  }
+
+  bool operator()(const value_type& element) const noexcept {
+    return may_contain(element);
+  }
+
+  size_t memory_bytes() const noexcept {
+    return blocks_.size() * sizeof(block);
+  }
+
+private:
+  static constexpr size_t words      = 8;
+  static constexpr size_t block_bits = words * 64;
+
+  struct alignas(64) block {
+    uint64_t words[blocked_bloom_filter::words] = {};
+  };
+
+  /// Odd multipliers picking independent bit positions from one 32-bit hash
+  static constexpr uint32_t salts[words] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+  };
+
+  size_t block_index(uint64_t hash) const noexcept {
+    return static_cast<size_t>(((hash >> 32) * blocks_.size()) >> 32);
+  }
+
+  static block mask(uint32_t hash) noexcept {
+    block bits;
+    for (size_t i = 0; i < words; ++i) {
+      bits.words[i] = uint64_t{1} << ((hash * salts[i]) >> 26);
+    }
+    return bits;
+  }
+
+  std::vector<block> blocks_;
+};
+
+/*!
+ * Set operation policy rejecting elements by blocked Bloom filter built on the smaller
+ * input before exact intersection or difference, for large inputs with few matches.
+ * Result is exactly the one of `set_operation`, including multiplicities.
+ * Falls back to `set_operation` on small inputs or unhashable elements.
+ */
+template <typename Buffer>
+class prefiltered_set_operation final {
+public:
+  using buffer_type = Buffer;
+  using  value_type = typename buffer_type::value_type;
+
+  /// Larger input size starting from which filter pays for its construction
+  static constexpr size_t min_prefilter_size = 4096;
+
+  explicit prefiltered_set_operation(buffer_type& buffer) : buffer_(buffer) {}
+
+  template <typename Target>
+  void union_with(const Target& with) {
+    set_operation<buffer_type>(buffer_).union_with(with);
+  }
+
+  template <typename Target>
+  void intersect_with(const Target& with) {
+    if (!prefilter<true>(with)) {
+      set_operation<buffer_type>(buffer_).intersect_with(with);
+    }
+  }
+
+  template <typename Target>
+  void difference_with(const Target& with) {
+    if (!prefilter<false>(with)) {
+      set_operation<buffer_type>(buffer_).difference_with(with);
+    }
+  }
+
+private:
+  template <typename Target>
+  static constexpr bool filterable =
+    std::is_same_v<std::remove_cv_t<typename Target::value_type>, std::remove_cv_t<value_type>> &&
+    requires (const value_type& element) { { std::hash<std::remove_cv_t<value_type>>{}(element) } -> std::convertible_to<size_t>; };
+
+  template <bool Intersect, typename Target>
+  bool prefilter(const Target& with) {
+    if constexpr (!filterable<Target>) {
+      return false;
+    } else {
+      using filter_type = blocked_bloom_filter<std::remove_cv_t<value_type>>;
+      const size_t buffer_size = std::distance(buffer_.begin(), buffer_.end());
+      const size_t   with_size = std::distance(with.begin(), with.end());
+      if (std::max(buffer_size, with_size) < min_prefilter_size) {
+        return false;
+      }
+      buffer_type new_buffer;
+      auto output = std::inserter(new_buffer, new_buffer.end());
+      if (with_size <= buffer_size) {
+        // Buffer elements rejected by filter are not in with, the rest is matched against
+        // with by a cursor, consuming one equivalent element per match like std::set_difference
+        const filter_type filter = filter_type::of(with);
+        auto cursor = with.begin();
+        for (auto& element : buffer_) {
+          bool matched = false;
+          if (filter.may_contain(element)) {
+            while (cursor != with.end() && *cursor < element) {
+              ++cursor;
+            }
+            matched = cursor != with.end() && !(element < *cursor);
+            if (matched) {
+              ++cursor;
+            }
+          }
+          if (matched == Intersect) {
+            *output = std::move(element);
+          }
+        }
+      } else {
+        // Elements of with not in buffer cannot affect result
+        const filter_type filter = filter_type::of(buffer_);
+        std::vector<std::remove_cv_t<value_type>> candidates;
+        std::copy_if(with.begin(), with.end(), std::back_inserter(candidates), std::cref(filter));
+        if constexpr (Intersect) {
+          std::set_intersection(buffer_.begin(), buffer_.end(), candidates.begin(), candidates.end(), output);
+        } else {
+          std::set_difference(buffer_.begin(), buffer_.end(), candidates.begin(), candidates.end(), output);
+        }
+      }
+      buffer_ = std::move(new_buffer);
+      return true;
+    }
+  }
+
+  buffer_type& buffer_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Execution hint for stages having parallel partitioned mode.
+ */
+struct parallel final {
+  size_t threads = std::max(1U, std::thread::hardware_concurrency());
+};
+
+/*!
+ * Open addressing hash set with linear probing over flat arrays of keys and
+ * one byte tags (7 hash bits, 0 for empty slot), so most mismatches are rejected
+ * without touching the key. Key has to be default constructible.
+ */
+template <typename Key, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class flat_hash_set final {
+public:
+  using key_type = Key;
+
+  explicit flat_hash_set(size_t expected_elements = 0) {
+    reserve(expected_elements);
+  }
+
+  static uint64_t hash(const key_type& key) noexcept(noexcept(Hash{}(key))) {
+    return detail::mix_hash(Hash{}(key));
+  }
+
+  /// @return true if key was not present
+  bool insert(const key_type& key) {
+    return insert(key, hash(key));
+  }
+
+  /// @param hash precomputed `hash(key)`
+  bool insert(const key_type& key, uint64_t hash) {
+    if ((size_ + 1) * 8 > tags_.size() * 7) {
+      rehash(std::max<size_t>(16, tags_.size() * 2));
+    }
+    return place(key, hash);
+  }
+
+  void reserve(size_t elements) {
+    size_t capacity = 16;
+    while (capacity * 7 < elements * 8) {
+      capacity *= 2;
+    }
+    if (capacity > tags_.size()) {
+      rehash(capacity);
+    }
+  }
+
+  bool contains(const key_type& key) const noexcept(noexcept(hash(key))) {
+    if (size_ == 0) {
+      return false;
+    }
+    const uint64_t hashed = hash(key);
+    const uint8_t  tag    = static_cast<uint8_t>(hashed >> 57) | 0x80;
+    const size_t   mask   = tags_.size() - 1;
+    for (size_t slot = hashed & mask; tags_[slot] != 0; slot = (slot + 1) & mask) {
+      if (tags_[slot] == tag && Equal{}(keys_[slot], key)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+
+private:
+  bool place(const key_type& key, uint64_t hash) {
+    const uint8_t tag  = static_cast<uint8_t>(hash >> 57) | 0x80;
+    const size_t  mask = tags_.size() - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      if (tags_[slot] == 0) {
+        tags_[slot] = tag;
+        keys_[slot] = key;
+        ++size_;
+        return true;
+      }
+      if (tags_[slot] == tag && Equal{}(keys_[slot], key)) {
+        return false;
+      }
+    }
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<uint8_t>  tags(capacity, 0);
+    std::vector<key_type> keys(capacity);
+    tags.swap(tags_);
+    keys.swap(keys_);
+    size_ = 0;
+    for (size_t slot = 0; slot < tags.size(); ++slot) {
+      if (tags[slot] != 0) {
+        place(keys[slot], hash(keys[slot]));
+      }
+    }
+  }
+
+  std::vector<uint8_t>  tags_;
+  std::vector<key_type> keys_;
+  size_t                size_ = 0;
+};
+
+namespace detail {
+
+template <typename Function>
+void run_parallel(size_t threads, Function function) {
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  for (size_t thread = 1; thread < threads; ++thread) {
+    workers.emplace_back(function, thread);
+  }
+  function(size_t{0});
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+/*!
+ * Partitioned distinct over rows: hashes are computed in parallel chunks, then every
+ * thread owns keys whose hash falls into its partition and inserts only those, in row
+ * order, into its own table. No table is shared, so no locking is needed.
+ * @param keep if not null, receives 1 for first occurrence of every key
+ * @return number of distinct keys
+ */
+template <typename Row, typename KeyOf>
+size_t partitioned_distinct(const std::vector<Row*>& rows, KeyOf key_of, size_t threads, std::vector<char>* keep) {
+  using key_type = std::remove_cvref_t<std::invoke_result_t<KeyOf&, Row&>>;
+  threads = std::max<size_t>(1, std::min(threads, rows.size() / 4096 + 1));
+  std::vector<uint64_t> hashes(rows.size());
+  if (keep != nullptr) {
+    keep->assign(rows.size(), 0);
+  }
+  const size_t chunk = (rows.size() + threads - 1) / threads;
+  run_parallel(threads, [&](size_t thread) {
+    const size_t end = std::min(rows.size(), (thread + 1) * chunk);
+    for (size_t row = thread * chunk; row < end; ++row) {
+      hashes[row] = flat_hash_set<key_type>::hash(key_of(*rows[row]));
+    }
+  });
+  std::vector<size_t> counts(threads, 0);
+  run_parallel(threads, [&](size_t thread) {
+    flat_hash_set<key_type> seen(rows.size() / threads);
+    for (size_t row = 0; row < rows.size(); ++row) {
+      // High bits pick partition, low bits pick slot inside table
+      if (((hashes[row] >> 32) * threads >> 32) != thread) {
+        continue;
+      }
+      if (seen.insert(key_of(*rows[row]), hashes[row]) && keep != nullptr) {
+        (*keep)[row] = 1;
+      }
+    }
+    counts[thread] = seen.size();
+  });
+  size_t result = 0;
+  for (const size_t count : counts) {
+    result += count;
+  }
+  return result;
+}
+
+/// Partition of hash, taken from its high bits as in `partitioned_distinct`
+inline size_t partition_of(uint64_t hash, size_t partitions) noexcept {
+  return static_cast<size_t>(((hash >> 32) * partitions) >> 32);
+}
+
+/// Partition of every row with per-chunk row counts, see `hash_partitions`
+struct partition_histogram {
+  std::vector<uint32_t>            partition;
+  /// Rows of every partition in every chunk of `chunk` consecutive rows
+  std::vector<std::vector<size_t>> chunks;
+  size_t                           chunk;
+
+  std::vector<size_t> sizes(size_t partitions) const {
+    std::vector<size_t> total(partitions, 0);
+    for (const auto& counts : chunks) {
+      for (size_t index = 0; index < partitions; ++index) {
+        total[index] += counts[index];
+      }
+    }
+    return total;
+  }
+};
+
+/*!
+ * Hash partition of every row by its key, computed in parallel chunks,
+ * each chunk counting its own histogram. Histograms are kept per chunk, so chunks
+ * can later scatter their own rows to precomputed offsets.
+ */
+template <typename Row, typename KeyOf>
+partition_histogram hash_partitions(const std::vector<Row*>& rows, KeyOf key_of, size_t partitions, size_t threads) {
+  using key_type = std::remove_cvref_t<std::invoke_result_t<KeyOf&, Row&>>;
+  threads = std::max<size_t>(1, std::min(threads, rows.size() / 4096 + 1));
+  partition_histogram result{
+    std::vector<uint32_t>(rows.size()),
+    std::vector<std::vector<size_t>>(threads, std::vector<size_t>(partitions, 0)),
+    (rows.size() + threads - 1) / threads
+  };
+  run_parallel(threads, [&](size_t thread) {
+    auto&        histogram = result.chunks[thread];
+    const size_t end       = std::min(rows.size(), (thread + 1) * result.chunk);
+    for (size_t row = thread * result.chunk; row < end; ++row) {
+      const size_t index = partition_of(flat_hash_set<key_type>::hash(key_of(*rows[row])), partitions);
+      result.partition[row] = static_cast<uint32_t>(index);
+      ++histogram[index];
+    }
+  });
+  return result;
+}
+
+} // namespace detail
+} // namespace query
+
+namespace query {
+namespace detail {
+
+/*!
+ * Position of needle in haystack or npos. Candidate positions are found by comparing
+ * first and last byte of needle with 32 (AVX2) or 16 (SSE2) haystack positions at once,
+ * and only candidates are verified by memcmp.
+ */
+inline size_t find_substring(std::string_view haystack, std::string_view needle) noexcept {
+  if (needle.empty()) {
+    return 0;
+  }
+  if (needle.size() > haystack.size()) {
+    return std::string_view::npos;
+  }
+  if (needle.size() == 1) {
+    return haystack.find(needle.front());
+  }
+  const char*  data = haystack.data();
+  const size_t last = needle.size() - 1;
+  const auto matches = [&](size_t position) {
+    return std::memcmp(data + position + 1, needle.data() + 1, last - 1) == 0;
+  };
+  size_t position = 0;
+#if defined(__AVX2__)
+  const __m256i first256 = _mm256_set1_epi8(needle.front());
+  const __m256i last256  = _mm256_set1_epi8(needle.back());
+  for (; position + last + 32 <= haystack.size(); position += 32) {
+    const __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + position));
+    const __m256i block_last  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + position + last));
+    uint32_t candidates = static_cast<uint32_t>(_mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first256), _mm256_cmpeq_epi8(block_last, last256))));
+    for (; candidates != 0; candidates &= candidates - 1) {
+      const size_t candidate = position + static_cast<size_t>(std::countr_zero(candidates));
+      if (matches(candidate)) {
+        return candidate;
+      }
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i first128 = _mm_set1_epi8(needle.front());
+  const __m128i last128  = _mm_set1_epi8(needle.back());
+  for (; position + last + 16 <= haystack.size(); position += 16) {
+    const __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + position));
+    const __m128i block_last  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + position + last));
+    uint32_t candidates = static_cast<uint32_t>(_mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(block_first, first128), _mm_cmpeq_epi8(block_last, last128))));
+    for (; candidates != 0; candidates &= candidates - 1) {
+      const size_t candidate = position + static_cast<size_t>(std::countr_zero(candidates));
+      if (matches(candidate)) {
+        return candidate;
+      }
+    }
+  }
+#endif
+  for (; position + last < haystack.size(); ++position) {
+    if (data[position] == needle.front() && data[position + last] == needle.back() && matches(position)) {
+      return position;
+    }
+  }
+  return std::string_view::npos;
+}
+
+constexpr char ascii_lower(char c) noexcept {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c;
+}
+
+/*!
+ * ASCII case-insensitive equality, 16 bytes at once with SSE2. Bytes outside ASCII compare exactly.
+ */
+inline bool equal_ignoring_case(std::string_view lhs, std::string_view rhs) noexcept {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  size_t position = 0;
+#if defined(__SSE2__)
+  // 'A'..'Z' shifted to the bottom of signed range, so one signed compare finds upper case
+  const __m128i shift = _mm_set1_epi8(static_cast<char>('A' + 128));
+  const __m128i bound = _mm_set1_epi8(static_cast<char>(-128 + 26));
+  const __m128i bit   = _mm_set1_epi8(0x20);
+  const auto lower = [&](__m128i block) {
+    const __m128i upper = _mm_cmplt_epi8(_mm_sub_epi8(block, shift), bound);
+    return _mm_or_si128(block, _mm_and_si128(upper, bit));
+  };
+  for (; position + 16 <= lhs.size(); position += 16) {
+    const __m128i left  = lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs.data() + position)));
+    const __m128i right = lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs.data() + position)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xffff) {
+      return false;
+    }
+  }
+#endif
+  for (; position < lhs.size(); ++position) {
+    if (ascii_lower(lhs[position]) != ascii_lower(rhs[position])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace detail
+
+/*!
+ * Set of strings for `in_set` gate. Lengths present in set are kept as a bitmask,
+ * so most misses are rejected before hashing.
+ */
+class string_set final {
+public:
+  string_set() = default;
+
+  template <typename Range>
+    requires std::convertible_to<std::ranges::range_reference_t<const Range&>, std::string_view>
+  explicit string_set(const Range& values) {
+    for (std::string_view value : values) {
+      insert(value);
+    }
+  }
+
+  explicit string_set(std::initializer_list<std::string_view> values) {
+    for (std::string_view value : values) {
+      insert(value);
+    }
+  }
+
+  /// Index of copy views own strings, not the ones of other
+  string_set(const string_set& other) : string_set(other.values_) {}
+
+  /// Moved deque keeps its strings in place, so index views stay valid
+  string_set(string_set&&) = default;
+
+  string_set& operator=(string_set other) noexcept {
+    values_.swap(other.values_);
+    std::swap(index_, other.index_);
+    std::swap(lengths_, other.lengths_);
+    return *this;
+  }
+
+  void insert(std::string_view value) {
+    if (contains(value)) {
+      return;
+    }
+    values_.emplace_back(value);
+    lengths_ |= length_bit(value.size());
+    index_.insert(values_.back());
+  }
+
+  bool contains(std::string_view value) const noexcept {
+    return (lengths_ & length_bit(value.size())) != 0 && index_.contains(value);
+  }
+
+  size_t size() const noexcept {
+    return values_.size();
+  }
+
+private:
+  /// Lengths of 63 and more share the last bit
+  static uint64_t length_bit(size_t length) noexcept {
+    return uint64_t{1} << std::min<size_t>(length, 63);
+  }
+
+  // Deque keeps strings in place, so views in index stay valid
+  std::deque<std::string>             values_;
+  flat_hash_set<std::string_view>     index_;
+  uint64_t                            lengths_ = 0;
+};
+
+/*!
+ * String comparators for `gate`: first argument is the checked value, second the gate parameter.
+ */
+namespace text {
+
+struct starts_with final {
+  bool operator()(std::string_view value, std::string_view prefix) const noexcept {
+    return value.size() >= prefix.size() && std::memcmp(value.data(), prefix.data(), prefix.size()) == 0;
+  }
+};
+
+struct ends_with final {
+  bool operator()(std::string_view value, std::string_view suffix) const noexcept {
+    return value.size() >= suffix.size() &&
+      std::memcmp(value.data() + value.size() - suffix.size(), suffix.data(), suffix.size()) == 0;
+  }
+};
+
+struct contains final {
+  bool operator()(std::string_view value, std::string_view part) const noexcept {
+    return detail::find_substring(value, part) != std::string_view::npos;
+  }
+};
+
+/// ASCII case-insensitive equality
+struct equals_ci final {
+  bool operator()(std::string_view value, std::string_view other) const noexcept {
+    return detail::equal_ignoring_case(value, other);
+  }
+};
+
+struct in_set final {
+  bool operator()(std::string_view value, const string_set& set) const noexcept {
+    return set.contains(value);
+  }
+};
+
+} // namespace text
+
+/*!
+ * String gates for `where`, e.g. `where(&human::name, query::starts_with("Mi"))`.
+ */
+inline gate<text::starts_with, std::string> starts_with(std::string prefix) {
+  return gate(text::starts_with{}, std::move(prefix));
+}
+
+inline gate<text::ends_with, std::string> ends_with(std::string suffix) {
+  return gate(text::ends_with{}, std::move(suffix));
+}
+
+inline gate<text::contains, std::string> contains(std::string part) {
+  return gate(text::contains{}, std::move(part));
+}
+
+inline gate<text::equals_ci, std::string> equals_ci(std::string other) {
+  return gate(text::equals_ci{}, std::move(other));
+}
+
+inline gate<text::in_set, string_set> in_set(std::initializer_list<std::string_view> values) {
+  return gate(text::in_set{}, string_set(values));
+}
+
+template <typename Range>
+gate<text::in_set, string_set> in_set(const Range& values) {
+  return gate(text::in_set{}, string_set(values));
+}
+
+} // namespace query
+
+namespace query {
+/*!
+ * Numeric operations (min, max, sum) implementation
+ */
+template <typename Buffer>
+class numeric final {
+public:
+  using buffer_type = Buffer;
+  using  value_type = typename Buffer::value_type;
+
+  static_assert(
+    container_traits::is_sequence_container<buffer_type>::value ||
+    container_traits::is_basic_string      <buffer_type>::value ,
+    "Sequence container or string expected"
+  );
+
+  explicit numeric(const buffer_type& buffer) : buffer_(buffer) {}
+
+  value_type min() requires (container_traits::has_three_way_comparator<value_type>::value || std::is_arithmetic_v<value_type>) {
+    value_type min = *buffer_.begin();
+    for (const auto& element : buffer_) {
+      if (element < min) {
+        min = element;
+      }
+    }
+    return min;
+  }
+
+  value_type max() requires (container_traits::has_three_way_comparator<value_type>::value || std::is_arithmetic_v<value_type>) {
+    value_type min = *buffer_.begin();
+    for (const auto& element : buffer_) {
+      if (element > min) {
+        min = element;
+      }
+    }
+    return min;
+  }
+
+  value_type sum() requires (container_traits::has_plus_operator<value_type>::value || std::is_arithmetic_v<value_type>) {
+    value_type sum{};
+    for (const auto& element : buffer_) {
+      sum = sum + element;
+    }
+    return sum;
+  }
+
+private:
+  const buffer_type& buffer_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Ordering operations implementation (sort, reverse sort, reverse)
+ */
+template <typename Buffer, typename T = typename Buffer::value_type>
+  requires
+    (std::is_same_v<Buffer, std::vector      <T>>) ||
+    (std::is_same_v<Buffer, std::deque       <T>>) ||
+    (std::is_same_v<Buffer, std::list        <T>>) ||
+    (std::is_same_v<Buffer, std::forward_list<T>>) ||
+    (std::is_same_v<Buffer, std::set         <T>>) ||
+    (std::is_same_v<Buffer, std::multiset    <T>>) ||
+    (container_traits::is_small_vector<Buffer>::value)
+class order final {
+public:
+  using buffer_type = Buffer;
+
+  class vector_deque_order final {
+  public:
+    explicit vector_deque_order(buffer_type& buffer) : buffer_(buffer) {}
+
+    void sort() {
+      std::sort(std::begin(buffer_), std::end(buffer_), [](const auto& lhs, const auto& rhs) { return lhs < rhs; });
+    }
+
+    void reverse_sort() {
+      std::sort(std::begin(buffer_), std::end(buffer_), [](const auto& lhs, const auto& rhs) { return lhs > rhs; });
+    }
+
+    void reverse() {
+      std::reverse(std::begin(buffer_), std::end(buffer_));
+    }
+
+  private:
+    buffer_type& buffer_;
+  };
+
+  class list_order final {
+  public:
+    explicit list_order(buffer_type& buffer) : buffer_(buffer) {}
+
+    void         sort() { buffer_.sort(); }
+    void reverse_sort() { buffer_.sort(); buffer_.reverse(); }
+    void reverse     () { buffer_.reverse(); }
+
+  private:
+    buffer_type& buffer_;
+  };
+
+public:
+  explicit order(buffer_type& buffer) : buffer_(buffer) {}
+
+  void sort()
+    requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque<T>> ||
+              container_traits::is_small_vector<Buffer>::value) {
+    vector_deque_order order(buffer_);
+    order.sort();
+  }
+
+  void sort() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
+    list_order order(buffer_);
+    order.sort();
+  }
+
+  void reverse_sort() requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque <T>> ||
+              container_traits::is_small_vector<Buffer>::value) {
+    vector_deque_order order(buffer_);
+    order.reverse_sort();
+  }
+
+  void reverse_sort() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
+    list_order order(buffer_);
+    order.reverse_sort();
+  }
+
+  void reverse() requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque <T>> ||
+              container_traits::is_small_vector<Buffer>::value) {
+    vector_deque_order order(buffer_);
+    order.reverse();
+  }
+
+  void reverse() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
+    list_order order(buffer_);
+    order.reverse();
+  }
+
+private:
+  buffer_type& buffer_;
+};
+
+} // namespace query
+
+namespace query {
+namespace binary {
+/*!
+ * Binary layout of a column:
+ *   header, then for `fixed`   layout: `count` elements memcpy'ed back to back,
+ *               for `strings` layout: `count + 1` uint64 offsets and character blob,
+ *               for `pairs`   layout: key column followed by value column.
+ * Every column starts at 8-byte boundary, so fixed columns can be viewed in place.
+ */
+constexpr uint32_t magic   = 0x4e494251; // "QBIN"
+constexpr uint16_t version = 1;
+
+enum struct layout : uint16_t { fixed = 1, strings = 2, pairs = 3 };
+
+struct header {
+  uint32_t magic;
+  uint16_t version;
+  layout   column_layout;
+  uint32_t element_size;
+  uint32_t reserved;
+  uint64_t count;
+};
+static_assert(sizeof(header) == 24 && std::is_trivially_copyable_v<header>);
+
+template <typename T>
+concept fixed_element = std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>;
+
+template <typename T>
+concept string_element = container_traits::is_basic_string<T>::value && std::is_same_v<typename T::value_type, char>;
+
+class writer final {
+public:
+  explicit writer(std::vector<std::byte>& output) noexcept : output_(output) {}
+
+  void bytes(const void* data, size_t size) {
+    const auto* begin = static_cast<const std::byte*>(data);
+    output_.insert(output_.end(), begin, begin + size);
+  }
+
+  void align() {
+    output_.resize((output_.size() + 7) & ~size_t(7));
+  }
+
+  void column_header(layout column_layout, uint32_t element_size, uint64_t count) {
+    const header column{magic, version, column_layout, element_size, 0, count};
+    bytes(&column, sizeof(column));
+  }
+
+  /// Column of elements produced by `project(element)` over [first, last)
+  template <typename Iterator, typename Projection>
+  void column(Iterator first, Iterator last, uint64_t count, Projection project) {
+    using element_type = std::decay_t<decltype(project(*first))>;
+    static_assert(fixed_element<element_type> || string_element<element_type>,
+      "Only trivially copyable elements and std::string are serializable");
+    if constexpr (fixed_element<element_type>) {
+      column_header(layout::fixed, sizeof(element_type), count);
+      if constexpr (std::contiguous_iterator<Iterator> && std::is_same_v<std::iter_value_t<Iterator>, element_type>) {
+        bytes(std::to_address(first), count * sizeof(element_type));
+      } else {
+        const size_t offset = output_.size();
+        output_.resize(offset + count * sizeof(element_type));
+        for (std::byte* out = output_.data() + offset; first != last; ++first, out += sizeof(element_type)) {
+          const element_type& element = project(*first);
+          std::memcpy(out, &element, sizeof(element_type));
+        }
+      }
+    } else {
+      column_header(layout::strings, sizeof(char), count);
+      uint64_t offset = 0;
+      bytes(&offset, sizeof(offset));
+      for (auto it = first; it != last; ++it) {
+        offset += project(*it).size();
+        bytes(&offset, sizeof(offset));
+      }
+      output_.reserve(output_.size() + offset);
+      for (; first != last; ++first) {
+        const auto& element = project(*first);
+        bytes(element.data(), element.size());
+      }
+    }
+    align();
+  }
+
+private:
+  std::vector<std::byte>& output_;
+};
+
+class reader final {
+public:
+  explicit reader(std::span<const std::byte> input) noexcept : input_(input), offset_(0) {}
+
+  const std::byte* take(size_t size) noexcept {
+    if (input_.size() - offset_ < size) {
+      return nullptr;
+    }
+    const std::byte* data = input_.data() + offset_;
+    offset_ += size;
+    return data;
+  }
+
+  std::optional<header> column_header(layout expected_layout) noexcept {
+    const std::byte* data = take(sizeof(header));
+    if (data == nullptr) {
+      return std::nullopt;
+    }
+    header column;
+    std::memcpy(&column, data, sizeof(column));
+    if (column.magic != magic || column.version != version || column.column_layout != expected_layout) {
+      return std::nullopt;
+    }
+    return column;
+  }
+
+  bool align() noexcept {
+    const size_t aligned = (offset_ + 7) & ~size_t(7);
+    if (aligned > input_.size()) {
+      return false;
+    }
+    offset_ = aligned;
+    return true;
+  }
+
+  /// Invoke `consume(element)` for each element of a column of type T
+  template <typename T, typename Consumer>
+  bool column(Consumer consume) {
+    if constexpr (fixed_element<T>) {
+      const auto column = column_header(layout::fixed);
+      if (!column || column->element_size != sizeof(T) || column->count > input_.size() / sizeof(T)) {
+        return false;
+      }
+      const std::byte* data = take(column->count * sizeof(T));
+      if (data == nullptr) {
+        return false;
+      }
+      for (uint64_t i = 0; i < column->count; ++i) {
+        T element;
+        std::memcpy(&element, data + i * sizeof(T), sizeof(T));
+        consume(std::move(element));
+      }
+    } else {
+      static_assert(string_element<T>, "Only trivially copyable elements and std::string are serializable");
+      const auto column = column_header(layout::strings);
+      if (!column || column->element_size != sizeof(char) || column->count >= input_.size() / sizeof(uint64_t)) {
+        return false;
+      }
+      const std::byte* offsets = take((column->count + 1) * sizeof(uint64_t));
+      if (offsets == nullptr) {
+        return false;
+      }
+      uint64_t total = 0;
+      std::memcpy(&total, offsets + column->count * sizeof(uint64_t), sizeof(total));
+      const std::byte* blob = take(total);
+      if (blob == nullptr) {
+        return false;
+      }
+      uint64_t begin = 0;
+      for (uint64_t i = 1; i <= column->count; ++i) {
+        uint64_t end;
+        std::memcpy(&end, offsets + i * sizeof(uint64_t), sizeof(end));
+        if (end < begin || end > total) {
+          return false;
+        }
+        consume(T(reinterpret_cast<const char*>(blob) + begin, end - begin));
+        begin = end;
+      }
+    }
+    return align();
+  }
+
+private:
+  std::span<const std::byte> input_;
+  size_t                     offset_;
+};
+
+template <typename Container>
+std::vector<std::byte> encode(const Container& container) {
+  std::vector<std::byte> output;
+  writer out(output);
+  const uint64_t count = static_cast<uint64_t>(std::distance(std::begin(container), std::end(container)));
+  if constexpr (container_traits::is_associative_container<Container>::value) {
+    out.column_header(layout::pairs, 0, count);
+    out.column(std::begin(container), std::end(container), count, [](const auto& pair) -> const auto& { return pair.first; });
+    out.column(std::begin(container), std::end(container), count, [](const auto& pair) -> const auto& { return pair.second; });
+  } else {
+    out.column(std::begin(container), std::end(container), count, [](const auto& element) -> const auto& { return element; });
+  }
+  return output;
+}
+
+/*!
+ * Zero-copy view of fixed layout column.
+ * @return nullopt if input is not a column of T or is misaligned
+ */
+template <fixed_element T>
+std::optional<std::span<const T>> view(std::span<const std::byte> input) noexcept {
+  reader in(input);
+  const auto column = in.column_header(layout::fixed);
+  if (!column || column->element_size != sizeof(T) || column->count > input.size() / sizeof(T)) {
+    return std::nullopt;
+  }
+  const std::byte* data = in.take(column->count * sizeof(T));
+  if (data == nullptr || reinterpret_cast<uintptr_t>(data) % alignof(T) != 0) {
+    return std::nullopt;
+  }
+  return std::span<const T>(reinterpret_cast<const T*>(data), column->count);
+}
+
+}// namespace binary
+
+/*!
+ * Decode container serialized by `from::to_binary()`.
+ * @return nullopt if input is malformed or holds other element types
+ */
+template <typename Container>
+std::optional<Container> from_binary(std::span<const std::byte> input) {
+  binary::reader in(input);
+  Container result;
+  if constexpr (container_traits::is_associative_container<Container>::value) {
+    using   key_type = typename Container::key_type;
+    using value_type = typename Container::mapped_type;
+    const auto column = in.column_header(binary::layout::pairs);
+    if (!column) {
+      return std::nullopt;
+    }
+    std::vector<key_type> keys;
+    keys.reserve(column->count);
+    if (!in.column<key_type>([&](key_type&& key) { keys.push_back(std::move(key)); }) || keys.size() != column->count) {
+      return std::nullopt;
+    }
+    size_t index = 0;
+    const bool decoded = in.column<value_type>([&](value_type&& value) {
+      if (index < keys.size()) {
+        container_traits::any_push(result, std::move(keys[index++]), std::move(value));
+      }
+    });
+    if (!decoded || index != keys.size()) {
+      return std::nullopt;
+    }
+  } else {
+    using value_type = typename Container::value_type;
+    if (!in.column<value_type>([&](value_type&& value) { container_traits::any_push(result, std::move(value)); })) {
+      return std::nullopt;
+    }
+  }
+  return result;
+}
+
+} // namespace query
+
+namespace query {
+/*!
+ * Execution hint of sort spilling to disk, see `external_sorter`.
+ */
+struct external final {
+  /// Bytes of rows held in memory at once
+  size_t memory_budget = size_t{256} << 20;
+};
+
+namespace detail {
+
+/*!
+ * Temporary file of rows, written and then read back sequentially in large blocks.
+ * Fixed size rows are stored as their bytes, strings as length and characters.
+ */
+template <typename T>
+class spill_file final {
+public:
+  static_assert(binary::fixed_element<T> || binary::string_element<T>,
+    "Only trivially copyable elements and std::string can be spilled");
+
+  explicit spill_file(size_t block_bytes) : file_(std::tmpfile()), block_(block_bytes) {
+    if (file_ == nullptr) {
+      throw std::runtime_error("external_sorter: cannot create temporary file");
+    }
+    // Blocks are already large, stdio buffer would only add a copy
+    std::setvbuf(file_.get(), nullptr, _IONBF, 0);
+  }
+
+  void write(const T& value) {
+    if constexpr (binary::fixed_element<T>) {
+      put(&value, sizeof(T));
+    } else {
+      const uint64_t size = value.size();
+      put(&size, sizeof(size));
+      put(value.data(), size);
+    }
+    ++count_;
+  }
+
+  /// Switch from writing to reading from the beginning
+  void rewind() {
+    if (filled_ != 0 && std::fwrite(block_.data(), 1, filled_, file_.get()) != filled_) {
+      throw std::runtime_error("external_sorter: cannot write temporary file");
+    }
+    std::rewind(file_.get());
+    position_ = 0;
+    filled_   = 0;
+  }
+
+  bool read(T& value) {
+    if (count_ == 0) {
+      return false;
+    }
+    --count_;
+    if constexpr (binary::fixed_element<T>) {
+      get(&value, sizeof(T));
+    } else {
+      uint64_t size;
+      get(&size, sizeof(size));
+      value.resize(size);
+      get(value.data(), size);
+    }
+    return true;
+  }
+
+private:
+  struct closer {
+    void operator()(std::FILE* file) const noexcept {
+      std::fclose(file);
+    }
+  };
+
+  void put(const void* data, size_t size) {
+    const auto* bytes = static_cast<const std::byte*>(data);
+    while (size != 0) {
+      if (filled_ == block_.size()) {
+        if (std::fwrite(block_.data(), 1, filled_, file_.get()) != filled_) {
+          throw std::runtime_error("external_sorter: cannot write temporary file");
+        }
+        filled_ = 0;
+      }
+      const size_t chunk = std::min(size, block_.size() - filled_);
+      std::memcpy(block_.data() + filled_, bytes, chunk);
+      filled_ += chunk;
+      bytes   += chunk;
+      size    -= chunk;
+    }
+  }
+
+  void get(void* data, size_t size) {
+    auto* bytes = static_cast<std::byte*>(data);
+    while (size != 0) {
+      if (position_ == filled_) {
+        filled_   = std::fread(block_.data(), 1, block_.size(), file_.get());
+        position_ = 0;
+        if (filled_ == 0) {
+          throw std::runtime_error("external_sorter: temporary file is truncated");
+        }
+      }
+      const size_t chunk = std::min(size, filled_ - position_);
+      std::memcpy(bytes, block_.data() + position_, chunk);
+      position_ += chunk;
+      bytes     += chunk;
+      size      -= chunk;
+    }
+  }
+
+  std::unique_ptr<std::FILE, closer> file_;
+  std::vector<std::byte>             block_;
+  size_t                             position_ = 0;
+  size_t                             filled_   = 0;
+  uint64_t                           count_    = 0;
+};
+
+/*!
+ * Tournament tree of losers over k sorted sources: root holds the smallest head,
+ * every inner node the loser of its match, so advancing the winner replays only
+ * log2(k) matches along its path. Ties go to the source of lower index.
+ */
+template <typename T, typename Compare>
+class loser_tree final {
+public:
+  loser_tree(std::vector<std::optional<T>>& heads, Compare& compare)
+    : heads_(heads), compare_(compare), tree_(std::max<size_t>(heads.size(), 1)) {
+    tree_[0] = heads_.size() > 1 ? build(1) : 0;
+  }
+
+  /// Source holding the smallest head, its head is empty once all sources are exhausted
+  size_t winner() const noexcept {
+    return tree_[0];
+  }
+
+  /// Replay matches after head of winner changed
+  void replay() {
+    size_t winner = tree_[0];
+    for (size_t node = (winner + heads_.size()) / 2; node > 0; node /= 2) {
+      if (less(tree_[node], winner)) {
+        std::swap(tree_[node], winner);
+      }
+    }
+    tree_[0] = winner;
+  }
+
+private:
+  /// Leaves are nodes k..2k-1, so inner nodes 1..k-1 fit tree of any k
+  size_t build(size_t node) {
+    if (node >= heads_.size()) {
+      return node - heads_.size();
+    }
+    const size_t lhs = build(2 * node);
+    const size_t rhs = build(2 * node + 1);
+    if (less(rhs, lhs)) {
+      tree_[node] = lhs;
+      return rhs;
+    }
+    tree_[node] = rhs;
+    return lhs;
+  }
+
+  bool less(size_t lhs, size_t rhs) const {
+    if (!heads_[lhs] || !heads_[rhs]) {
+      return heads_[lhs] && !heads_[rhs];
+    }
+    if (compare_(*heads_[lhs], *heads_[rhs])) {
+      return true;
+    }
+    return !compare_(*heads_[rhs], *heads_[lhs]) && lhs < rhs;
+  }
+
+  std::vector<std::optional<T>>& heads_;
+  Compare&                       compare_;
+  std::vector<size_t>            tree_;
+};
+
+} // namespace detail
+
+/*!
+ * External merge sort. Rows are collected into a run of at most the memory budget,
+ * full run is sorted and spilled to a temporary file, and runs are merged by a loser
+ * tree reading every run sequentially in large blocks. If there are more runs than
+ * blocks fitting the budget, runs are first merged in groups into longer runs.
+ * Input fitting the budget is sorted in memory and never written to disk.
+ */
+template <typename T, typename Compare = std::less<>>
+class external_sorter final {
+public:
+  using value_type = T;
+
+  explicit external_sorter(external mode = {}, Compare compare = {})
+    : budget_ (std::max<size_t>(mode.memory_budget, 1))
+    , block_  (std::clamp<size_t>(budget_ / 16, size_t{64} << 10, size_t{4} << 20))
+    , compare_(std::move(compare)) {}
+
+  void add(value_type value) {
+    run_bytes_ += bytes_of(value);
+    run_.push_back(std::move(value));
+    if (run_bytes_ >= budget_) {
+      spill();
+    }
+  }
+
+  /*!
+   * Pass all rows to sink in sorted order, leaving sorter empty.
+   * @param sink callable with `value_type&&`
+   */
+  template <typename Sink>
+  void drain(Sink&& sink) {
+    if (runs_.empty()) {
+      std::sort(run_.begin(), run_.end(), compare_);
+      for (auto& value : run_) {
+        sink(std::move(value));
+      }
+      run_.clear();
+      run_bytes_ = 0;
+      return;
+    }
+    if (!run_.empty()) {
+      spill();
+    }
+    const size_t fan_in = std::max<size_t>(2, budget_ / block_);
+    while (runs_.size() > fan_in) {
+      std::vector<std::unique_ptr<run_file>> group;
+      for (size_t i = 0; i < fan_in; ++i) {
+        group.push_back(std::move(runs_[i]));
+      }
+      runs_.erase(runs_.begin(), runs_.begin() + fan_in);
+      auto merged = std::make_unique<run_file>(block_);
+      merge(group, [&](value_type&& value) { merged->write(value); });
+      runs_.push_back(std::move(merged));
+    }
+    merge(runs_, sink);
+    runs_.clear();
+  }
+
+  /// Number of runs spilled to disk so far
+  size_t runs() const noexcept {
+    return spilled_;
+  }
+
+private:
+  using run_file = detail::spill_file<value_type>;
+
+  static size_t bytes_of(const value_type& value) noexcept {
+    if constexpr (binary::string_element<value_type>) {
+      return sizeof(value_type) + value.size();
+    } else {
+      return sizeof(value_type);
+    }
+  }
+
+  void spill() {
+    std::sort(run_.begin(), run_.end(), compare_);
+    auto run = std::make_unique<run_file>(block_);
+    for (const auto& value : run_) {
+      run->write(value);
+    }
+    runs_.push_back(std::move(run));
+    ++spilled_;
+    run_.clear();
+    run_bytes_ = 0;
+  }
+
+  template <typename Sink>
+  void merge(std::vector<std::unique_ptr<run_file>>& runs, Sink&& sink) {
+    std::vector<std::optional<value_type>> heads(runs.size());
+    for (size_t i = 0; i < runs.size(); ++i) {
+      runs[i]->rewind();
+      heads[i].emplace();
+      if (!runs[i]->read(*heads[i])) {
+        heads[i].reset();
+      }
+    }
+    detail::loser_tree<value_type, Compare> tree(heads, compare_);
+    for (size_t winner = tree.winner(); heads[winner]; winner = tree.winner()) {
+      value_type value = std::move(*heads[winner]);
+      if (!runs[winner]->read(*heads[winner])) {
+        heads[winner].reset();
+      }
+      tree.replay();
+      sink(std::move(value));
+    }
+  }
+
+  size_t                                 budget_;
+  size_t                                 block_;
+  Compare                                compare_;
+  std::vector<value_type>                run_;
+  size_t                                 run_bytes_ = 0;
+  std::vector<std::unique_ptr<run_file>> runs_;
+  size_t                                 spilled_   = 0;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Profiling policy of `from` that records nothing, so instrumentation compiles out.
+ */
+struct null_profiler final {
+  static constexpr bool enabled = false;
+};
+
+/*!
+ * Profiling policy of `from` that records wall time, rows in/out, allocated bytes
+ * and buffer rebuilds of every stage, and prints the chain as plan tree.
+ */
+class stage_profiler final {
+public:
+  static constexpr bool enabled = true;
+
+  struct stage {
+    const char*              name;
+    std::chrono::nanoseconds time;
+    size_t                   rows_in;
+    size_t                   rows_out;
+    size_t                   bytes_allocated;
+    size_t                   buffer_rebuilds;
+  };
+
+  /// Returns total bytes allocated by the process so far, e.g. from replaced operator new
+  using allocation_counter = size_t (*)();
+
+  /*!
+   * Without counter, allocated bytes are estimated as size of rebuilt buffers.
+   */
+  void count_allocations_with(allocation_counter counter) noexcept {
+    counter_ = counter;
+  }
+
+  bool counts_allocations() const noexcept {
+    return counter_ != nullptr;
+  }
+
+  size_t allocated_bytes() const {
+    return counter_ ? counter_() : 0;
+  }
+
+  void record(const stage& stage) {
+    stages_.push_back(stage);
+  }
+
+  const std::vector<stage>& stages() const noexcept {
+    return stages_;
+  }
+
+  /*!
+   * Print recorded chain as plan tree, last stage is the root.
+   */
+  void explain(std::ostream& stream) const {
+    size_t depth = 0;
+    for (auto it = stages_.rbegin(); it != stages_.rend(); ++it, ++depth) {
+      indent(stream, depth);
+      stream << it->name
+             << " (rows " << it->rows_in << " -> " << it->rows_out
+             << ", time " << it->time.count() << " ns"
+             << ", bytes " << it->bytes_allocated
+             << ", rebuilds " << it->buffer_rebuilds << ")\n";
+    }
+    indent(stream, depth);
+    stream << "source\n";
+  }
+
+private:
+  static void indent(std::ostream& stream, size_t depth) {
+    if (depth > 0) {
+      stream << std::string((depth - 1) * 3, ' ') << "`- ";
+    }
+  }
+
+  std::vector<stage> stages_;
+  allocation_counter counter_ = nullptr;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Comparison performed by a gate, recognized for standard comparators only.
+ * Gate compares `comparator(element, value)`, so `std::less<>` selects elements less than value.
+ */
+enum struct comparison { unsupported, equal, less, less_equal, greater, greater_equal };
+
+template <typename Comparator> struct comparison_of                              : std::integral_constant<comparison, comparison::unsupported>   {};
+template <typename T>          struct comparison_of<std::equal_to<T>>            : std::integral_constant<comparison, comparison::equal>         {};
+template <typename T>          struct comparison_of<std::less<T>>                : std::integral_constant<comparison, comparison::less>          {};
+template <typename T>          struct comparison_of<std::less_equal<T>>          : std::integral_constant<comparison, comparison::less_equal>    {};
+template <typename T>          struct comparison_of<std::greater<T>>             : std::integral_constant<comparison, comparison::greater>       {};
+template <typename T>          struct comparison_of<std::greater_equal<T>>       : std::integral_constant<comparison, comparison::greater_equal> {};
+
+/*!
+ * Standard comparator compares Key values as they are: transparent `std::less<>` or `std::less<Key>`,
+ * but not `std::less<int>` over double keys, which converts both operands first. Only such comparators
+ * can be answered by binary search or index over Key.
+ */
+template <typename Comparator, typename Key>
+struct compares_as : std::false_type {};
+
+template <template <typename> typename Comparator, typename T, typename Key>
+struct compares_as<Comparator<T>, Key> : std::bool_constant<std::is_void_v<T> || std::is_same_v<T, Key>> {};
+
+/*!
+ * Slice of sorted range [first, last) satisfying `comparison` against key.
+ * @param less strict weak ordering the range is sorted by, compares element with key both ways
+ */
+template <typename Iterator, typename Key, typename Less>
+std::pair<Iterator, Iterator> comparison_range(Iterator first, Iterator last, comparison op, const Key& key, Less less) {
+  const auto lower = [&] { return std::lower_bound(first, last, key, [&](const auto& element, const Key& k) { return less(element, k); }); };
+  const auto upper = [&] { return std::upper_bound(first, last, key, [&](const Key& k, const auto& element) { return less(k, element); }); };
+  switch (op) {
+  case comparison::equal:         return {lower(), upper()};
+  case comparison::less:          return {first, lower()};
+  case comparison::less_equal:    return {first, upper()};
+  case comparison::greater:       return {upper(), last};
+  case comparison::greater_equal: return {lower(), last};
+  default:                        return {first, last};
+  }
+}
+
+/*!
+ * Slice of ordered associative container (set, map) satisfying `comparison` against key,
+ * found by its own O(log n) lower_bound/upper_bound.
+ */
+template <typename Ordered, typename Key>
+auto ordered_range(Ordered& container, comparison op, const Key& key) {
+  using iterator = decltype(container.begin());
+  switch (op) {
+  case comparison::equal:         return std::pair<iterator, iterator>(container.equal_range(key));
+  case comparison::less:          return std::pair<iterator, iterator>(container.begin(), container.lower_bound(key));
+  case comparison::less_equal:    return std::pair<iterator, iterator>(container.begin(), container.upper_bound(key));
+  case comparison::greater:       return std::pair<iterator, iterator>(container.upper_bound(key), container.end());
+  case comparison::greater_equal: return std::pair<iterator, iterator>(container.lower_bound(key), container.end());
+  default:                        return std::pair<iterator, iterator>(container.begin(), container.end());
+  }
+}
+
+/*!
+ * Key extractor selecting whole element.
+ */
+struct identity final {
+  template <typename T>
+  constexpr const T& operator()(const T& value) const noexcept {
+    return value;
+  }
+
+  constexpr bool operator==(const identity&) const noexcept = default;
+};
+
+/*!
+ * Type-erased secondary index, registered in `from` with `with_index`.
+ */
+template <typename Value>
+class index_base {
+public:
+  virtual ~index_base() = default;
+
+  /*!
+   * Append pointers to elements of source whose key satisfies comparison, in source order.
+   * @param field    pointer to key extractor used by the query, of type `field_type`
+   * @param key      pointer to key converted to index key type `key_type`
+   * @return false if index was built over another source or key, or cannot serve comparison
+   */
+  virtual bool lookup(const void* source, std::type_index field_type, const void* field,
+                      comparison op, std::type_index key_type, const void* key,
+                      std::vector<const Value*>& output) const = 0;
+};
+
+namespace detail {
+
+template <typename Container>
+size_t source_size(const Container& container) noexcept {
+  if constexpr (requires { container.size(); }) {
+    return container.size();
+  } else {
+    return 0;
+  }
+}
+
+/*!
+ * State of source an index was built over. Reallocation changes first element address even if
+ * size is the same, in-place edits are seen only through version of a `versioned` source.
+ */
+struct source_snapshot final {
+  size_t      size    = 0;
+  const void* first   = nullptr;
+  uint64_t    version = 0;
+
+  bool operator==(const source_snapshot&) const noexcept = default;
+};
+
+template <typename Container>
+source_snapshot snapshot_of(const Container& container, const versioned<Container>* tracked) noexcept {
+  const auto first = container.begin();
+  return {
+    source_size(container),
+    first == container.end() ? nullptr : static_cast<const void*>(std::addressof(*first)),
+    tracked == nullptr ? 0 : tracked->version()
+  };
+}
+
+template <typename Field>
+bool same_field(std::type_index field_type, const void* field, const Field& own) noexcept {
+  if (field_type != std::type_index(typeid(Field))) {
+    return false;
+  }
+  if constexpr (std::equality_comparable<Field>) {
+    return *static_cast<const Field*>(field) == own;
+  } else {
+    return std::is_empty_v<Field>;
+  }
+}
+
+} // namespace detail
+
+/*!
+ * Sorted index for range and equality gates, O(log n + k log k) lookup.
+ * Must be rebuilt after source is modified. It is ignored by `from` if source size or storage changed,
+ * or if versioned source was modified; in-place edits of plain containers are not detected.
+ * @tparam Field member object pointer or key function
+ */
+template <typename Container, typename Field = identity>
+class sorted_index final : public index_base<typename Container::value_type> {
+public:
+  using container_type = Container;
+  using     value_type = typename container_type::value_type;
+  using       key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, const value_type&>>;
+
+  explicit sorted_index(const container_type& source, Field field = {}) : source_(source), field_(field) {
+    rebuild();
+  }
+
+  /// Index over versioned source is also ignored after any `modify()` of it
+  explicit sorted_index(const versioned<container_type>& source, Field field = {})
+    : source_(source.get()), tracked_(&source), field_(field) {
+    rebuild();
+  }
+
+  void rebuild() {
+    entries_.clear();
+    size_t position = 0;
+    for (const auto& element : source_) {
+      entries_.push_back({position++, &element});
+    }
+    std::stable_sort(entries_.begin(), entries_.end(), [this](const entry& l, const entry& r) {
+      return key(*l.element) < key(*r.element);
+    });
+    built_ = detail::snapshot_of(source_, tracked_);
+  }
+
+  /*!
+   * Elements with key satisfying comparison, in source order.
+   */
+  std::vector<const value_type*> select(comparison op, const key_type& value) const {
+    std::vector<const value_type*> output;
+    collect(op, value, output);
+    return output;
+  }
+
+  bool lookup(const void* source, std::type_index field_type, const void* field,
+              comparison op, std::type_index key_type_index, const void* value,
+              std::vector<const value_type*>& output) const override {
+    if (source != &source_ || op == comparison::unsupported || key_type_index != std::type_index(typeid(key_type)) ||
+        built_ != detail::snapshot_of(source_, tracked_) || !detail::same_field<Field>(field_type, field, field_)) {
+      return false;
+    }
+    collect(op, *static_cast<const key_type*>(value), output);
+    return true;
+  }
+
+private:
+  struct entry {
+    size_t            position;
+    const value_type* element;
+  };
+
+  decltype(auto) key(const value_type& element) const {
+    return std::invoke(field_, element);
+  }
+
+  void collect(comparison op, const key_type& value, std::vector<const value_type*>& output) const {
+    const auto less = [this](const auto& l, const auto& r) {
+      if constexpr (std::is_same_v<std::decay_t<decltype(l)>, entry>) {
+        return key(*l.element) < r;
+      } else {
+        return l < key(*r.element);
+      }
+    };
+    auto [first, last] = comparison_range(entries_.begin(), entries_.end(), op, value, less);
+    std::vector<entry> matches(first, last);
+    std::sort(matches.begin(), matches.end(), [](const entry& l, const entry& r) { return l.position < r.position; });
+    output.reserve(output.size() + matches.size());
+    for (const auto& match : matches) {
+      output.push_back(match.element);
+    }
+  }
+
+  const container_type&                  source_;
+  const versioned<container_type>*       tracked_ = nullptr;
+  Field                                  field_;
+  std::vector<entry>                     entries_;
+  detail::source_snapshot                built_;
+};
+
+/*!
+ * Hash index for equality gates, O(1 + k) lookup.
+ * Must be rebuilt after source is modified. It is ignored by `from` if source size or storage changed,
+ * or if versioned source was modified; in-place edits of plain containers are not detected.
+ * @tparam Field member object pointer or key function
+ */
+template <typename Container, typename Field = identity>
+class hash_index final : public index_base<typename Container::value_type> {
+public:
+  using container_type = Container;
+  using     value_type = typename container_type::value_type;
+  using       key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, const value_type&>>;
+
+  explicit hash_index(const container_type& source, Field field = {}) : source_(source), field_(field) {
+    rebuild();
+  }
+
+  /// Index over versioned source is also ignored after any `modify()` of it
+  explicit hash_index(const versioned<container_type>& source, Field field = {})
+    : source_(source.get()), tracked_(&source), field_(field) {
+    rebuild();
+  }
+
+  void rebuild() {
+    buckets_.clear();
+    for (const auto& element : source_) {
+      buckets_[std::invoke(field_, element)].push_back(&element);
+    }
+    built_ = detail::snapshot_of(source_, tracked_);
+  }
+
+  /*!
+   * Elements with key equal to value, in source order.
+   */
+  const std::vector<const value_type*>& select(const key_type& value) const {
+    static const std::vector<const value_type*> empty;
+    const auto found = buckets_.find(value);
+    return found == buckets_.end() ? empty : found->second;
+  }
+
+  bool lookup(const void* source, std::type_index field_type, const void* field,
+              comparison op, std::type_index key_type_index, const void* value,
+              std::vector<const value_type*>& output) const override {
+    if (source != &source_ || op != comparison::equal || key_type_index != std::type_index(typeid(key_type)) ||
+        built_ != detail::snapshot_of(source_, tracked_) || !detail::same_field<Field>(field_type, field, field_)) {
+      return false;
+    }
+    const auto& matches = select(*static_cast<const key_type*>(value));
+    output.insert(output.end(), matches.begin(), matches.end());
+    return true;
+  }
+
+private:
+  const container_type&                                         source_;
+  const versioned<container_type>*                              tracked_ = nullptr;
+  Field                                                         field_;
+  std::unordered_map<key_type, std::vector<const value_type*>> buckets_;
+  detail::source_snapshot                                       built_;
+};
+
+} // namespace query
+
+namespace query {
+namespace detail {
+
+/// Bounds are wider than code, so last of a full dictionary (max() + 1) does not wrap to 0
+struct code_range final {
+  size_t first = 0;
+  size_t last  = 0;
+};
+
+/// Code inside [first, last), single compare thanks to unsigned wrap around
+struct in_code_range final {
+  template <typename Code>
+  bool operator()(Code code, const code_range& range) const noexcept {
+    return static_cast<size_t>(code) - range.first < range.last - range.first;
+  }
+};
+
+/// Code whose dictionary entry passed the gate
+struct in_code_mask final {
+  template <typename Code>
+  bool operator()(Code code, const std::vector<uint8_t>& mask) const noexcept {
+    return mask[code] != 0;
+  }
+};
+
+struct string_hash final {
+  using is_transparent = void;
+
+  size_t operator()(std::string_view value) const noexcept {
+    return std::hash<std::string_view>{}(value);
+  }
+};
+
+} // namespace detail
+
+/*!
+ * Column of low-cardinality strings stored as integer codes into a sorted dictionary.
+ *
+ * Dictionary is order preserving, so comparing, sorting, grouping and deduplicating codes
+ * gives the same result as doing it on strings. Query `codes()` with `from`, translate string
+ * gates with `translate` once per query and decode the result at the end:
+ *
+ *   const auto open = column.decode(from(column.codes()).where(column.translate(starts_with("op"))).sort().to());
+ *
+ * @tparam Code unsigned integer wide enough for number of distinct values
+ */
+template <typename Code = uint32_t>
+class dictionary_column final {
+public:
+  using  code_type = Code;
+  using value_type = std::string;
+
+  static_assert(std::is_unsigned_v<code_type>, "Unsigned code type expected");
+
+  dictionary_column() = default;
+
+  template <typename Range>
+    requires std::convertible_to<std::ranges::range_reference_t<const Range&>, std::string_view>
+  explicit dictionary_column(const Range& values) {
+    append(values);
+  }
+
+  /*!
+   * Append values. If new distinct values appear, dictionary is re-sorted and existing codes
+   * are remapped once per call, so append in bulk rather than value by value.
+   * @throw std::length_error if distinct values do not fit into code_type
+   */
+  template <typename Range>
+    requires std::convertible_to<std::ranges::range_reference_t<const Range&>, std::string_view>
+  void append(const Range& values) {
+    const size_t known = dictionary_.size();
+    const size_t count = codes_.size();
+    std::vector<std::string> fresh;
+    try {
+      for (std::string_view value : values) {
+        const auto found = index_.find(value);
+        if (found != index_.end()) {
+          codes_.push_back(found->second);
+          continue;
+        }
+        if (known + fresh.size() > std::numeric_limits<code_type>::max()) {
+          throw std::length_error("dictionary_column: too many distinct values for code type");
+        }
+        const auto code = static_cast<code_type>(known + fresh.size());
+        fresh.emplace_back(value);
+        index_.emplace(fresh.back(), code);
+        codes_.push_back(code);
+      }
+      if (!fresh.empty()) {
+        reencode(fresh);
+      }
+    } catch (...) {
+      // Column is left as before the call
+      for (const std::string& value : fresh) {
+        index_.erase(value);
+      }
+      codes_.resize(count);
+      throw;
+    }
+  }
+
+  void push_back(std::string_view value) {
+    append(std::span<const std::string_view>(&value, 1));
+  }
+
+  size_t size() const noexcept {
+    return codes_.size();
+  }
+
+  bool empty() const noexcept {
+    return codes_.empty();
+  }
+
+  const std::string& operator[](size_t position) const noexcept {
+    return dictionary_[codes_[position]];
+  }
+
+  const std::vector<code_type>& codes() const noexcept {
+    return codes_;
+  }
+
+  /// Distinct values in ascending order, indexed by code
+  const std::vector<std::string>& dictionary() const noexcept {
+    return dictionary_;
+  }
+
+  std::optional<code_type> code_of(std::string_view value) const {
+    const auto found = index_.find(value);
+    return found == index_.end() ? std::nullopt : std::optional<code_type>(found->second);
+  }
+
+  const std::string& decode(code_type code) const noexcept {
+    return dictionary_[code];
+  }
+
+  /*!
+   * Decode container of codes, e.g. result of a query over `codes()`.
+   */
+  template <typename Target = std::vector<std::string>, typename Codes>
+  Target decode(const Codes& codes) const {
+    Target target;
+    if constexpr (requires { target.reserve(codes.size()); }) {
+      target.reserve(codes.size());
+    }
+    for (const code_type code : codes) {
+      container_traits::any_push(target, dictionary_[code]);
+    }
+    return target;
+  }
+
+  /*!
+   * Gate on strings translated to gate on codes, evaluated against dictionary only.
+   * Equality and range gates with standard comparators become a code range found by binary search,
+   * any other gate (text gates, user comparators) is evaluated once per distinct value into a mask.
+   */
+  template <typename Comparator, typename T>
+  auto translate(const gate<Comparator, T>& logical_gate) const {
+    constexpr comparison op = comparison_of<Comparator>::value;
+    if constexpr (op != comparison::unsupported && std::is_convertible_v<const T&, std::string_view>) {
+      const std::string_view key = logical_gate.value();
+      const auto [first, last] = comparison_range(dictionary_.begin(), dictionary_.end(), op, key, std::less<>{});
+      return gate(detail::in_code_range{}, detail::code_range{
+        static_cast<size_t>(first - dictionary_.begin()),
+        static_cast<size_t>(last  - dictionary_.begin())
+      });
+    } else {
+      std::vector<uint8_t> mask(dictionary_.size());
+      for (size_t code = 0; code < dictionary_.size(); ++code) {
+        mask[code] = logical_gate.compare_with(dictionary_[code]);
+      }
+      return gate(detail::in_code_mask{}, std::move(mask));
+    }
+  }
+
+  /*!
+   * Group codes by value, counted by direct indexing instead of hashing strings.
+   * @return distinct values present in codes with their counts, in ascending order
+   */
+  template <typename Codes>
+  std::vector<std::pair<std::string, size_t>> count_by(const Codes& codes) const {
+    std::vector<size_t> counts(dictionary_.size());
+    for (const code_type code : codes) {
+      ++counts[code];
+    }
+    std::vector<std::pair<std::string, size_t>> groups;
+    for (size_t code = 0; code < counts.size(); ++code) {
+      if (counts[code] != 0) {
+        groups.emplace_back(dictionary_[code], counts[code]);
+      }
+    }
+    return groups;
+  }
+
+private:
+  /*!
+   * Merge fresh values (provisional codes after known ones) into sorted dictionary and remap codes.
+   * Everything that can throw runs before the column is modified, so on exception fresh values
+   * are intact and `append` can roll back.
+   */
+  void reencode(std::vector<std::string>& fresh) {
+    const size_t known = dictionary_.size();
+    std::vector<code_type> order(fresh.size());
+    std::iota(order.begin(), order.end(), code_type{0});
+    std::sort(order.begin(), order.end(), [&](code_type l, code_type r) { return fresh[l] < fresh[r]; });
+
+    std::vector<std::string> merged;
+    merged.reserve(known + fresh.size());
+    std::vector<code_type> remap(known + fresh.size());
+    // Nothing below allocates
+    size_t old_position = 0;
+    size_t new_position = 0;
+    while (old_position < known || new_position < order.size()) {
+      const auto code = static_cast<code_type>(merged.size());
+      if (new_position == order.size() || (old_position < known && dictionary_[old_position] < fresh[order[new_position]])) {
+        remap[old_position] = code;
+        merged.push_back(std::move(dictionary_[old_position++]));
+      } else {
+        remap[known + order[new_position]] = code;
+        merged.push_back(std::move(fresh[order[new_position++]]));
+      }
+    }
+    dictionary_ = std::move(merged);
+    for (code_type& code : codes_) {
+      code = remap[code];
+    }
+    for (auto& [value, code] : index_) {
+      code = remap[code];
+    }
+  }
+
+  std::vector<code_type>                                                        codes_;
+  std::vector<std::string>                                                      dictionary_;
+  std::unordered_map<std::string, code_type, detail::string_hash, std::equal_to<>> index_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Container with version counter, bumped on every mutable access.
+ * Queries started from it can be served from `result_cache` while version is unchanged.
+ */
+template <typename Container>
+class versioned final {
+public:
+  using container_type = Container;
+
+  explicit versioned(container_type container = {}) : container_(std::move(container)), id_(next_id()), version_(0) {}
+
+  /// Copies are distinct sources and never share cached results
+  versioned(const versioned& other) : container_(other.container_), id_(next_id()), version_(0) {}
+
+  versioned& operator=(const versioned& other) {
+    container_ = other.container_;
+    ++version_;
+    return *this;
+  }
+
+  const container_type& get() const noexcept {
+    return container_;
+  }
+
+  /// Returned reference should not be kept, later mutations through it are not versioned
+  container_type& modify() noexcept {
+    ++version_;
+    return container_;
+  }
+
+  uint64_t id() const noexcept {
+    return id_;
+  }
+
+  uint64_t version() const noexcept {
+    return version_;
+  }
+
+private:
+  static uint64_t next_id() noexcept {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+  }
+
+  container_type container_;
+  uint64_t       id_;
+  uint64_t       version_;
+};
+
+/*!
+ * Structural hash of a query: stage kinds, gate comparators and parameters, callable types.
+ * Besides the 64-bit hash every mixed part is recorded in `structure()`, which the cache compares
+ * on hit, so queries with colliding hashes never share results. Parameters are recorded exactly
+ * if they are strings or have unique object representation (integers, enums, plain structs),
+ * floating point parameters by their bits, other hashable parameters by their std::hash only.
+ * Query is not cacheable if some stage depends on state that cannot be hashed
+ * (capturing lambdas, stateful comparators, unhashable gate values, external containers).
+ * Fingerprint constructed as not recording ignores everything mixed into it and is never cacheable,
+ * so queries no cache can serve do not pay for it.
+ */
+class fingerprint final {
+public:
+  explicit fingerprint(bool recording = true) noexcept : cacheable_(recording), recording_(recording) {}
+
+  void mix(uint64_t value) noexcept {
+    if (!recording_) {
+      return;
+    }
+    state_ ^= value + 0x9e3779b97f4a7c15ULL + (state_ << 6) + (state_ >> 2);
+  }
+
+  template <typename T>
+  void mix_value(const T& value) {
+    if (!recording_) {
+      return;
+    }
+    if constexpr (requires { std::hash<T>{}(value); }) {
+      mix(std::hash<T>{}(value));
+      record_type<T>();
+      if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        record_string(value);
+      } else if constexpr (std::has_unique_object_representations_v<T> || std::is_floating_point_v<T>) {
+        record(&value, sizeof(T));
+      } else {
+        const size_t hash = std::hash<T>{}(value);
+        record(&hash, sizeof(hash));
+      }
+    } else {
+      cacheable_ = false;
+    }
+  }
+
+  template <typename Callable>
+  void mix_callable() {
+    if (!recording_) {
+      return;
+    }
+    mix(typeid(Callable).hash_code());
+    record_type<Callable>();
+    if constexpr (!std::is_empty_v<Callable>) {
+      cacheable_ = false;
+    }
+  }
+
+  /// Member pointers are recorded by value, other fields as callables, by type only
+  template <typename Field>
+  void mix_field(Field field) {
+    if (!recording_) {
+      return;
+    }
+    if constexpr (std::is_member_pointer_v<Field>) {
+      unsigned char bytes[sizeof(Field)];
+      std::memcpy(bytes, &field, sizeof(Field));
+      mix(std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(bytes), sizeof(Field))));
+      record_type<Field>();
+      record(bytes, sizeof(Field));
+    } else {
+      mix_callable<Field>();
+    }
+  }
+
+  void mix_name(std::string_view name) {
+    if (!recording_) {
+      return;
+    }
+    mix(std::hash<std::string_view>{}(name));
+    record_string(name);
+  }
+
+  void invalidate() noexcept {
+    cacheable_ = false;
+  }
+
+  uint64_t value() const noexcept {
+    return state_;
+  }
+
+  /// Exact sequence of mixed parts, equal for structurally equal queries
+  const std::string& structure() const noexcept {
+    return structure_;
+  }
+
+  bool cacheable() const noexcept {
+    return cacheable_;
+  }
+
+private:
+  void record(const void* bytes, size_t size) {
+    structure_.append(static_cast<const char*>(bytes), size);
+  }
+
+  /// Length prefixed, so consecutive strings cannot be split differently
+  void record_string(std::string_view value) {
+    const size_t size = value.size();
+    record(&size, sizeof(size));
+    structure_.append(value);
+  }
+
+  template <typename T>
+  void record_type() {
+    record_string(typeid(T).name());
+  }
+
+  uint64_t    state_     = 0;
+  std::string structure_;
+  bool        cacheable_;
+  bool        recording_;
+};
+
+/*!
+ * Bounded LRU cache of query results keyed by source identity, source version,
+ * query fingerprint and result type. Thread safe.
+ */
+class result_cache final {
+public:
+  /// Hit requires equal query structure, not only equal query hash
+  struct key {
+    uint64_t        source;
+    uint64_t        version;
+    uint64_t        query;
+    std::type_index result;
+    std::string     structure;
+
+    bool operator==(const key&) const = default;
+  };
+
+  struct statistics {
+    size_t hits        = 0;
+    size_t misses      = 0;
+    size_t uncacheable = 0;
+    size_t evictions   = 0;
+    size_t entries     = 0;
+    size_t bytes       = 0;
+  };
+
+  explicit result_cache(size_t capacity_bytes) noexcept : capacity_bytes_(capacity_bytes) {}
+
+  result_cache(const result_cache&) = delete;
+  result_cache& operator=(const result_cache&) = delete;
+
+  /*!
+   * Return cached result or compute and remember it. Result bigger than whole capacity is not stored.
+   */
+  template <typename Result, typename Compute>
+  std::shared_ptr<const Result> get_or_compute(const key& lookup, Compute compute) {
+    {
+      std::lock_guard lock(mutex_);
+      const auto found = index_.find(lookup);
+      if (found != index_.end()) {
+        ++statistics_.hits;
+        entries_.splice(entries_.begin(), entries_, found->second);
+        return std::static_pointer_cast<const Result>(found->second->value);
+      }
+      ++statistics_.misses;
+    }
+    auto result = std::make_shared<const Result>(compute());
+    // Key is stored twice, in entry and in index
+    const size_t bytes = estimate_bytes(*result) + 2 * lookup.structure.size();
+    std::lock_guard lock(mutex_);
+    if (bytes <= capacity_bytes_ && index_.find(lookup) == index_.end()) {
+      entries_.push_front({lookup, result, bytes});
+      index_.emplace(lookup, entries_.begin());
+      statistics_.bytes += bytes;
+      ++statistics_.entries;
+      evict();
+    }
+    return result;
+  }
+
+  void note_uncacheable() noexcept {
+    std::lock_guard lock(mutex_);
+    ++statistics_.uncacheable;
+  }
+
+  void clear() {
+    std::lock_guard lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    statistics_.entries = 0;
+    statistics_.bytes   = 0;
+  }
+
+  statistics stats() const {
+    std::lock_guard lock(mutex_);
+    return statistics_;
+  }
+
+private:
+  struct entry {
+    key                         lookup;
+    std::shared_ptr<const void> value;
+    size_t                      bytes;
+  };
+
+  struct key_hash {
+    size_t operator()(const key& lookup) const noexcept {
+      fingerprint hash;
+      hash.mix(lookup.source);
+      hash.mix(lookup.version);
+      hash.mix(lookup.query);
+      hash.mix(lookup.result.hash_code());
+      return static_cast<size_t>(hash.value());
+    }
+  };
+
+  template <typename Result>
+  static size_t estimate_bytes(const Result& result) noexcept {
+    if constexpr (requires { result.size(); typename Result::value_type; }) {
+      return sizeof(Result) + result.size() * sizeof(typename Result::value_type);
+    } else {
+      return sizeof(Result);
+    }
+  }
+
+  void evict() {
+    while (statistics_.bytes > capacity_bytes_ && !entries_.empty()) {
+      const entry& last = entries_.back();
+      statistics_.bytes -= last.bytes;
+      --statistics_.entries;
+      ++statistics_.evictions;
+      index_.erase(last.lookup);
+      entries_.pop_back();
+    }
+  }
+
+  mutable std::mutex                                          mutex_;
+  size_t                                                      capacity_bytes_;
+  std::list<entry>                                            entries_;
+  std::unordered_map<key, std::list<entry>::iterator, key_hash> index_;
+  statistics                                                  statistics_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * Result of a query over append-only sources, kept up to date incrementally.
+ *
+ * Remembers filter output, sorted order and aggregate partials (count, sum, min, max),
+ * `refresh()` processes only elements appended to the source and merged sources
+ * since previous refresh. If a source shrinks, the view is rebuilt from scratch.
+ * Keeping result sorted costs O(delta log delta) to sort the new rows plus a linear merge.
+ *
+ * @tparam Source random access container (vector, deque)
+ */
+template <typename Source, typename Buffer = std::vector<typename Source::value_type>>
+class incremental_view final {
+public:
+  using source_type = Source;
+  using buffer_type = Buffer;
+  using  value_type = typename source_type::value_type;
+
+  static_assert(std::random_access_iterator<typename source_type::const_iterator>, "Random access source expected");
+
+  explicit incremental_view(const source_type& source) : inputs_{{&source, 0}}, retain_rows_(true), sorted_(false) {}
+
+  template <typename T, typename Comparator>
+  incremental_view& where(gate<Comparator, T>&& logical_gate) {
+    return add_filter([logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element);
+    });
+  }
+
+  template <typename Field, typename T, typename Comparator>
+  incremental_view& where(Field field, gate<Comparator, T>&& logical_gate) {
+    return add_filter([field, logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element.*field);
+    });
+  }
+
+  template <typename Lambda>
+  incremental_view& where(Lambda lambda) {
+    return add_filter([lambda = std::move(lambda)](const value_type& element) {
+      return static_cast<bool>(lambda(element));
+    });
+  }
+
+  template <typename Field, typename Lambda>
+  incremental_view& where(Field field, Lambda lambda) {
+    return add_filter([field, lambda = std::move(lambda)](const value_type& element) {
+      return static_cast<bool>(lambda(element.*field));
+    });
+  }
+
+  /*!
+   * Also track another append-only source, filters apply to it as well.
+   */
+  incremental_view& merge(const source_type& other) {
+    inputs_.push_back({&other, 0});
+    reset();
+    return *this;
+  }
+
+  /*!
+   * Keep result rows in ascending order.
+   */
+  incremental_view& sort() {
+    sorted_ = true;
+    reset();
+    return *this;
+  }
+
+  /*!
+   * Maintain aggregates only, without storing result rows.
+   */
+  incremental_view& aggregates_only() {
+    retain_rows_ = false;
+    reset();
+    return *this;
+  }
+
+  /*!
+   * Apply elements appended to sources since previous refresh.
+   * @return number of new rows passing the filters
+   */
+  size_t refresh() {
+    for (const auto& current : inputs_) {
+      if (current.source->size() < current.processed) {
+        reset();
+        break;
+      }
+    }
+    buffer_type delta;
+    size_t selected = 0;
+    for (auto& current : inputs_) {
+      const source_type& source = *current.source;
+      const size_t end = source.size();
+      for (size_t i = current.processed; i < end; ++i) {
+        const value_type& element = source[i];
+        if (accepts(element)) {
+          accumulate(element);
+          if (retain_rows_) {
+            container_traits::any_push(delta, element);
+          }
+          ++selected;
+        }
+      }
+      current.processed = end;
+    }
+    append_rows(std::move(delta));
+    return selected;
+  }
+
+  const buffer_type& rows() const noexcept {
+    return rows_;
+  }
+
+  size_t count() const noexcept {
+    return count_;
+  }
+
+  /// Sum of selected rows, value-initialized if none. Kept for arithmetic rows only
+  value_type sum() const requires std::is_arithmetic_v<value_type> {
+    return sum_.value_or(value_type{});
+  }
+
+  /// Smallest selected row, nullopt if none
+  std::optional<value_type> min() const {
+    return min_;
+  }
+
+  /// Largest selected row, nullopt if none
+  std::optional<value_type> max() const {
+    return max_;
+  }
+
+private:
+  struct input {
+    const source_type* source;
+    /// Elements before this index are already reflected in the view
+    size_t             processed;
+  };
+
+  template <typename Test>
+  incremental_view& add_filter(Test test) {
+    filters_.emplace_back(std::move(test));
+    reset();
+    return *this;
+  }
+
+  bool accepts(const value_type& element) const {
+    for (const auto& filter : filters_) {
+      if (!filter(element)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void accumulate(const value_type& element) {
+    ++count_;
+    // Strings and other non-arithmetic types with + would grow the sum with every row
+    if constexpr (std::is_arithmetic_v<value_type>) {
+      sum_ = sum_ ? static_cast<value_type>(*sum_ + element) : element;
+    }
+    if constexpr (requires { element < element; }) {
+      if (!min_ || element < *min_) {
+        min_ = element;
+      }
+      if (!max_ || *max_ < element) {
+        max_ = element;
+      }
+    }
+  }
+
+  void append_rows(buffer_type&& delta) {
+    if (delta.empty()) {
+      return;
+    }
+    if (sorted_) {
+      std::sort(delta.begin(), delta.end());
+    }
+    const auto middle = static_cast<std::ptrdiff_t>(rows_.size());
+    if (rows_.empty()) {
+      rows_ = std::move(delta);
+    } else {
+      rows_.insert(rows_.end(), std::make_move_iterator(delta.begin()), std::make_move_iterator(delta.end()));
+    }
+    if (sorted_ && middle > 0) {
+      std::inplace_merge(rows_.begin(), rows_.begin() + middle, rows_.end());
+    }
+  }
+
+  void reset() {
+    for (auto& current : inputs_) {
+      current.processed = 0;
+    }
+    rows_.clear();
+    count_ = 0;
+    sum_.reset();
+    min_.reset();
+    max_.reset();
+  }
+
+  std::vector<input>                                   inputs_;
+  std::vector<std::function<bool(const value_type&)>> filters_;
+  bool                                                 retain_rows_;
+  bool                                                 sorted_;
+  buffer_type                                          rows_;
+  size_t                                               count_ = 0;
+  std::optional<value_type>                            sum_;
+  std::optional<value_type>                            min_;
+  std::optional<value_type>                            max_;
+};
+
+} // namespace query
+
+namespace query {
+namespace detail {
+
+template <typename Predicate, typename T>
+bool accepts(const Predicate& predicate, const T& value) {
+  if constexpr (requires { predicate.compare_with(value); }) {
+    return predicate.compare_with(value);
+  } else {
+    return static_cast<bool>(predicate(value));
+  }
+}
+
+} // namespace detail
+
+/// Sink of `shared_scan` appending accepted elements to container
+template <typename Target>
+auto collect_into(Target& target) {
+  return [&target](const auto& element) { container_traits::any_push(target, element); };
+}
+
+/// Sink of `shared_scan` counting accepted elements
+inline auto count_into(size_t& count) {
+  return [&count](const auto&) { ++count; };
+}
+
+/// Sink of `shared_scan` summing accepted elements, or their field
+template <typename T, typename Field = identity>
+auto sum_into(T& sum, Field field = {}) {
+  return [&sum, field](const auto& element) { sum += std::invoke(field, element); };
+}
+
+/// Sink of `shared_scan` keeping minimum of accepted elements, or of their field
+template <typename T, typename Field = identity>
+auto min_into(std::optional<T>& min, Field field = {}) {
+  return [&min, field](const auto& element) {
+    const auto& value = std::invoke(field, element);
+    if (!min || value < *min) {
+      min = value;
+    }
+  };
+}
+
+/// Sink of `shared_scan` keeping maximum of accepted elements, or of their field
+template <typename T, typename Field = identity>
+auto max_into(std::optional<T>& max, Field field = {}) {
+  return [&max, field](const auto& element) {
+    const auto& value = std::invoke(field, element);
+    if (!max || *max < value) {
+      max = value;
+    }
+  };
+}
+
+/*!
+ * Many queries evaluated in one pass over the same source. Every query is a predicate
+ * (callable or gate, on element or its field) or a `from` pipeline of where and take stages,
+ * and a sink receiving accepted elements, see `collect_into`, `count_into`, `sum_into`,
+ * `min_into`, `max_into`. Aggregates are computed by sinks; pipelines with merges, sorts
+ * or set operations cannot be shared, as their stages need more than one pass.
+ *
+ * Source is read in blocks of rows which stay in cache while every query runs its own
+ * loop over them, so memory bandwidth is paid once instead of once per query and
+ * dispatch to a query happens once per block. Scan ends early once every pipeline reached its take limit.
+ */
+template <typename Container>
+class shared_scan final {
+public:
+  using container_type = Container;
+  using     value_type = typename container_type::value_type;
+
+  explicit shared_scan(const container_type& source, size_t block_rows = 1024)
+    : source_    (source)
+    , block_rows_(std::max<size_t>(block_rows, 1)) {}
+
+  template <typename Predicate, typename Sink>
+    requires (!requires (Predicate& query, const container_type& source) { query.shared_filter(source); })
+  shared_scan& add(Predicate predicate, Sink sink) {
+    return add(identity{}, std::move(predicate), std::move(sink));
+  }
+
+  template <typename Field, typename Predicate, typename Sink>
+  shared_scan& add(Field field, Predicate predicate, Sink sink) {
+    queries_.push_back([field, predicate = std::move(predicate), sink = std::move(sink)](const value_type* const* rows, size_t count) mutable {
+      for (size_t i = 0; i < count; ++i) {
+        if (detail::accepts(predicate, std::invoke(field, *rows[i]))) {
+          sink(*rows[i]);
+        }
+      }
+      return true;
+    });
+    return *this;
+  }
+
+  /*!
+   * Register `from` pipeline over the same source, its where stages and take limits select rows.
+   * Filters of pipeline are moved out of it, so it is consumed at once, and run over whole blocks:
+   * one indirect call per block and per filter, the filter loop itself is called by its static type.
+   * @throw std::invalid_argument if pipeline has stages other than filters, see `from::shared_filter`
+   */
+  template <typename Query, typename Sink>
+    requires requires (Query& query, const container_type& source) { query.shared_filter(source); }
+  shared_scan& add(Query& query, Sink sink) {
+    queries_.push_back([select = query.shared_filter(source_), selected = std::vector<uint32_t>(block_rows_), sink = std::move(sink)](
+                         const value_type* const* rows, size_t count) mutable {
+      std::iota(selected.begin(), selected.begin() + count, uint32_t{0});
+      const batch_selection block = select(rows, selected.data(), count);
+      for (size_t i = 0; i < block.count; ++i) {
+        sink(*rows[selected[i]]);
+      }
+      return !block.stop;
+    });
+    return *this;
+  }
+
+  /*!
+   * Scan source once, feeding every registered query.
+   */
+  void run() {
+    std::vector<const value_type*> rows;
+    rows.reserve(block_rows_);
+    std::vector<size_t> active(queries_.size());
+    std::iota(active.begin(), active.end(), size_t{0});
+    for (auto it = std::begin(source_); it != std::end(source_) && !active.empty();) {
+      rows.clear();
+      for (; it != std::end(source_) && rows.size() < block_rows_; ++it) {
+        rows.push_back(&*it);
+      }
+      std::erase_if(active, [&](size_t query) { return !queries_[query](rows.data(), rows.size()); });
+    }
+  }
+
+  size_t queries() const noexcept {
+    return queries_.size();
+  }
+
+private:
+  const container_type&                                             source_;
+  size_t                                                            block_rows_;
+  /// Returns false once query needs no more rows
+  std::vector<std::function<bool(const value_type* const*, size_t)>> queries_;
+};
+
+} // namespace query
+
+namespace query {
+/*!
+ * HyperLogLog distinct count estimator over 2^precision one byte registers.
+ * Relative standard error is 1.04 / sqrt(2^precision), about 0.8% for default precision.
+ * Sketches of same precision merge into sketch of union of their inputs.
+ */
+template <typename T, typename Hash = std::hash<T>>
+class hyperloglog final {
+public:
+  using value_type = T;
+
+  /// @param precision number of index bits, 4..18
+  explicit hyperloglog(uint8_t precision = 14)
+    : precision_(std::clamp<uint8_t>(precision, 4, 18))
+    , registers_(size_t{1} << precision_, 0) {}
+
+  void add(const value_type& value) noexcept {
+    const uint64_t hash  = detail::mix_hash(Hash{}(value));
+    const size_t   index = hash >> (64 - precision_);
+    // Guard bit bounds rank when remaining bits are zero
+    const uint64_t rest  = (hash << precision_) | (uint64_t{1} << (precision_ - 1));
+    registers_[index] = std::max<uint8_t>(registers_[index], static_cast<uint8_t>(std::countl_zero(rest) + 1));
+  }
+
+  void merge(const hyperloglog& other) {
+    if (other.precision_ != precision_) {
+      throw std::invalid_argument("hyperloglog: precision mismatch");
+    }
+    for (size_t i = 0; i < registers_.size(); ++i) {
+      registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+  }
+
+  uint64_t estimate() const noexcept {
+    const double m = static_cast<double>(registers_.size());
+    double sum   = 0;
+    size_t zeros = 0;
+    for (const uint8_t rank : registers_) {
+      sum   += std::ldexp(1.0, -rank);
+      zeros += rank == 0;
+    }
+    const double alpha    = m >= 128 ? 0.7213 / (1 + 1.079 / m) : m >= 64 ? 0.709 : m >= 32 ? 0.697 : 0.673;
+    const double estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros != 0) {
+      // Linear counting is more precise for small cardinalities
+      return static_cast<uint64_t>(std::llround(m * std::log(m / static_cast<double>(zeros))));
+    }
+    return static_cast<uint64_t>(std::llround(estimate));
+  }
+
+  double standard_error() const noexcept {
+    return 1.04 / std::sqrt(static_cast<double>(registers_.size()));
+  }
+
+private:
+  uint8_t              precision_;
+  std::vector<uint8_t> registers_;
+};
+
+/*!
+ * KLL quantile sketch: levels of compactors, where level h holds items of weight 2^h
+ * and full level is sorted and every other item (random half) promoted to next level.
+ * Normalized rank error is about 1.65 / k with high probability, memory is O(k).
+ * Sketches merge into sketch of union of their inputs.
+ */
+template <typename T, typename Compare = std::less<T>>
+class kll_sketch final {
+public:
+  using value_type = T;
+
+  explicit kll_sketch(size_t k = 200, uint64_t seed = 0x9e3779b97f4a7c15ULL)
+    : k_     (std::max<size_t>(k, 8))
+    , random_(seed | 1)
+    , levels_(1) {}
+
+  void add(const value_type& value) {
+    levels_[0].push_back(value);
+    ++count_;
+    compact();
+  }
+
+  void merge(const kll_sketch& other) {
+    if (other.levels_.size() > levels_.size()) {
+      levels_.resize(other.levels_.size());
+    }
+    for (size_t level = 0; level < other.levels_.size(); ++level) {
+      levels_[level].insert(levels_[level].end(), other.levels_[level].begin(), other.levels_[level].end());
+    }
+    count_ += other.count_;
+    compact();
+  }
+
+  /*!
+   * @param q rank in [0, 1], 0.5 for median
+   * @return item whose rank is approximately q, empty if nothing was added
+   */
+  std::optional<value_type> quantile(double q) const {
+    std::vector<std::pair<const value_type*, uint64_t>> weighted;
+    uint64_t total = 0;
+    for (size_t level = 0; level < levels_.size(); ++level) {
+      for (const auto& item : levels_[level]) {
+        weighted.emplace_back(&item, uint64_t{1} << level);
+        total += uint64_t{1} << level;
+      }
+    }
+    if (weighted.empty()) {
+      return std::nullopt;
+    }
+    std::sort(weighted.begin(), weighted.end(), [](const auto& lhs, const auto& rhs) { return Compare{}(*lhs.first, *rhs.first); });
+    const double target = std::clamp(q, 0.0, 1.0) * static_cast<double>(total);
+    uint64_t cumulative = 0;
+    for (const auto& [item, weight] : weighted) {
+      cumulative += weight;
+      if (static_cast<double>(cumulative) >= target) {
+        return *item;
+      }
+    }
+    return *weighted.back().first;
+  }
+
+  uint64_t count() const noexcept {
+    return count_;
+  }
+
+  double normalized_rank_error() const noexcept {
+    return 1.65 / static_cast<double>(k_);
+  }
+
+private:
+  /// Capacity shrinks geometrically by 2/3 from top level down
+  size_t capacity(size_t level) const {
+    const size_t depth = levels_.size() - 1 - level;
+    return std::max<size_t>(2, static_cast<size_t>(static_cast<double>(k_) * std::pow(2.0 / 3.0, static_cast<double>(depth))));
+  }
+
+  void compact() {
+    for (size_t level = 0; level < levels_.size(); ++level) {
+      if (levels_[level].size() < capacity(level)) {
+        continue;
+      }
+      if (level + 1 == levels_.size()) {
+        levels_.emplace_back();
+      }
+      auto& items = levels_[level];
+      std::sort(items.begin(), items.end(), Compare{});
+      const size_t paired = items.size() / 2 * 2;
+      for (size_t i = next_bit(); i < paired; i += 2) {
+        levels_[level + 1].push_back(items[i]);
+      }
+      items.erase(items.begin(), items.begin() + paired);
+    }
+  }
+
+  size_t next_bit() noexcept {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    return random_ & 1;
+  }
+
+  size_t                               k_;
+  uint64_t                             random_;
+  uint64_t                             count_ = 0;
+  std::vector<std::vector<value_type>> levels_;
+};
+
+/*!
+ * Count-min sketch: depth rows of width counters. Estimate never underestimates and
+ * overestimates by at most epsilon * total count with probability 1 - delta.
+ */
+template <typename T, typename Hash = std::hash<T>>
+class count_min_sketch final {
+public:
+  using value_type = T;
+
+  explicit count_min_sketch(double epsilon = 0.001, double delta = 0.01)
+    : width_   (static_cast<size_t>(std::ceil(std::exp(1.0) / std::max(epsilon, 1e-9))))
+    , depth_   (static_cast<size_t>(std::ceil(std::log(1 / std::clamp(delta, 1e-9, 0.5)))))
+    , counters_(width_ * depth_, 0) {}
+
+  void add(const value_type& value, uint64_t count = 1) noexcept {
+    const uint64_t hash = detail::mix_hash(Hash{}(value));
+    for (size_t row = 0; row < depth_; ++row) {
+      counters_[row * width_ + column(hash, row)] += count;
+    }
+  }
+
+  uint64_t estimate(const value_type& value) const noexcept {
+    const uint64_t hash = detail::mix_hash(Hash{}(value));
+    uint64_t result = std::numeric_limits<uint64_t>::max();
+    for (size_t row = 0; row < depth_; ++row) {
+      result = std::min(result, counters_[row * width_ + column(hash, row)]);
+    }
+    return result;
+  }
+
+  void merge(const count_min_sketch& other) {
+    if (other.width_ != width_ || other.depth_ != depth_) {
+      throw std::invalid_argument("count_min_sketch: dimensions mismatch");
+    }
+    for (size_t i = 0; i < counters_.size(); ++i) {
+      counters_[i] += other.counters_[i];
+    }
+  }
+
+private:
+  /// Row hashes are derived from two halves of one hash (Kirsch-Mitzenmacher)
+  size_t column(uint64_t hash, size_t row) const noexcept {
+    return static_cast<size_t>(((hash & 0xffffffff) + row * (hash >> 32)) % width_);
+  }
+
+  size_t                width_;
+  size_t                depth_;
+  std::vector<uint64_t> counters_;
+};
+
+/*!
+ * Heavy hitters: count-min sketch of all elements plus a small set of candidates
+ * with largest estimated counts.
+ */
+template <typename T, typename Hash = std::hash<T>>
+class top_k_sketch final {
+public:
+  using value_type = T;
+
+  explicit top_k_sketch(size_t k, double epsilon = 0.001, double delta = 0.01)
+    : k_(std::max<size_t>(k, 1)), counts_(epsilon, delta) {}
+
+  void add(const value_type& value) {
+    counts_.add(value);
+    offer(value, counts_.estimate(value));
+  }
+
+  void merge(const top_k_sketch& other) {
+    counts_.merge(other.counts_);
+    auto candidates = std::move(heap_);
+    candidates.insert(candidates.end(), other.heap_.begin(), other.heap_.end());
+    heap_.clear();
+    positions_.clear();
+    for (const auto& [value, count] : candidates) {
+      offer(value, counts_.estimate(value));
+    }
+  }
+
+  /// At most k elements with estimated counts, most frequent first
+  std::vector<std::pair<value_type, uint64_t>> top() const {
+    std::vector<std::pair<value_type, uint64_t>> result(heap_.begin(), heap_.end());
+    std::sort(result.begin(), result.end(), [](const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; });
+    result.resize(std::min(result.size(), k_));
+    return result;
+  }
+
+private:
+  /*!
+   * Twice k candidates are tracked, so late risers are not evicted by noise.
+   * Candidates form a min-heap by estimate with position of every value, so both
+   * the smallest candidate and update of a known one cost O(log k).
+   */
+  void offer(const value_type& value, uint64_t estimate) {
+    if (auto found = positions_.find(value); found != positions_.end()) {
+      const size_t position = found->second;
+      heap_[position].second = estimate;
+      sift_down(sift_up(position));
+      return;
+    }
+    if (heap_.size() < 2 * k_) {
+      heap_.emplace_back(value, estimate);
+      positions_.emplace(value, heap_.size() - 1);
+      sift_up(heap_.size() - 1);
+      return;
+    }
+    if (heap_.front().second < estimate) {
+      positions_.erase(heap_.front().first);
+      heap_.front() = {value, estimate};
+      positions_.emplace(value, 0);
+      sift_down(0);
+    }
+  }
+
+  size_t sift_up(size_t position) {
+    while (position > 0) {
+      const size_t parent = (position - 1) / 2;
+      if (heap_[parent].second <= heap_[position].second) {
+        break;
+      }
+      swap_slots(parent, position);
+      position = parent;
+    }
+    return position;
+  }
+
+  void sift_down(size_t position) {
+    for (;;) {
+      size_t smallest = position;
+      for (const size_t child : { 2 * position + 1, 2 * position + 2 }) {
+        if (child < heap_.size() && heap_[child].second < heap_[smallest].second) {
+          smallest = child;
+        }
+      }
+      if (smallest == position) {
+        return;
+      }
+      swap_slots(smallest, position);
+      position = smallest;
+    }
+  }
+
+  void swap_slots(size_t lhs, size_t rhs) {
+    std::swap(heap_[lhs], heap_[rhs]);
+    positions_[heap_[lhs].first] = lhs;
+    positions_[heap_[rhs].first] = rhs;
+  }
+
+  size_t                                         k_;
+  count_min_sketch<value_type, Hash>             counts_;
+  std::vector<std::pair<value_type, uint64_t>>   heap_;
+  std::unordered_map<value_type, size_t, Hash>   positions_;
+};
+
+} // namespace query
+
+namespace query {
+/// Seed of samplers when none is given, so repeated queries return same sample
+inline constexpr uint64_t default_seed = 0x9e3779b97f4a7c15ULL;
+
+namespace detail {
+
+/// Uniform double in open interval (0, 1)
+inline double open_unit(std::mt19937_64& random) noexcept {
+  return (static_cast<double>(random() >> 11) + 0.5) * 0x1.0p-53;
+}
+
+} // namespace detail
+
+/*!
+ * Uniform sample of at most capacity items of a stream (reservoir, Algorithm L).
+ * Once full, number of items to skip before next replacement is drawn at once,
+ * so sampling n of N items takes O(n (1 + log(N / n))) random numbers.
+ * Reservoirs of disjoint streams merge into uniform sample of their union.
+ */
+template <typename T>
+class reservoir final {
+public:
+  using value_type = T;
+
+  explicit reservoir(size_t capacity, uint64_t seed = default_seed)
+    : capacity_(capacity), random_(seed) {
+    items_.reserve(capacity_);
+  }
+
+  template <typename U>
+  void add(U&& value) {
+    if (items_.size() < capacity_) {
+      items_.emplace_back(std::forward<U>(value));
+      if (++seen_ == capacity_) {
+        restart();
+      }
+      return;
+    }
+    if (capacity_ != 0 && seen_ == next_) {
+      items_[std::uniform_int_distribution<size_t>(0, capacity_ - 1)(random_)] = std::forward<U>(value);
+      weight_ *= std::exp(std::log(detail::open_unit(random_)) / static_cast<double>(capacity_));
+      draw_next(seen_);
+    }
+    ++seen_;
+  }
+
+  /// Number of upcoming items that will not enter the sample
+  uint64_t skip() const noexcept {
+    if (items_.size() < capacity_) {
+      return 0;
+    }
+    return capacity_ == 0 ? std::numeric_limits<uint64_t>::max() : next_ - seen_;
+  }
+
+  /// Account for count items not entering the sample, at most `skip()`
+  void skip(uint64_t count) noexcept {
+    seen_ += count;
+  }
+
+  /*!
+   * Merge sample of disjoint stream. Each slot takes an item from either side with
+   * probability proportional to number of items that side has seen.
+   */
+  void merge(reservoir other) {
+    std::shuffle(items_.begin(), items_.end(), random_);
+    std::shuffle(other.items_.begin(), other.items_.end(), random_);
+    std::vector<value_type> merged;
+    merged.reserve(capacity_);
+    uint64_t left  = seen_;
+    uint64_t right = other.seen_;
+    size_t   lhs   = 0;
+    size_t   rhs   = 0;
+    while (merged.size() < capacity_ && (lhs < items_.size() || rhs < other.items_.size())) {
+      const bool take_left = rhs == other.items_.size() ||
+        (lhs < items_.size() && std::uniform_int_distribution<uint64_t>(0, left + right - 1)(random_) < left);
+      if (take_left) {
+        merged.push_back(std::move(items_[lhs++]));
+        --left;
+      } else {
+        merged.push_back(std::move(other.items_[rhs++]));
+        --right;
+      }
+    }
+    items_ = std::move(merged);
+    seen_ += other.seen_;
+    if (items_.size() == capacity_ && capacity_ != 0) {
+      restart();
+    }
+  }
+
+  const std::vector<value_type>& items() const noexcept {
+    return items_;
+  }
+
+  uint64_t seen() const noexcept {
+    return seen_;
+  }
+
+private:
+  /// Largest of capacity smallest keys of seen items is Beta(capacity, seen - capacity + 1)
+  void restart() {
+    const double smallest = std::gamma_distribution<double>(static_cast<double>(capacity_))(random_);
+    const double rest     = std::gamma_distribution<double>(static_cast<double>(seen_ - capacity_ + 1))(random_);
+    weight_ = smallest / (smallest + rest);
+    draw_next(seen_ - 1);
+  }
+
+  /// Position of next replacement after item at given position
+  void draw_next(uint64_t last) {
+    next_ = last + static_cast<uint64_t>(std::floor(std::log(detail::open_unit(random_)) / std::log1p(-weight_))) + 1;
+  }
+
+  size_t                  capacity_;
+  std::mt19937_64         random_;
+  std::vector<value_type> items_;
+  uint64_t                seen_   = 0;
+  uint64_t                next_   = 0;
+  double                  weight_ = 0;
+};
+
+/*!
+ * Sample of at most capacity items where inclusion probability grows with item
+ * weight (A-ExpJ). Every item gets key u^(1/weight), largest keys are kept, and
+ * once full, total weight to skip before next replacement is drawn at once.
+ * Keys are independent, so reservoirs of disjoint streams merge by keeping largest keys.
+ */
+template <typename T>
+class weighted_reservoir final {
+public:
+  using value_type = T;
+
+  explicit weighted_reservoir(size_t capacity, uint64_t seed = default_seed)
+    : capacity_(capacity), random_(seed) {
+    entries_.reserve(capacity_);
+  }
+
+  /// Items of zero or negative weight are never sampled
+  template <typename U>
+  void add(U&& value, double weight) {
+    if (!(weight > 0) || capacity_ == 0) {
+      return;
+    }
+    if (entries_.size() < capacity_) {
+      push({ std::log(detail::open_unit(random_)) / weight, std::forward<U>(value) });
+      if (entries_.size() == capacity_) {
+        draw_jump();
+      }
+      return;
+    }
+    jump_ -= weight;
+    if (jump_ > 0) {
+      return;
+    }
+    // Key of replacing item is conditioned on exceeding smallest kept key
+    const double threshold = std::exp(entries_.front().key * weight);
+    const double key       = threshold + detail::open_unit(random_) * (1 - threshold);
+    std::pop_heap(entries_.begin(), entries_.end(), by_key);
+    entries_.back() = { std::log(key) / weight, std::forward<U>(value) };
+    std::push_heap(entries_.begin(), entries_.end(), by_key);
+    draw_jump();
+  }
+
+  void merge(weighted_reservoir other) {
+    for (auto& entry : other.entries_) {
+      push(std::move(entry));
+      if (entries_.size() > capacity_) {
+        std::pop_heap(entries_.begin(), entries_.end(), by_key);
+        entries_.pop_back();
+      }
+    }
+    if (entries_.size() == capacity_ && capacity_ != 0) {
+      draw_jump();
+    }
+  }
+
+  std::vector<value_type> items() const {
+    std::vector<value_type> result;
+    result.reserve(entries_.size());
+    for (const auto& entry : entries_) {
+      result.push_back(entry.value);
+    }
+    return result;
+  }
+
+private:
+  struct entry {
+    double     key;
+    value_type value;
+  };
+
+  /// Min-heap on logarithm of key, smallest kept key on top
+  static bool by_key(const entry& lhs, const entry& rhs) noexcept {
+    return lhs.key > rhs.key;
+  }
+
+  void push(entry item) {
+    entries_.push_back(std::move(item));
+    std::push_heap(entries_.begin(), entries_.end(), by_key);
+  }
+
+  void draw_jump() {
+    jump_ = std::log(detail::open_unit(random_)) / entries_.front().key;
+  }
+
+  size_t             capacity_;
+  std::mt19937_64    random_;
+  std::vector<entry> entries_;
+  double             jump_ = 0;
+};
+
+/*!
+ * Bernoulli sampler keeping every item with probability p. Gap to next kept item
+ * is geometric and drawn at once, so skipped items cost a decrement.
+ */
+class bernoulli_sampler final {
+public:
+  explicit bernoulli_sampler(double probability, uint64_t seed = default_seed)
+    : probability_(probability), random_(seed) {
+    draw_gap();
+  }
+
+  bool operator()() noexcept {
+    if (gap_ != 0) {
+      --gap_;
+      return false;
+    }
+    draw_gap();
+    return true;
+  }
+
+  /// Number of upcoming items that will be skipped
+  uint64_t gap() const noexcept {
+    return gap_;
+  }
+
+private:
+  void draw_gap() noexcept {
+    if (probability_ >= 1) {
+      gap_ = 0;
+    } else if (!(probability_ > 0)) {
+      gap_ = std::numeric_limits<uint64_t>::max();
+    } else {
+      const double gap = std::floor(std::log(detail::open_unit(random_)) / std::log1p(-probability_));
+      gap_ = gap >= 0x1.0p63 ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(gap);
+    }
+  }
+
+  double          probability_;
+  std::mt19937_64 random_;
+  uint64_t        gap_ = 0;
+};
+
+} // namespace query
+
+namespace query {
+/// Partition key of window covering all rows
+struct whole_partition final {
+  template <typename T>
+  constexpr int operator()(const T&) const noexcept {
+    return 0;
+  }
+};
+
+/*!
+ * Frame of window functions: rows of partition from its start up to current row
+ * (cumulative), or last `rows` rows of partition up to current row (sliding).
+ * Partition is field or key function, rows of partition do not have to be adjacent.
+ */
+template <typename Partition = whole_partition>
+struct window final {
+  Partition partition;
+  /// 0 for cumulative frame
+  size_t    rows = 0;
+};
+
+inline window<> over(size_t rows = 0) {
+  return { whole_partition{}, rows };
+}
+
+template <typename Partition>
+  requires (!std::is_integral_v<Partition>)
+window<Partition> over(Partition partition, size_t rows = 0) {
+  return { partition, rows };
+}
+
+namespace detail {
+
+/*!
+ * Visit rows in order (or in reverse order), passing state of row's partition.
+ */
+template <typename State, typename Row, typename Partition, typename Step>
+void scan_partitions(const std::vector<Row*>& rows, const Partition& partition, bool backward, Step step) {
+  const auto visit = [&](auto&& state_of) {
+    for (size_t i = 0; i < rows.size(); ++i) {
+      const size_t row = backward ? rows.size() - 1 - i : i;
+      step(state_of(*rows[row]), row);
+    }
+  };
+  if constexpr (std::is_same_v<Partition, whole_partition>) {
+    State state{};
+    visit([&](Row&) -> State& { return state; });
+  } else {
+    using key_type = std::remove_cvref_t<std::invoke_result_t<const Partition&, Row&>>;
+    std::unordered_map<key_type, State> states;
+    visit([&](Row& row) -> State& { return states[std::invoke(partition, row)]; });
+  }
+}
+
+} // namespace detail
+} // namespace query
+
+namespace query {
+/*!
+ * Rewrites applied by `from` planner to the chain as written.
+ */
+struct plan_rewrites {
+  /// where stages evaluated in the same scan as preceding where
+  size_t fused_filters       = 0;
+  /// where stages applied to each merge input before merging
+  size_t filters_below_merge = 0;
+  /// where stages evaluated before pending sort
+  size_t filters_before_sort = 0;
+  /// take limits ending the scan as soon as they are reached
+  size_t limits_pushed_down  = 0;
+  /// sorts dropped because buffer is already ordered or sorted again later
+  size_t elided_sorts        = 0;
+  /// where stages answered by secondary index lookup instead of a scan
+  size_t index_lookups       = 0;
+  /// where stages answered by binary search over ordered source or buffer
+  size_t range_selections    = 0;
+};
+
+/*!
+ * Supported operations:
+ * - where
+ * - take
+ * - merge
+ * - sort
+ * - reverse sort
+ * - reverse
+ * - union with
+ * - difference with
+ * - intersect with
+ * - to
+ * - write to
+ * - to binary
+ * - min
+ * - max
+ * - sum
+ *
+ * where, merge and sort are not executed immediately but recorded and rewritten
+ * into a single scan of every input, run by the next stage needing the buffer:
+ * consecutive where stages are fused, where stages are pushed below merge and
+ * before sort, take ends the scan early and redundant sorts are dropped.
+ * Merged containers are read at that point, so they should outlive the query.
+ * See `plan()` and `rewrites()`.
+ *
+ * With `stage_profiler` as ProfilePolicy every stage is timed and `explain()`
+ * prints the executed chain, see `profiled_from`.
+ */
+template <
+  typename Container,
+  typename Buffer                                           = Container,
+  template <typename          > typename WherePolicy        = where,
+  template <typename          > typename SetOperationPolicy = set_operation,
+  template <typename          > typename NumericPolicy      = numeric,
+  template <typename          > typename OrderPolicy        = order,
+  template <typename, typename> typename MergePolicy        = merge,
+  template <typename, typename> typename CastPolicy         = cast,
+  typename ProfilePolicy                                    = null_profiler
+>
+class from final {
+public:
+  using   container_type = Container;
+  using      buffer_type = Buffer;
+  using       value_type = typename buffer_type::value_type;
+  using     where_policy = WherePolicy<buffer_type>;
+  using       set_policy = SetOperationPolicy<buffer_type>;
+  template <typename T1>
+  using   numeric_policy = NumericPolicy<T1>;
+  template <typename T1>
+  using     order_policy = OrderPolicy<T1>;
+  template <typename T1, typename T2>
+  using     merge_policy = MergePolicy<T1, T2>;
+  template <typename T1, typename T2>
+  using      cast_policy = CastPolicy<T1, T2>;
+  using   profile_policy = ProfilePolicy;
+
+  explicit from(const container_type& container)
+    : container_       (&container)
+    , buffer_          ()
+    , buffer_populated_(false)
+    , ordered_         (container_traits::is_ordered_container<container_type>::value)
+    , elements_to_take_(-1) {}
+
+  /*!
+   * Query over versioned source, its terminals can be served from `result_cache`.
+   */
+  explicit from(const versioned<container_type>& source) : from(source.get()) {
+    source_id_      = source.id();
+    source_version_ = source.version();
+    fingerprint_    = query::fingerprint();
+    fingerprint_.mix_name(typeid(from).name());
+  }
+
+  /*!
+   * Take ownership of expiring source, it becomes the working buffer without copying.
+   * Terminal `to()` of such query moves the buffer out, so owning query is one-shot.
+   */
+  explicit from(container_type&& container)
+    : container_       (nullptr)
+    , buffer_          ()
+    , buffer_populated_(true)
+    , ordered_         (container_traits::is_ordered_container<container_type>::value)
+    , elements_to_take_(-1) {
+    if constexpr (std::is_same_v<container_type, buffer_type>) {
+      buffer_ = std::move(container);
+    } else {
+      merge_policy<buffer_type, container_type> policy;
+      policy(buffer_, std::move(container));
+    }
+  }
+
+  template <typename T, typename Comparator>
+  from& where(gate<Comparator, T>&& logical_gate) {
+    [[maybe_unused]] stage_guard stage(*this, "where", stage_effect::deferred);
+    fingerprint_.mix_name("where");
+    fingerprint_.mix_callable<Comparator>();
+    fingerprint_.mix_value(logical_gate.value());
+    if (select_by_index(identity{}, logical_gate) || select_by_range<false>(logical_gate)) {
+      return *this;
+    }
+    add_filter("where", [logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element);
+    });
+    return *this;
+  }
+
+  template <typename Field, typename T, typename Comparator>
+  from& where(Field field, gate<Comparator, T>&& logical_gate) {
+    [[maybe_unused]] stage_guard stage(*this, "where", stage_effect::deferred);
+    fingerprint_.mix_name("where");
+    fingerprint_.mix_field(field);
+    fingerprint_.mix_callable<Comparator>();
+    fingerprint_.mix_value(logical_gate.value());
+    if (select_by_index(field, logical_gate)) {
+      return *this;
+    }
+    add_filter("where", [field, logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element.*field);
+    });
+    return *this;
+  }
+
+  template <typename T, typename Comparator>
+  from& where_key(gate<Comparator, T>&& logical_gate) {
+    [[maybe_unused]] stage_guard stage(*this, "where_key", stage_effect::deferred);
+    fingerprint_.mix_name("where_key");
+    fingerprint_.mix_callable<Comparator>();
+    fingerprint_.mix_value(logical_gate.value());
+    if (select_by_range<true>(logical_gate)) {
+      return *this;
+    }
+    add_filter("where_key", [logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element.first);
+    });
+    return *this;
+  }
+
+  template <typename Field, typename T, typename Comparator>
+  from& where_key(Field field, gate<Comparator, T>&& logical_gate) {
+    [[maybe_unused]] stage_guard stage(*this, "where_key", stage_effect::deferred);
+    fingerprint_.mix_name("where_key");
+    fingerprint_.mix_field(field);
+    fingerprint_.mix_callable<Comparator>();
+    fingerprint_.mix_value(logical_gate.value());
+    add_filter("where_key", [field, logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element.first.*field);
+    });
+    return *this;
+  }
+
+  template <typename T, typename Comparator>
+  from& where_value(gate<Comparator, T>&& logical_gate) {
+    [[maybe_unused]] stage_guard stage(*this, "where_value", stage_effect::deferred);
+    fingerprint_.mix_name("where_value");
+    fingerprint_.mix_callable<Comparator>();
+    fingerprint_.mix_value(logical_gate.value());
+    add_filter("where_value", [logical_gate = std::move(logical_gate)](const value_type& element) {
+      return logical_gate.compare_with(element.second);
+    });
+    return *this;
+  }
+
+  template <typename Lambda>
+  from& where(Lambda lambda) {
+    [[maybe_unused]] stage_guard stage(*this, "where", stage_effect::deferred);
+    fingerprint_.mix_name("where");
+    fingerprint_.mix_callable<Lambda>();
+    add_filter("where", [lambda = std::move(lambda)](const value_type& element) {
+      return static_cast<bool>(lambda(element));
+    });
+    return *this;
+  }
+
+  template <typename Field, typename Lambda>
+  from& where(Field field, Lambda lambda) {
+    [[maybe_unused]] stage_guard stage(*this, "where", stage_effect::deferred);
+    fingerprint_.mix_name("where");
+    fingerprint_.mix_field(field);
+    fingerprint_.mix_callable<Lambda>();
+    add_filter("where", [field, lambda = std::move(lambda)](const value_type& element) {
+      return static_cast<bool>(lambda(element.*field));
+    });
+    return *this;
+  }
+
+  /*!
+   * Register secondary index over the source. First where with a gate on the indexed
+   * field (or whole element) and standard comparator is answered by index lookup
+   * instead of a scan. Index must outlive the query.
+   */
+  from& with_index(const index_base<typename container_type::value_type>& index) {
+    indexes_.push_back(&index);
+    return *this;
+  }
+
+  from& take(ssize_t to_take) {
+    fingerprint_.mix_name("take");
+    fingerprint_.mix_value(to_take);
+    elements_to_take_ = to_take;
+    return *this;
+  }
+
+  /*!
+   * Run filters over batches of rows with selection vectors instead of element at a time,
+   * amortizing per-element dispatch over the batch. 0 restores element at a time scan.
+   */
+  from& batch(size_t rows = 1024) noexcept {
+    batch_size_ = rows;
+    return *this;
+  }
+
+  template <typename Target>
+  from& merge(const Target& with) {
+    [[maybe_unused]] stage_guard stage(*this, "merge", stage_effect::deferred);
+    fingerprint_.invalidate();
+    add_segment([&with](from& query, buffer_type& result, size_t first_filter) {
+      query.scan_segment(result, with, first_filter);
+    });
+    return *this;
+  }
+
+  template <typename Target>
+    requires (!std::is_lvalue_reference_v<Target>)
+  from& merge(Target&& with) {
+    [[maybe_unused]] stage_guard stage(*this, "merge", stage_effect::deferred);
+    fingerprint_.invalidate();
+    auto owned = std::make_shared<Target>(std::move(with));
+    add_segment([owned](from& query, buffer_type& result, size_t first_filter) {
+      query.scan_segment(result, std::move(*owned), first_filter);
+    });
+    return *this;
+  }
+
+  template <typename T>
+  from& merge(std::initializer_list<T> with) {
+    return merge(std::vector<T>(with));
+  }
+
+  from& sort() {
+    [[maybe_unused]] stage_guard stage(*this, "sort", stage_effect::deferred);
+    fingerprint_.mix_name("sort");
+    if constexpr (container_traits::is_ordered_container<buffer_type>::value) {
+      ++rewrites_.elided_sorts;
+    } else {
+      set_pending_order("sort", true, [](buffer_type& buffer) {
+        order_policy<buffer_type> policy(buffer);
+        policy.sort();
+      });
+    }
+    return *this;
+  }
+
+  from& reverse_sort() requires requires (order_policy<buffer_type> policy) { policy.reverse_sort(); } {
+    [[maybe_unused]] stage_guard stage(*this, "reverse_sort", stage_effect::deferred);
+    fingerprint_.mix_name("reverse_sort");
+    set_pending_order("reverse_sort", false, [](buffer_type& buffer) {
+      order_policy<buffer_type> policy(buffer);
+      policy.reverse_sort();
+    });
+    return *this;
+  }
+
+  from& reverse() requires requires (order_policy<buffer_type> policy) { policy.reverse(); } {
+    materialize();
+    [[maybe_unused]] stage_guard stage(*this, "reverse", stage_effect::in_place);
+    fingerprint_.mix_name("reverse");
+    order_policy<buffer_type> policy(buffer_);
+    policy.reverse();
+    ordered_ = false;
+    return *this;
+  }
+
+  template <typename Target>
+  from& union_with(Target&& container) {
+    materialize();
+    [[maybe_unused]] stage_guard stage(*this, "union_with", stage_effect::rebuild);
+    fingerprint_.invalidate();
+    set_policy policy(buffer_);
+    policy.union_with(std::forward<Target>(container));
+    return *this;
+  }
+
+  template <typename Target>
+  from& intersect_with(Target&& container) {
+    materialize();
+    [[maybe_unused]] stage_guard stage(*this, "intersect_with", stage_effect::rebuild);
+    fingerprint_.invalidate();
+    set_policy policy(buffer_);
+    policy.intersect_with(std::forward<Target>(container));
+    return *this;
+  }
+
+  template <typename Target>
+  from& difference_with(Target&& container) {
+    materialize();
+    [[maybe_unused]] stage_guard stage(*this, "difference_with", stage_effect::rebuild);
+    fingerprint_.invalidate();
+    set_policy policy(buffer_);
+    policy.difference_with(std::forward<Target>(container));
+    return *this;
+  }
+
+  /*!
+   * Keep uniform random sample of n elements, in their current order.
+   * Same seed over same input gives same sample.
+   */
+  from& sample(size_t n, uint64_t seed = default_seed) {
+    return sample_by(n, nullptr, std::nullopt, seed);
+  }
+
+  /*!
+   * Keep random sample of n elements, element chosen with probability growing with its weight.
+   */
+  template <typename Weight>
+    requires std::invocable<Weight&, const value_type&>
+  from& sample(size_t n, Weight weight, uint64_t seed = default_seed) {
+    return sample_by(n, std::move(weight), std::nullopt, seed);
+  }
+
+  /*!
+   * Same as `sample(n)`, threads sample chunks of rows and merge reservoirs.
+   * Sample depends on seed and number of threads.
+   */
+  from& sample(size_t n, parallel mode, uint64_t seed = default_seed) {
+    return sample_by(n, nullptr, mode, seed);
+  }
+
+  /// Weight is called concurrently by threads, so it has to be callable as const
+  template <typename Weight>
+    requires std::invocable<const Weight&, const value_type&>
+  from& sample(size_t n, Weight weight, parallel mode, uint64_t seed = default_seed) {
+    return sample_by(n, std::move(weight), mode, seed);
+  }
+
+  /*!
+   * Keep every element with probability p, independently, see `bernoulli_sampler`.
+   */
+  from& sample_fraction(double p, uint64_t seed = default_seed) {
+    [[maybe_unused]] stage_guard stage(*this, "sample_fraction", stage_effect::deferred);
+    fingerprint_.mix_name("sample_fraction");
+    fingerprint_.mix_value(p);
+    fingerprint_.mix_value(seed);
+    add_filter("sample_fraction", [sampler = bernoulli_sampler(p, seed)](const value_type&) mutable {
+      return sampler();
+    });
+    return *this;
+  }
+
+  /*!
+   * Keep first occurrence of every element, preserving order.
+   * Deduplication by hash table, so elements have to be hashable.
+   */
+  from& distinct() {
+    fingerprint_.mix_name("distinct");
+    return add_distinct(identity{});
+  }
+
+  /*!
+   * Keep first element having each value of field, preserving order.
+   */
+  template <typename Field>
+  from& distinct(Field field) {
+    fingerprint_.mix_name("distinct");
+    fingerprint_.mix_field(field);
+    return add_distinct(field);
+  }
+
+  /*!
+   * Same as `distinct()`, computed by threads owning hash partitions.
+   */
+  from& distinct(parallel mode) {
+    fingerprint_.mix_name("distinct");
+    return parallel_distinct(identity{}, mode);
+  }
+
+  template <typename Field>
+  from& distinct(Field field, parallel mode) {
+    fingerprint_.mix_name("distinct");
+    fingerprint_.mix_field(field);
+    return parallel_distinct(field, mode);
+  }
+
+  template <typename Target>
+  Target to(Target) {
+    return to<Target>();
+  }
+
+  /*!
+   * Convert result to Target. Buffer of query owning its source is moved out and the query
+   * is consumed: later terminals throw `std::logic_error`. Other queries copy the buffer
+   * and stay usable.
+   */
+  template <typename Target = buffer_type>
+  Target to() {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "to", stage_effect::convert);
+    if (!buffer_populated_) {
+      cast_policy<container_type, Target> policy;
+      return policy(*container_);
+    } else if (owns_source()) {
+      consumed_by_ = "to";
+      cast_policy<buffer_type, Target> policy;
+      return policy(std::move(buffer_));
+    } else {
+      cast_policy<buffer_type, Target> policy;
+      return policy(buffer_);
+    }
+  }
+
+  /*!
+   * Render result as text (same format as `to(std::string{})`) into sink.
+   * @param sink std::ostream or callable with `std::string_view`
+   */
+  template <typename Sink>
+  void write_to(Sink&& sink) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "write_to", stage_effect::convert);
+    if (!buffer_populated_) {
+      cast_policy<container_type, std::string>::write(*container_, sink);
+    } else {
+      cast_policy<buffer_type, std::string>::write(buffer_, sink);
+    }
+  }
+
+  /*!
+   * Serialize result into compact binary columns, see `query::binary`.
+   * Read back by `query::from_binary` or viewed in place by `query::binary::view`.
+   */
+  std::vector<std::byte> to_binary() {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "to_binary", stage_effect::convert);
+    return buffer_populated_ ? binary::encode(buffer_) : binary::encode(*container_);
+  }
+
+  auto min() {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "min", stage_effect::aggregate);
+    if (!buffer_populated_) {
+      numeric_policy<container_type> policy(*container_);
+      return policy.min();
+    } else {
+      numeric_policy<buffer_type> policy(buffer_);
+      return policy.min();
+    }
+  }
+
+  auto max() {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "max", stage_effect::aggregate);
+    if (!buffer_populated_) {
+      numeric_policy<container_type> policy(*container_);
+      return policy.max();
+    } else {
+      numeric_policy<buffer_type> policy(buffer_);
+      return policy.max();
+    }
+  }
+
+  auto sum() {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "sum", stage_effect::aggregate);
+    if (!buffer_populated_) {
+      numeric_policy<container_type> policy(*container_);
+      return policy.sum();
+    } else {
+      numeric_policy<buffer_type> policy(buffer_);
+      return policy.sum();
+    }
+  }
+
+  /*!
+   * Sort result under memory budget and pass it to sink in ascending order, spilling
+   * sorted runs to temporary files, see `external_sorter`. Filters pending over the source
+   * feed runs directly, so the source is never copied into buffer. Query is one-shot:
+   * pending stages are consumed on either path, and later terminals throw `std::logic_error`.
+   * @param sink callable with `value_type&&`
+   */
+  template <typename Sink>
+  void sort_to(Sink&& sink, external mode = {}) {
+    external_sort("sort_to", std::less<>{}, sink, mode);
+  }
+
+  /*!
+   * Same as `sort_to`, in descending order.
+   */
+  template <typename Sink>
+  void reverse_sort_to(Sink&& sink, external mode = {}) {
+    external_sort("reverse_sort_to", std::greater<>{}, sink, mode);
+  }
+
+  /*!
+   * Split result into n buffers by hash of field, keeping order inside every buffer.
+   * Equal keys land in the same buffer, so buffers can go to independent consumers.
+   * Rows are hashed once to count partition sizes, then scattered into presized buffers.
+   * Query owning its source moves rows into buffers and is consumed, like by `to()`.
+   */
+  template <typename Field>
+  std::vector<buffer_type> partition_by(Field field, size_t n) {
+    return partition_rows(field, n, std::nullopt);
+  }
+
+  /*!
+   * Same as `partition_by(field, n)`, rows are hashed by chunks and every thread
+   * fills the buffers it owns.
+   */
+  template <typename Field>
+  std::vector<buffer_type> partition_by(Field field, size_t n, parallel mode) {
+    return partition_rows(field, n, mode);
+  }
+
+  std::vector<buffer_type> partition_by(size_t n) {
+    return partition_rows(identity{}, n, std::nullopt);
+  }
+
+  /*!
+   * Estimated number of distinct elements by HyperLogLog, see `hyperloglog`.
+   */
+  uint64_t approx_count_distinct(uint8_t precision = 14) {
+    return feed("approx_count_distinct", hyperloglog<std::remove_cv_t<value_type>>(precision)).estimate();
+  }
+
+  /*!
+   * Element of approximately given rank by KLL sketch, see `kll_sketch`.
+   * @param q rank in [0, 1], 0.5 for median
+   */
+  auto approx_quantile(double q, size_t k = 200) {
+    return feed("approx_quantile", kll_sketch<std::remove_cv_t<value_type>>(k)).quantile(q);
+  }
+
+  /*!
+   * At most k most frequent elements with estimated counts by count-min sketch,
+   * see `count_min_sketch` for epsilon and delta.
+   */
+  auto approx_top_k(size_t k, double epsilon = 0.001, double delta = 0.01) {
+    return feed("approx_top_k", top_k_sketch<std::remove_cv_t<value_type>>(k, epsilon, delta)).top();
+  }
+
+  /*!
+   * Add every element to sketch (anything with `add(element)` and `merge(other)`) and return it.
+   * Returned sketch can be merged with sketches of other queries, shards or later appends.
+   */
+  template <typename Sketch>
+  Sketch sketch(Sketch sketch) {
+    return feed("sketch", std::move(sketch));
+  }
+
+  /*!
+   * Same as `sketch(Sketch)`, every thread fills its own copy of sketch over a chunk
+   * of rows and copies are merged.
+   */
+  template <typename Sketch>
+  Sketch sketch(const Sketch& prototype, parallel mode) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "sketch", stage_effect::aggregate);
+    return with_rows([&](const auto& rows) {
+      const size_t threads = std::max<size_t>(1, std::min(mode.threads, rows.size() / 4096 + 1));
+      const size_t chunk   = (rows.size() + threads - 1) / threads;
+      std::vector<Sketch> partial(threads, prototype);
+      detail::run_parallel(threads, [&](size_t thread) {
+        const size_t end = std::min(rows.size(), (thread + 1) * chunk);
+        for (size_t row = thread * chunk; row < end; ++row) {
+          partial[thread].add(*rows[row]);
+        }
+      });
+      for (size_t thread = 1; thread < threads; ++thread) {
+        partial[0].merge(partial[thread]);
+      }
+      return std::move(partial[0]);
+    });
+  }
+
+  /*!
+   * Number of distinct elements, without building deduplicated buffer.
+   */
+  size_t count_distinct() {
+    return count_distinct_by(identity{}, std::nullopt);
+  }
+
+  template <typename Field>
+  size_t count_distinct(Field field) {
+    return count_distinct_by(field, std::nullopt);
+  }
+
+  size_t count_distinct(parallel mode) {
+    return count_distinct_by(identity{}, mode);
+  }
+
+  template <typename Field>
+  size_t count_distinct(Field field, parallel mode) {
+    return count_distinct_by(field, mode);
+  }
+
+  /*!
+   * Sum of field over window frame of every row, in buffer order. Over `sort()`
+   * output gives running sums (`over()`) or moving sums (`over(rows)`) in O(n).
+   */
+  template <typename Partition = whole_partition, typename Field = identity>
+  auto window_sum(window<Partition> frame = {}, Field field = {}) {
+    return window_aggregate("window_sum", frame, field, [](const auto& sum, size_t) { return sum; });
+  }
+
+  /*!
+   * Average of field over window frame of every row, e.g. moving average by `over(rows)`.
+   */
+  template <typename Partition = whole_partition, typename Field = identity>
+  std::vector<double> window_average(window<Partition> frame = {}, Field field = {}) {
+    return window_aggregate("window_average", frame, field, [](const auto& sum, size_t count) {
+      return static_cast<double>(sum) / static_cast<double>(count);
+    });
+  }
+
+  /*!
+   * Field of row `offset` rows before every row in its partition, empty for first rows.
+   * Frame size is not used.
+   */
+  template <typename Partition = whole_partition, typename Field = identity>
+  auto lag(size_t offset = 1, window<Partition> frame = {}, Field field = {}) {
+    return window_shift("lag", offset, frame, field, false);
+  }
+
+  /*!
+   * Field of row `offset` rows after every row in its partition, empty for last rows.
+   */
+  template <typename Partition = whole_partition, typename Field = identity>
+  auto lead(size_t offset = 1, window<Partition> frame = {}, Field field = {}) {
+    return window_shift("lead", offset, frame, field, true);
+  }
+
+  /*!
+   * Rank of every row in its partition with ties sharing rank and leaving gaps (SQL RANK).
+   * Rows are expected in order of field within partition, e.g. output of `sort()`.
+   */
+  template <typename Partition = whole_partition, typename Field = identity>
+  std::vector<size_t> rank(window<Partition> frame = {}, Field field = {}) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "rank", stage_effect::aggregate);
+    return with_rows([&](const auto& rows) {
+      using key_type = window_key<decltype(rows), Field>;
+      struct state {
+        size_t                  rows = 0;
+        size_t                  rank = 0;
+        std::optional<key_type> previous;
+      };
+      std::vector<size_t> result(rows.size());
+      detail::scan_partitions<state>(rows, frame.partition, false, [&](state& partition, size_t row) {
+        const auto& value = std::invoke(field, *rows[row]);
+        ++partition.rows;
+        if (!partition.previous || !(*partition.previous == value)) {
+          partition.rank     = partition.rows;
+          partition.previous = value;
+        }
+        result[row] = partition.rank;
+      });
+      return result;
+    });
+  }
+
+  /*!
+   * Same as `to()`, but result is looked up in cache by source version and query
+   * fingerprint. Queries over unversioned sources or with unhashable stages are computed every time.
+   */
+  template <typename Target = buffer_type>
+  std::shared_ptr<const Target> cached_to(result_cache& cache) {
+    return cached<Target>(cache, "to", [this] { return to<Target>(); });
+  }
+
+  auto cached_min(result_cache& cache) {
+    using result_type = decltype(min());
+    return *cached<result_type>(cache, "min", [this] { return min(); });
+  }
+
+  auto cached_max(result_cache& cache) {
+    using result_type = decltype(max());
+    return *cached<result_type>(cache, "max", [this] { return max(); });
+  }
+
+  auto cached_sum(result_cache& cache) {
+    using result_type = decltype(sum());
+    return *cached<result_type>(cache, "sum", [this] { return sum(); });
+  }
+
+  /*!
+   * Recorded where stages with their take limits as a block selector, for `shared_scan`:
+   * it narrows selection vector of a block of source rows and tells whether scan can end.
+   * Filters are moved into the selector, every filter runs over the whole block before the next one,
+   * and the query is consumed: its terminals throw `std::logic_error` afterwards.
+   * @throw std::invalid_argument if query is not a chain of filters over given source
+   *        (merges, sorts, set operations, owned source, answered by index)
+   */
+  std::function<batch_selection(const value_type* const*, uint32_t*, size_t)> shared_filter(const container_type& source)
+    requires std::is_same_v<std::remove_cv_t<typename container_type::value_type>, std::remove_cv_t<value_type>> {
+    if (container_ != &source || buffer_populated_ || !segments_.empty() || pending_order_ != nullptr) {
+      throw std::invalid_argument("from: only filters over the scanned source can be shared");
+    }
+    consumed_by_ = "shared_scan";
+    std::function<batch_selection(const value_type* const*, uint32_t*, size_t)> select =
+      [filters = std::move(filters_)](const value_type* const* rows, uint32_t* selected, size_t count) mutable {
+        return batch_chain(filters, 0)(rows, selected, count);
+      };
+    filters_.clear();
+    return select;
+  }
+
+  /*!
+   * Structural hash of stages recorded so far. Recorded only for queries over versioned source,
+   * the only ones `cached_to()` and other cached terminals can serve.
+   */
+  const query::fingerprint& fingerprint() const noexcept {
+    return fingerprint_;
+  }
+
+  /*!
+   * Pending plan, one line per scanned input with filters applied to it,
+   * followed by pending sort. Empty if nothing is pending.
+   */
+  std::string plan() const {
+    std::string result;
+    if (!has_pending()) {
+      return result;
+    }
+    result += buffer_populated_ ? "scan buffer" : "scan source";
+    describe_filters(result, 0);
+    for (const auto& input : segments_) {
+      result += "\nscan merge";
+      describe_filters(result, input.first_filter);
+    }
+    if (pending_order_ != nullptr) {
+      result += '\n';
+      result += pending_order_name_;
+    }
+    return result;
+  }
+
+  const plan_rewrites& rewrites() const noexcept {
+    return rewrites_;
+  }
+
+  const profile_policy& profiler() const noexcept {
+    return profiler_;
+  }
+
+  profile_policy& profiler() noexcept {
+    return profiler_;
+  }
+
+  /*!
+   * Print executed stages as plan tree with their statistics.
+   */
+  void explain(std::ostream& stream) const requires (profile_policy::enabled) {
+    profiler_.explain(stream);
+  }
+
+private:
+  enum struct stage_effect { deferred, in_place, rebuild, convert, aggregate };
+
+  /*!
+   * Records one stage into profiler on destruction.
+   * Member template, so it is not instantiated by explicit instantiation of `from` without profiler.
+   */
+  template <typename = profile_policy>
+  class active_stage_guard final {
+  public:
+    active_stage_guard(from& query, const char* name, stage_effect effect)
+      : query_           (query)
+      , name_            (name)
+      , effect_          (effect)
+      , rows_in_         (query.rows())
+      , allocated_before_(query.profiler_.allocated_bytes())
+      , start_           (std::chrono::steady_clock::now()) {}
+
+    active_stage_guard(const active_stage_guard&) = delete;
+    active_stage_guard& operator=(const active_stage_guard&) = delete;
+
+    ~active_stage_guard() {
+      const auto   time    = std::chrono::steady_clock::now() - start_;
+      const size_t rebuilt = effect_ == stage_effect::rebuild;
+      size_t rows_out = rows_in_;
+      if (effect_ == stage_effect::aggregate) {
+        rows_out = 1;
+      } else if (effect_ == stage_effect::in_place || effect_ == stage_effect::rebuild) {
+        rows_out = query_.rows();
+      }
+      const size_t bytes = query_.profiler_.counts_allocations()
+        ? query_.profiler_.allocated_bytes() - allocated_before_
+        : rebuilt * rows_out * sizeof(value_type);
+      query_.profiler_.record({
+        name_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time),
+        rows_in_,
+        rows_out,
+        bytes,
+        rebuilt
+      });
+    }
+
+  private:
+    from&                                 query_;
+    const char*                           name_;
+    stage_effect                          effect_;
+    size_t                                rows_in_;
+    size_t                                allocated_before_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  struct null_stage_guard final {
+    constexpr null_stage_guard(from&, const char*, stage_effect) noexcept {}
+  };
+
+  using stage_guard = std::conditional_t<profile_policy::enabled, active_stage_guard<>, null_stage_guard>;
+
+  /*!
+   * Test of recorded where stage, type-erased without allocation: tests up to `inline_size`
+   * bytes are stored inline and called through a table of functions instantiated for their type.
+   * Element, batch and whole-source scans all run the one stored test, so stateful filters
+   * (distinct, sampling) keep one state when inputs are scanned in different ways.
+   */
+  class filter_test final {
+  public:
+    static constexpr size_t inline_size = 64;
+
+    template <typename Test>
+    explicit filter_test(Test test) : operations_(&operations_of<Test>) {
+      if constexpr (stored_inline<Test>) {
+        ::new (static_cast<void*>(inline_)) Test(std::move(test));
+      } else {
+        heap_ = new Test(std::move(test));
+      }
+    }
+
+    filter_test(const filter_test& other) : operations_(other.operations_) {
+      operations_->copy(*this, other);
+    }
+
+    filter_test(filter_test&& other) noexcept : operations_(other.operations_) {
+      operations_->move(*this, other);
+    }
+
+    filter_test& operator=(const filter_test& other) {
+      if (this != &other) {
+        filter_test copy(other);
+        *this = std::move(copy);
+      }
+      return *this;
+    }
+
+    filter_test& operator=(filter_test&& other) noexcept {
+      if (this != &other) {
+        operations_->destroy(*this);
+        operations_ = other.operations_;
+        operations_->move(*this, other);
+      }
+      return *this;
+    }
+
+    ~filter_test() {
+      operations_->destroy(*this);
+    }
+
+    bool operator()(const value_type& element) {
+      return operations_->test(target(), element);
+    }
 
-  class vector_deque_order final {
-  public:
-    explicit vector_deque_order(buffer_type& buffer) : buffer_(buffer) {}
+    /// Narrows selection vector of a batch, returns number of rows left. Selection is compacted without branches.
+    size_t batch(const value_type* const* rows, uint32_t* selected, size_t count) {
+      return operations_->batch(target(), rows, selected, count);
+    }
 
-    void sort() {
-      std::sort(std::begin(buffer_), std::end(buffer_), [](const auto& lhs, const auto& rhs) { return lhs < rhs; });
+    /// Append rows of source accepted by this test alone, with test called by its static type
+    void scan(const container_type& source, buffer_type& result) {
+      operations_->scan(target(), source, result);
     }
 
-    void reverse_sort() {
-      std::sort(std::begin(buffer_), std::end(buffer_), [](const auto& lhs, const auto& rhs) { return lhs > rhs; });
+  private:
+    struct operations {
+      bool   (*test)(void*, const value_type&);
+      size_t (*batch)(void*, const value_type* const*, uint32_t*, size_t);
+      void   (*scan)(void*, const container_type&, buffer_type&);
+      void   (*copy)(filter_test&, const filter_test&);
+      void   (*move)(filter_test&, filter_test&) noexcept;
+      void   (*destroy)(filter_test&) noexcept;
+    };
+
+    template <typename Test>
+    static constexpr bool stored_inline = sizeof(Test) <= inline_size &&
+                                          alignof(Test) <= alignof(std::max_align_t) &&
+                                          std::is_nothrow_move_constructible_v<Test>;
+
+    template <typename Test, typename Holder>
+    static auto& stored(Holder& holder) noexcept {
+      using stored_type = std::conditional_t<std::is_const_v<Holder>, const Test, Test>;
+      if constexpr (stored_inline<Test>) {
+        return *std::launder(reinterpret_cast<stored_type*>(holder.inline_));
+      } else {
+        return *static_cast<stored_type*>(holder.heap_);
+      }
     }
 
-    void reverse() {
-      std::reverse(std::begin(buffer_), std::end(buffer_));
+    template <typename Test>
+    static constexpr operations operations_of = {
+      [](void* test, const value_type& element) {
+        return static_cast<bool>((*static_cast<Test*>(test))(element));
+      },
+      [](void* test, const value_type* const* rows, uint32_t* selected, size_t count) {
+        Test& current = *static_cast<Test*>(test);
+        size_t left = 0;
+        for (size_t i = 0; i < count; ++i) {
+          const uint32_t row = selected[i];
+          selected[left] = row;
+          left += static_cast<bool>(current(*rows[row]));
+        }
+        return left;
+      },
+      [](void* test, const container_type& source, buffer_type& result) {
+        Test& current = *static_cast<Test*>(test);
+        auto selector = [&current](const value_type& element) {
+          return static_cast<bool>(current(element)) ? selection::keep : selection::skip;
+        };
+        where_policy policy(result);
+        policy.append(source, selector);
+      },
+      [](filter_test& holder, const filter_test& other) {
+        if constexpr (stored_inline<Test>) {
+          ::new (static_cast<void*>(holder.inline_)) Test(stored<Test>(other));
+        } else {
+          holder.heap_ = new Test(stored<Test>(other));
+        }
+      },
+      [](filter_test& holder, filter_test& other) noexcept {
+        if constexpr (stored_inline<Test>) {
+          ::new (static_cast<void*>(holder.inline_)) Test(std::move(stored<Test>(other)));
+        } else {
+          holder.heap_ = std::exchange(other.heap_, nullptr);
+        }
+      },
+      [](filter_test& holder) noexcept {
+        if constexpr (stored_inline<Test>) {
+          stored<Test>(holder).~Test();
+        } else {
+          delete static_cast<Test*>(std::exchange(holder.heap_, nullptr));
+        }
+      }
+    };
+
+    void* target() noexcept {
+      return heap_ != nullptr ? heap_ : static_cast<void*>(inline_);
+    }
+
+    const operations* operations_;
+    void*             heap_ = nullptr;
+    alignas(std::max_align_t) unsigned char inline_[inline_size];
+  };
+
+  /*!
+   * Recorded where stage. Limit is the take count in effect when it was recorded,
+   * shared by all inputs it applies to.
+   */
+  struct filter {
+    const char* name;
+    filter_test test;
+    ssize_t     limit;
+    ssize_t     taken;
+  };
+
+  /// Few stages are kept inline, so short chains do not allocate
+  using filter_list = small_vector<filter, 4>;
+
+  /*!
+   * Selector running filters recorded since given input was merged.
+   */
+  class filter_chain final {
+  public:
+    filter_chain(filter_list& filters, size_t first) noexcept : filters_(filters), first_(first) {}
+
+    selection operator()(const value_type& element) {
+      for (size_t i = first_; i < filters_.size(); ++i) {
+        filter& current = filters_[i];
+        if (current.limit >= 0 && current.taken >= current.limit) {
+          return selection::stop;
+        }
+        if (!current.test(element)) {
+          return selection::skip;
+        }
+        if (current.limit >= 0) {
+          ++current.taken;
+        }
+      }
+      return selection::keep;
     }
 
   private:
-    buffer_type& buffer_;
+    filter_list&         filters_;
+    size_t               first_;
   };
 
-  class list_order final {
+  /*!
+   * Batch selector running filters recorded since given input was merged,
+   * each over whole selection vector before the next one.
+   */
+  class batch_chain final {
   public:
-    explicit list_order(buffer_type& buffer) : buffer_(buffer) {}
+    batch_chain(filter_list& filters, size_t first) noexcept : filters_(filters), first_(first) {}
 
-    void         sort() { buffer_.sort(); }
-    void reverse_sort() { buffer_.sort(); buffer_.reverse(); }
-    void reverse     () { buffer_.reverse(); }
+    batch_selection operator()(const value_type* const* rows, uint32_t* selected, size_t count) {
+      bool stop = false;
+      for (size_t i = first_; i < filters_.size() && count > 0; ++i) {
+        filter& current = filters_[i];
+        if (current.limit >= 0 && current.taken >= current.limit) {
+          return { 0, true };
+        }
+        count = current.test.batch(rows, selected, count);
+        if (current.limit >= 0) {
+          count = std::min(count, static_cast<size_t>(current.limit - current.taken));
+          current.taken += count;
+          stop = stop || current.taken >= current.limit;
+        }
+      }
+      return { count, stop };
+    }
 
   private:
-    buffer_type& buffer_;
+    filter_list&         filters_;
+    size_t               first_;
   };
 
-public:
-  explicit order(buffer_type& buffer) : buffer_(buffer) {}
+  /*!
+   * Recorded merge input, scanned after the source in recording order.
+   */
+  struct segment {
+    std::function<void(from&, buffer_type&, size_t)> scan;
+    size_t                                           first_filter;
+  };
 
-  void sort()
-    requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque<T>>) {
-    vector_deque_order order(buffer_);
-    order.sort();
+  using segment_list = small_vector<segment, 2>;
+
+  using order_step = void (*)(buffer_type&);
+
+  template <typename Test>
+  void add_filter(const char* name, Test test) {
+    static_assert(container_traits::is_appendable<buffer_type>::value, "Buffer does not support appending");
+    if (elements_to_take_ >= 0 && pending_order_ != nullptr) {
+      // Limit selects first elements in sorted order, so sort has to run first
+      materialize();
+    }
+    if (!filters_.empty()) {
+      ++rewrites_.fused_filters;
+    }
+    if (!segments_.empty()) {
+      ++rewrites_.filters_below_merge;
+    }
+    if (pending_order_ != nullptr) {
+      ++rewrites_.filters_before_sort;
+    }
+    if (elements_to_take_ >= 0) {
+      ++rewrites_.limits_pushed_down;
+    }
+    filters_.push_back({name, filter_test(std::move(test)), elements_to_take_, 0});
   }
 
-  void sort() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
-    list_order order(buffer_);
-    order.sort();
+  template <typename Field>
+  from& add_distinct(Field field) {
+    [[maybe_unused]] stage_guard stage(*this, "distinct", stage_effect::deferred);
+    if (pending_order_ != nullptr) {
+      // First occurrence is taken in sorted order, so distinct cannot move before sort
+      materialize();
+    }
+    using key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, const value_type&>>;
+    add_filter("distinct", [field, seen = flat_hash_set<key_type>()](const value_type& element) mutable {
+      return seen.insert(std::invoke(field, element));
+    });
+    return *this;
   }
 
-  void reverse_sort() requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque <T>>) {
-    vector_deque_order order(buffer_);
-    order.reverse_sort();
+  template <typename Field>
+  from& parallel_distinct(Field field, parallel mode) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "distinct", stage_effect::rebuild);
+    buffer_type result;
+    const auto select = [&](auto& source) {
+      std::vector<char> keep;
+      detail::partitioned_distinct(rows_of(source), key_of(field), mode.threads, &keep);
+      size_t row = 0;
+      for (auto& element : source) {
+        if (keep[row++]) {
+          container_traits::any_push(result, std::move(element));
+        }
+      }
+    };
+    if (!buffer_populated_) {
+      select(*container_);
+    } else {
+      select(buffer_);
+    }
+    buffer_ = std::move(result);
+    buffer_populated_ = true;
+    return *this;
   }
 
-  void reverse_sort() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
-    list_order order(buffer_);
-    order.reverse_sort();
+  /*!
+   * Reservoir sample of row positions, so rows skipped by reservoir are never read
+   * unless weighted. Kept rows are then extracted in one ordered pass.
+   */
+  template <typename Weight>
+  from& sample_by(size_t n, Weight weight, std::optional<parallel> mode, uint64_t seed) {
+    constexpr bool weighted = !std::is_null_pointer_v<Weight>;
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "sample", stage_effect::rebuild);
+    fingerprint_.mix_name("sample");
+    fingerprint_.mix_value(n);
+    fingerprint_.mix_value(seed);
+    fingerprint_.mix_value(mode ? mode->threads : 0);
+    if constexpr (weighted) {
+      fingerprint_.mix_callable<Weight>();
+    }
+    using reservoir_type = std::conditional_t<weighted, weighted_reservoir<size_t>, reservoir<size_t>>;
+    const auto select = [&](const auto& rows, size_t count) {
+      const size_t threads = mode ? std::max<size_t>(1, std::min(mode->threads, count / 4096 + 1)) : 1;
+      const size_t chunk   = (count + threads - 1) / threads;
+      std::vector<reservoir_type> partial;
+      for (size_t thread = 0; thread < threads; ++thread) {
+        partial.emplace_back(n, detail::mix_hash(seed + thread));
+      }
+      detail::run_parallel(threads, [&](size_t thread) {
+        auto&        sampled = partial[thread];
+        const size_t end     = std::min(count, (thread + 1) * chunk);
+        for (size_t row = thread * chunk; row < end;) {
+          if constexpr (weighted) {
+            if constexpr (std::invocable<const Weight&, const value_type&>) {
+              sampled.add(row, static_cast<double>(std::invoke(std::as_const(weight), *rows[row])));
+            } else {
+              // Only sequential sample accepts callables needing mutable access
+              sampled.add(row, static_cast<double>(std::invoke(weight, *rows[row])));
+            }
+            ++row;
+          } else {
+            const size_t skipped = static_cast<size_t>(std::min<uint64_t>(sampled.skip(), end - row));
+            sampled.skip(skipped);
+            row += skipped;
+            if (row < end) {
+              sampled.add(row++);
+            }
+          }
+        }
+      });
+      for (size_t thread = 1; thread < threads; ++thread) {
+        partial[0].merge(std::move(partial[thread]));
+      }
+      std::vector<size_t> positions = partial[0].items();
+      std::sort(positions.begin(), positions.end());
+      return positions;
+    };
+    std::vector<size_t> positions;
+    if constexpr (weighted) {
+      positions = with_rows([&](const auto& rows) { return select(rows, rows.size()); });
+    } else {
+      positions = select(nullptr, buffer_populated_ ? count_rows(buffer_) : count_rows(*container_));
+    }
+    keep_positions(positions);
+    return *this;
   }
 
-  void reverse() requires (std::is_same_v<Buffer, std::vector<T>> || std::is_same_v<Buffer, std::deque <T>>) {
-    vector_deque_order order(buffer_);
-    order.reverse();
+  template <typename Compare, typename Sink>
+  void external_sort(const char* name, Compare compare, Sink& sink, external mode) {
+    external_sorter<std::remove_cv_t<value_type>, Compare> sorter(mode, compare);
+    if (!buffer_populated_ && segments_.empty() && pending_order_ == nullptr) {
+      [[maybe_unused]] stage_guard stage(*this, name, stage_effect::aggregate);
+      filter_chain chain(filters_, 0);
+      for (const auto& element : *container_) {
+        const selection selected = chain(element);
+        if (selected == selection::stop) {
+          break;
+        }
+        if (selected == selection::keep) {
+          sorter.add(element);
+        }
+      }
+      filters_.clear();
+    } else {
+      execute_pending();
+      [[maybe_unused]] stage_guard stage(*this, name, stage_effect::aggregate);
+      for (auto& element : buffer_) {
+        if (owns_source()) {
+          sorter.add(std::move(element));
+        } else {
+          sorter.add(element);
+        }
+      }
+      container_traits::any_clear(buffer_);
+    }
+    consumed_by_ = name;
+    sorter.drain(sink);
   }
 
-  void reverse() requires (std::is_same_v<Buffer, std::list<T>> || std::is_same_v<Buffer, std::forward_list<T>>) {
-    list_order order(buffer_);
-    order.reverse();
+  template <typename Field>
+  std::vector<buffer_type> partition_rows(Field field, size_t n, std::optional<parallel> mode) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "partition_by", stage_effect::aggregate);
+    n = std::max<size_t>(n, 1);
+    const size_t threads = mode ? mode->threads : 1;
+    std::vector<buffer_type> result(n);
+    const auto presize = [&](const std::vector<size_t>& sizes) {
+      if constexpr (requires (buffer_type& buffer) { buffer.reserve(size_t{}); }) {
+        for (size_t index = 0; index < n; ++index) {
+          result[index].reserve(sizes[index]);
+        }
+      }
+    };
+    // Rows of owned buffer are mutable, so they are moved instead of copied
+    const auto scatter = [&](auto& source) {
+      const size_t count = count_rows(source);
+      if (threads == 1 || count < 2 * 4096) {
+        using key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, decltype(*std::begin(source))>>;
+        std::vector<uint32_t> partition;
+        std::vector<size_t>   sizes(n, 0);
+        partition.reserve(count);
+        for (const auto& element : source) {
+          const size_t index = detail::partition_of(flat_hash_set<key_type>::hash(std::invoke(field, element)), n);
+          partition.push_back(static_cast<uint32_t>(index));
+          ++sizes[index];
+        }
+        presize(sizes);
+        size_t row = 0;
+        for (auto& element : source) {
+          container_traits::any_push(result[partition[row++]], std::move(element));
+        }
+        return;
+      }
+      std::vector<std::remove_reference_t<decltype(*std::begin(source))>*> rows;
+      rows.reserve(count);
+      for (auto& element : source) {
+        rows.push_back(&element);
+      }
+      const detail::partition_histogram histogram = detail::hash_partitions(rows, key_of(field), n, threads);
+      const size_t chunks = histogram.chunks.size();
+      const auto chunk_rows = [&](size_t chunk) {
+        return std::pair(chunk * histogram.chunk, std::min(rows.size(), (chunk + 1) * histogram.chunk));
+      };
+      if constexpr (requires (buffer_type& buffer, value_type& element) {
+                      buffer.resize(size_t{});
+                      buffer[size_t{}] = std::move(element);
+                    } && std::is_default_constructible_v<value_type>) {
+        // Chunk writes its rows to its own offsets of presized buffers, in source order
+        std::vector<std::vector<size_t>> offsets(chunks, std::vector<size_t>(n));
+        for (size_t index = 0; index < n; ++index) {
+          size_t offset = 0;
+          for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            offsets[chunk][index] = offset;
+            offset += histogram.chunks[chunk][index];
+          }
+          result[index].resize(offset);
+        }
+        detail::run_parallel(chunks, [&](size_t chunk) {
+          auto& offset = offsets[chunk];
+          const auto [first, last] = chunk_rows(chunk);
+          for (size_t row = first; row < last; ++row) {
+            const uint32_t index = histogram.partition[row];
+            result[index][offset[index]++] = std::move(*rows[row]);
+          }
+        });
+      } else {
+        // Buffers without random access: chunks fill own buffers, joined per partition in chunk order
+        std::vector<std::vector<buffer_type>> local(chunks, std::vector<buffer_type>(n));
+        detail::run_parallel(chunks, [&](size_t chunk) {
+          const auto [first, last] = chunk_rows(chunk);
+          for (size_t row = first; row < last; ++row) {
+            container_traits::any_push(local[chunk][histogram.partition[row]], std::move(*rows[row]));
+          }
+        });
+        presize(histogram.sizes(n));
+        const size_t owners = std::min(threads, n);
+        detail::run_parallel(owners, [&](size_t thread) {
+          for (size_t index = thread; index < n; index += owners) {
+            for (size_t chunk = 0; chunk < chunks; ++chunk) {
+              for (auto& element : local[chunk][index]) {
+                container_traits::any_push(result[index], std::move(element));
+              }
+            }
+          }
+        });
+      }
+    };
+    if (!buffer_populated_) {
+      scatter(*container_);
+    } else if (owns_source()) {
+      // Rows are moved out, later terminals would see moved-from rows
+      consumed_by_ = "partition_by";
+      scatter(buffer_);
+    } else {
+      scatter(std::as_const(buffer_));
+    }
+    return result;
   }
 
-private:
-  buffer_type& buffer_;
-};
+  /// Replace result with rows at given ascending positions
+  void keep_positions(const std::vector<size_t>& positions) {
+    buffer_type result;
+    const auto select = [&](auto& source) {
+      size_t row  = 0;
+      size_t next = 0;
+      for (auto& element : source) {
+        if (next == positions.size()) {
+          break;
+        }
+        if (positions[next] == row++) {
+          container_traits::any_push(result, std::move(element));
+          ++next;
+        }
+      }
+    };
+    if (!buffer_populated_) {
+      select(*container_);
+    } else {
+      select(buffer_);
+    }
+    buffer_ = std::move(result);
+    buffer_populated_ = true;
+  }
 
-} // namespace query
+  template <typename Field>
+  size_t count_distinct_by(Field field, std::optional<parallel> mode) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, "count_distinct", stage_effect::aggregate);
+    const auto count = [&](const auto& source) {
+      if (mode) {
+        return detail::partitioned_distinct(rows_of(source), key_of(field), mode->threads, nullptr);
+      }
+      using key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, decltype(*std::begin(source))>>;
+      flat_hash_set<key_type> seen;
+      for (const auto& element : source) {
+        seen.insert(std::invoke(field, element));
+      }
+      return seen.size();
+    };
+    return buffer_populated_ ? count(buffer_) : count(*container_);
+  }
 
-namespace query {
-/*!
- * Supported operations:
- * - where
- * - take
- * - merge
- * - sort
- * - reverse sort
- * - reverse
- * - union with
- * - difference with
- * - intersect with
- * - to
- * - min
- * - max
- * - sum
- */
-template <
-  typename Container,
-  typename Buffer                                           = Container,
-  template <typename          > typename WherePolicy        = where,
-  template <typename          > typename SetOperationPolicy = set_operation,
-  template <typename          > typename NumericPolicy      = numeric,
-  template <typename          > typename OrderPolicy        = order,
-  template <typename, typename> typename MergePolicy        = merge,
-  template <typename, typename> typename CastPolicy         = cast
->
-class from final {
-public:
-  using   container_type = Container;
-  using      buffer_type = Buffer;
-  using     where_policy = WherePolicy<buffer_type>;
-  using       set_policy = SetOperationPolicy<buffer_type>;
-  template <typename T1>
-  using   numeric_policy = NumericPolicy<T1>;
-  template <typename T1>
-  using     order_policy = OrderPolicy<T1>;
-  template <typename T1, typename T2>
-  using     merge_policy = MergePolicy<T1, T2>;
-  template <typename T1, typename T2>
-  using      cast_policy = CastPolicy<T1, T2>;
+  template <typename Sketch>
+  Sketch feed(const char* name, Sketch sketch) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, name, stage_effect::aggregate);
+    const auto add_all = [&](const auto& source) {
+      for (const auto& element : source) {
+        sketch.add(element);
+      }
+    };
+    if (buffer_populated_) {
+      add_all(buffer_);
+    } else {
+      add_all(*container_);
+    }
+    return sketch;
+  }
 
-  explicit from(const container_type& container) : container_(container), elements_to_take_(-1) {}
+  template <typename Rows, typename Field>
+  using window_key = std::remove_cvref_t<std::invoke_result_t<const Field&, decltype(**std::declval<Rows>().begin())>>;
 
-  template <typename T, typename Comparator>
-  from& where(gate<Comparator, T>&& logical_gate) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_gate(logical_gate);
-    return *this;
+  template <typename Function>
+  auto with_rows(Function function) {
+    return buffer_populated_ ? function(rows_of(buffer_)) : function(rows_of(*container_));
   }
 
-  template <typename Field, typename T, typename Comparator>
-  from& where(Field field, gate<Comparator, T>&& logical_gate) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_gate(field, logical_gate);
-    return *this;
+  /*!
+   * Running sum and row count of frame, finished into result of every row.
+   */
+  template <typename Partition, typename Field, typename Finish>
+  auto window_aggregate(const char* name, const window<Partition>& frame, Field field, Finish finish) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, name, stage_effect::aggregate);
+    return with_rows([&](const auto& rows) {
+      using key_type = window_key<decltype(rows), Field>;
+      struct state {
+        key_type             sum{};
+        size_t               count = 0;
+        std::deque<key_type> frame;
+      };
+      std::vector<std::invoke_result_t<Finish&, const key_type&, size_t>> result(rows.size());
+      detail::scan_partitions<state>(rows, frame.partition, false, [&](state& partition, size_t row) {
+        const auto& value = std::invoke(field, *rows[row]);
+        partition.sum += value;
+        if (frame.rows == 0) {
+          ++partition.count;
+        } else {
+          partition.frame.push_back(value);
+          if (partition.frame.size() > frame.rows) {
+            partition.sum -= partition.frame.front();
+            partition.frame.pop_front();
+          }
+          partition.count = partition.frame.size();
+        }
+        result[row] = finish(partition.sum, partition.count);
+      });
+      return result;
+    });
   }
 
-  template <typename T, typename Comparator>
-  from& where_key(gate<Comparator, T>&& logical_gate) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_gate(where_policy::select_policy::by_key, logical_gate);
-    return *this;
+  template <typename Partition, typename Field>
+  auto window_shift(const char* name, size_t offset, const window<Partition>& frame, Field field, bool backward) {
+    execute_pending();
+    [[maybe_unused]] stage_guard stage(*this, name, stage_effect::aggregate);
+    return with_rows([&](const auto& rows) {
+      using key_type = window_key<decltype(rows), Field>;
+      using    state = std::deque<key_type>;
+      std::vector<std::optional<key_type>> result(rows.size());
+      detail::scan_partitions<state>(rows, frame.partition, backward, [&](state& previous, size_t row) {
+        if (offset == 0) {
+          result[row] = std::invoke(field, *rows[row]);
+          return;
+        }
+        if (previous.size() == offset) {
+          result[row] = previous.front();
+          previous.pop_front();
+        }
+        previous.push_back(std::invoke(field, *rows[row]));
+      });
+      return result;
+    });
   }
 
-  template <typename Field, typename T, typename Comparator>
-  from& where_key(Field field, gate<Comparator, T>&& logical_gate) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_gate(where_policy::select_policy::by_key, field, logical_gate);
-    return *this;
+  template <typename Source>
+  static auto rows_of(const Source& source) {
+    std::vector<const typename Source::value_type*> rows;
+    rows.reserve(count_rows(source));
+    for (const auto& element : source) {
+      rows.push_back(&element);
+    }
+    return rows;
   }
 
-  template <typename T, typename Comparator>
-  from& where_value(gate<Comparator, T>&& logical_gate) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_gate(where_policy::select_policy::by_value, logical_gate);
-    return *this;
+  template <typename Field>
+  static auto key_of(Field field) {
+    return [field](const auto& element) -> decltype(auto) { return std::invoke(field, element); };
   }
 
-  template <typename Lambda>
-  from& where(Lambda lambda) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_lambda(lambda);
-    return *this;
+  /*!
+   * Populate buffer from a registered index if gate is the first stage over the source.
+   */
+  template <typename Field, typename T, typename Comparator>
+  bool select_by_index(const Field& field, const gate<Comparator, T>& logical_gate) {
+    constexpr comparison op = comparison_of<Comparator>::value;
+    using source_value = typename container_type::value_type;
+    using     key_type = std::remove_cvref_t<std::invoke_result_t<const Field&, const source_value&>>;
+    if constexpr (op == comparison::unsupported || !compares_as<Comparator, key_type>::value ||
+                  !requires { typename std::common_type_t<key_type, T>; }) {
+      return false;
+    } else if constexpr (!std::is_same_v<std::common_type_t<key_type, T>, key_type>) {
+      // Converting gate value to key type would change comparison semantics
+      return false;
+    } else {
+      if (indexes_.empty() || buffer_populated_ || has_pending()) {
+        return false;
+      }
+      const key_type key = static_cast<key_type>(logical_gate.value());
+      std::vector<const source_value*> matches;
+      for (const auto* index : indexes_) {
+        if (index->lookup(container_, typeid(Field), &field, op, typeid(key_type), &key, matches)) {
+          size_t to_take = matches.size();
+          if (elements_to_take_ >= 0) {
+            to_take = std::min(to_take, static_cast<size_t>(elements_to_take_));
+          }
+          for (size_t i = 0; i < to_take; ++i) {
+            container_traits::any_push(buffer_, *matches[i]);
+          }
+          buffer_populated_ = true;
+          ++rewrites_.index_lookups;
+          return true;
+        }
+      }
+      return false;
+    }
   }
 
-  template <typename Field, typename Lambda>
-  from& where(Field field, Lambda lambda) {
-    populate_buffer_if_empty();
-    where_policy policy(buffer_, elements_to_take_);
-    policy.by_lambda(field, lambda);
-    return *this;
+  /*!
+   * Slice contiguous range matching gate by binary search if gate is the first stage
+   * over an ordered source, or over an ordered buffer without pending stages.
+   * @tparam ByKey gate applies to key of associative container, otherwise to whole element
+   */
+  template <bool ByKey, typename T, typename Comparator>
+  bool select_by_range(const gate<Comparator, T>& logical_gate) {
+    constexpr comparison op = comparison_of<Comparator>::value;
+    if constexpr (op == comparison::unsupported) {
+      return false;
+    } else {
+      if (elements_to_take_ >= 0 && filters_.empty() && segments_.empty() && pending_order_ != nullptr) {
+        // Limit selects first elements in sorted order, so sort runs first and range is sliced from its output
+        materialize();
+      }
+      if (has_pending()) {
+        return false;
+      }
+      if (!buffer_populated_) {
+        if constexpr (range_searchable<container_type, ByKey, T, Comparator>()) {
+          const auto [first, last] = ordered_range(*container_, op, static_cast<typename container_type::key_type>(logical_gate.value()));
+          for (auto it = first; it != last && !limit_reached(); ++it) {
+            container_traits::any_push(buffer_, *it);
+          }
+          buffer_populated_ = true;
+          ++rewrites_.range_selections;
+          return true;
+        }
+      } else if (ordered_) {
+        if constexpr (range_searchable<buffer_type, ByKey, T, Comparator>()) {
+          const auto key = static_cast<typename buffer_type::key_type>(logical_gate.value());
+          const auto [first, last] = ordered_range(buffer_, op, key);
+          buffer_.erase(last, buffer_.end());
+          buffer_.erase(buffer_.begin(), first);
+          truncate_to_limit();
+          ++rewrites_.range_selections;
+          return true;
+        } else if constexpr (!ByKey && !container_traits::is_associative_container<container_type>::value &&
+                             std::random_access_iterator<typename buffer_type::iterator> &&
+                             compares_as<Comparator, value_type>::value &&
+                             requires { typename std::common_type_t<value_type, T>; }) {
+          if constexpr (std::is_same_v<std::common_type_t<value_type, T>, value_type>) {
+            const auto key = static_cast<value_type>(logical_gate.value());
+            const auto [first, last] = comparison_range(buffer_.begin(), buffer_.end(), op, key,
+              [](const value_type& l, const value_type& r) { return l < r; });
+            const auto offset = first - buffer_.begin();
+            buffer_.erase(last, buffer_.end());
+            buffer_.erase(buffer_.begin(), buffer_.begin() + offset);
+            truncate_to_limit();
+            ++rewrites_.range_selections;
+            return true;
+          }
+        }
+      }
+      return false;
+    }
   }
 
-  from& take(ssize_t to_take) noexcept {
-    elements_to_take_ = to_take;
-    return *this;
+  /*!
+   * Ordered associative container whose key (ByKey) or whole element can be compared with T
+   * after converting T to key type without changing comparison semantics, by Comparator
+   * comparing keys as they are.
+   */
+  template <typename C, bool ByKey, typename T, typename Comparator>
+  static constexpr bool range_searchable() {
+    if constexpr (!container_traits::is_ordered_container<C>::value) {
+      return false;
+    } else if constexpr (ByKey != container_traits::is_associative_container<C>::value) {
+      return false;
+    } else if constexpr (!compares_as<Comparator, typename C::key_type>::value) {
+      return false;
+    } else if constexpr (!requires { typename std::common_type_t<typename C::key_type, T>; }) {
+      return false;
+    } else {
+      return std::is_same_v<std::common_type_t<typename C::key_type, T>, typename C::key_type>;
+    }
   }
 
-  template <typename Target>
-  from& merge(const Target& with) {
-    merge_impl(with);
-    return *this;
+  bool limit_reached() const noexcept {
+    return elements_to_take_ >= 0 && count_rows(buffer_) >= static_cast<size_t>(elements_to_take_);
   }
 
-  template <typename T>
-  from& merge(std::initializer_list<T> with) {
-    merge_impl(with);
-    return *this;
+  void truncate_to_limit() {
+    if (elements_to_take_ >= 0 && count_rows(buffer_) > static_cast<size_t>(elements_to_take_)) {
+      buffer_.erase(std::next(buffer_.begin(), elements_to_take_), buffer_.end());
+    }
   }
 
-  from& sort() {
-    populate_buffer_if_empty();
-    order_policy<buffer_type> policy(buffer_);
-    policy.sort();
-    return *this;
+  template <typename Scan>
+  void add_segment(Scan scan) {
+    static_assert(container_traits::is_appendable<buffer_type>::value, "Buffer does not support appending");
+    if (pending_order_ != nullptr) {
+      // Merged elements are appended after sorted ones
+      materialize();
+    }
+    segments_.push_back({std::move(scan), filters_.size()});
+    ordered_ = container_traits::is_ordered_container<buffer_type>::value;
   }
 
-  from& reverse_sort() {
-    populate_buffer_if_empty();
-    order_policy<buffer_type> policy(buffer_);
-    policy.reverse_sort();
-    return *this;
+  void set_pending_order(const char* name, bool ascending, order_step step) {
+    static_assert(container_traits::is_appendable<buffer_type>::value, "Buffer does not support appending");
+    if (ascending && pending_order_ == nullptr && segments_.empty() && ordered_) {
+      ++rewrites_.elided_sorts;
+      return;
+    }
+    if (pending_order_ != nullptr) {
+      ++rewrites_.elided_sorts;
+    }
+    pending_order_      = step;
+    pending_order_name_ = name;
+    pending_ascending_  = ascending;
   }
 
-  from& reverse() {
-    populate_buffer_if_empty();
-    order_policy<buffer_type> policy(buffer_);
-    policy.reverse();
-    return *this;
+  /*!
+   * Append elements of one input accepting filters starting from first_filter.
+   */
+  template <typename Source>
+  void scan_segment(buffer_type& result, Source&& source, size_t first_filter) {
+    if (first_filter >= filters_.size()) {
+      merge_policy<buffer_type, std::remove_cvref_t<Source>> policy;
+      policy(result, std::forward<Source>(source));
+    } else {
+      where_policy policy(result);
+      if constexpr (batchable<Source>) {
+        if (batch_size_ > 0) {
+          batch_chain chain(filters_, first_filter);
+          policy.append_batches(std::forward<Source>(source), chain, batch_size_);
+          return;
+        }
+      }
+      filter_chain chain(filters_, first_filter);
+      policy.append(std::forward<Source>(source), chain);
+    }
   }
 
-  template <typename Target>
-  from& union_with(Target&& container) {
-    populate_buffer_if_empty();
-    set_policy policy(buffer_);
-    policy.union_with(std::forward<Target>(container));
-    return *this;
-  }
+  /// Source rows can be passed to filters by pointer and where policy selects batches
+  template <typename Source>
+  static constexpr bool batchable =
+    std::is_same_v<std::remove_cv_t<typename std::remove_cvref_t<Source>::value_type>, std::remove_cv_t<value_type>> &&
+    std::is_lvalue_reference_v<decltype(*std::begin(std::declval<Source&>()))> &&
+    requires (where_policy policy, Source&& source, batch_chain& chain) {
+      policy.append_batches(std::forward<Source>(source), chain, size_t{});
+    };
 
-  template <typename Target>
-  from& intersect_with(Target&& container) {
-    populate_buffer_if_empty();
-    set_policy policy(buffer_);
-    policy.intersect_with(std::forward<Target>(container));
-    return *this;
+  bool has_pending() const noexcept {
+    return !filters_.empty() || !segments_.empty() || pending_order_ != nullptr;
   }
 
-  template <typename Target>
-  from& difference_with(Target&& container) {
-    populate_buffer_if_empty();
-    set_policy policy(buffer_);
-    policy.difference_with(std::forward<Target>(container));
-    return *this;
+  void execute_pending() {
+    if (consumed_by_ != nullptr) {
+      throw std::logic_error(std::string("from: query was consumed by ") + consumed_by_);
+    }
+    if constexpr (container_traits::is_appendable<buffer_type>::value) {
+      if (has_pending()) {
+        materialize();
+      }
+    }
   }
 
-  template <typename Target>
-  Target to(Target) {
-    if (buffer_.empty()) {
-      cast_policy<container_type, Target> policy;
-      return policy(container_);
-    } else {
-      cast_policy<buffer_type, Target> policy;
-      return policy(buffer_);
+  /*!
+   * Run pending plan in one scan of every input, or copy source into buffer if nothing is pending.
+   */
+  void materialize() {
+    if (buffer_populated_ && !has_pending()) {
+      return;
+    }
+    [[maybe_unused]] stage_guard stage(*this, "materialize", stage_effect::rebuild);
+    if (!buffer_populated_) {
+      buffer_type result;
+      if (filters_.size() == 1 && filters_[0].limit < 0 && batch_size_ == 0) {
+        // Single filter over the source, most common query shape, runs without per-element indirect call
+        filters_[0].test.scan(*container_, result);
+      } else {
+        scan_segment(result, *container_, 0);
+      }
+      buffer_ = std::move(result);
+      buffer_populated_ = true;
+    } else if (!filters_.empty()) {
+      if constexpr (requires (where_policy policy, filter_chain& chain) { policy.retain(chain); }) {
+        if (batch_size_ == 0) {
+          filter_chain chain(filters_, 0);
+          where_policy policy(buffer_);
+          policy.retain(chain);
+        } else {
+          rebuild_filtered();
+        }
+      } else {
+        rebuild_filtered();
+      }
     }
+    for (auto& input : segments_) {
+      input.scan(*this, buffer_, input.first_filter);
+    }
+    if (pending_order_ != nullptr) {
+      pending_order_(buffer_);
+      ordered_ = pending_ascending_;
+    }
+    filters_.clear();
+    segments_.clear();
+    pending_order_ = nullptr;
   }
 
-  auto min() {
-    if (buffer_.empty()) {
-      numeric_policy<container_type> policy(container_);
-      return policy.min();
-    } else {
-      populate_buffer_if_empty();
-      numeric_policy<buffer_type> policy(buffer_);
-      return policy.min();
-    }
+  void rebuild_filtered() {
+    buffer_type result;
+    scan_segment(result, std::move(buffer_), 0);
+    buffer_ = std::move(result);
   }
 
-  auto max() {
-    if (buffer_.empty()) {
-      numeric_policy<container_type> policy(container_);
-      return policy.max();
-    } else {
-      populate_buffer_if_empty();
-      numeric_policy<buffer_type> policy(buffer_);
-      return policy.max();
+  void describe_filters(std::string& result, size_t first) const {
+    for (size_t i = first; i < filters_.size(); ++i) {
+      result += " | ";
+      result += filters_[i].name;
+      if (filters_[i].limit >= 0) {
+        result += " take ";
+        result += std::to_string(filters_[i].limit);
+      }
     }
   }
 
-  auto sum() {
-    if (buffer_.empty()) {
-      numeric_policy<container_type> policy(container_);
-      return policy.sum();
+  template <typename C>
+  static size_t count_rows(const C& container) noexcept {
+    if constexpr (requires { container.size(); }) {
+      return container.size();
     } else {
-      populate_buffer_if_empty();
-      numeric_policy<buffer_type> policy(buffer_);
-      return policy.sum();
+      return static_cast<size_t>(std::distance(std::begin(container), std::end(container)));
     }
   }
 
-private:
-  template <typename Target>
-  void merge_impl(const Target& with) {
-    populate_buffer_if_empty();
-    merge_policy<buffer_type, Target> policy;
-    policy(buffer_, with);
+  size_t rows() const noexcept {
+    return buffer_populated_ ? count_rows(buffer_) : count_rows(*container_);
   }
 
-  void populate_buffer_if_empty() {
-    if (buffer_.empty()) {
-      merge_policy<buffer_type, container_type> policy;
-      policy(buffer_, container_);
+  bool owns_source() const noexcept {
+    return container_ == nullptr;
+  }
+
+  template <typename Result, typename Compute>
+  std::shared_ptr<const Result> cached(result_cache& cache, std::string_view terminal, Compute compute) {
+    if (source_id_ == 0 || !fingerprint_.cacheable()) {
+      cache.note_uncacheable();
+      return std::make_shared<const Result>(compute());
     }
+    query::fingerprint print = fingerprint_;
+    print.mix_name(terminal);
+    return cache.get_or_compute<Result>({source_id_, source_version_, print.value(), typeid(Result), print.structure()}, compute);
   }
 
-  const container_type& container_;
+  /// nullptr if source was moved into the buffer
+  const container_type* container_;
   buffer_type           buffer_;
+  bool                  buffer_populated_;
+  /// Buffer (or source, until buffer is populated) is in ascending order
+  bool                  ordered_;
   ssize_t               elements_to_take_;
+  filter_list           filters_;
+  segment_list          segments_;
+  std::vector<const index_base<typename container_type::value_type>*> indexes_;
+  order_step            pending_order_      = nullptr;
+  const char*           pending_order_name_ = nullptr;
+  bool                  pending_ascending_  = false;
+  plan_rewrites         rewrites_;
+  /// Identity and version of versioned source, 0 if source is not versioned
+  uint64_t              source_id_          = 0;
+  uint64_t              source_version_     = 0;
+  /// Rows per batch of filter scan, 0 for element at a time
+  size_t                batch_size_         = 0;
+  /// Name of one-shot terminal that streamed the result out, nullptr while query is usable
+  const char*           consumed_by_        = nullptr;
+  /// Not recording unless source is versioned
+  query::fingerprint    fingerprint_{false};
+  [[no_unique_address]]
+  profile_policy        profiler_;
 };
 
+template <typename Container, typename Buffer = Container>
+using profiled_from = from<Container, Buffer, where, set_operation, numeric, order, merge, cast, stage_profiler>;
+
 } // namespace query
 
+/*!
+ * Common instantiations, compiled once by query_instantiations.cpp. Translation units
+ * defining QUERY_EXTERN_TEMPLATES before including this header and linking that object
+ * do not instantiate and emit non-template members of these classes themselves.
+ * Member templates (`where(predicate)`, `to<Target>()`, ...) are still instantiated per use.
+ * @param declare variadic macro applied to every `class name<arguments>`
+ */
+#define QUERY_COMMON_INSTANTIATIONS(declare)                             \
+  declare(class query::from<std::vector<int>>)                           \
+  declare(class query::from<std::vector<long>>)                          \
+  declare(class query::from<std::vector<double>>)                        \
+  declare(class query::from<std::vector<std::string>>)                   \
+  declare(class query::from<std::deque<int>>)                            \
+  declare(class query::from<std::set<int>>)                              \
+  declare(class query::from<std::set<std::string>>)                      \
+  declare(class query::where<std::vector<int>>)                          \
+  declare(class query::where<std::vector<std::string>>)                  \
+  declare(class query::where<std::map<int, int>>)                        \
+  declare(class query::where<std::map<std::string, int>>)                \
+  declare(class query::numeric<std::vector<int>>)                        \
+  declare(class query::numeric<std::vector<long>>)                       \
+  declare(class query::numeric<std::vector<double>>)                     \
+  declare(class query::set_operation<std::set<int>>)                     \
+  declare(class query::set_operation<std::set<std::string>>)             \
+  declare(class query::merge<std::map<int, int>, std::map<int, int>>)
+
+#ifdef QUERY_EXTERN_TEMPLATES
+#define QUERY_EXTERN_TEMPLATE(...) extern template __VA_ARGS__;
+QUERY_COMMON_INSTANTIATIONS(QUERY_EXTERN_TEMPLATE)
+#undef QUERY_EXTERN_TEMPLATE
+#endif // QUERY_EXTERN_TEMPLATES
+
 #endif // QUERY_HPP
@@ -0,0 +1,10 @@
+#include "query.hpp"
+
+/*!
+ * Explicit instantiations of `QUERY_COMMON_INSTANTIATIONS`. Compile once and link into
+ * programs whose translation units define QUERY_EXTERN_TEMPLATES.
+ */
+
+#define QUERY_INSTANTIATE_TEMPLATE(...) template __VA_ARGS__;
+QUERY_COMMON_INSTANTIATIONS(QUERY_INSTANTIATE_TEMPLATE)
+#undef QUERY_INSTANTIATE_TEMPLATE
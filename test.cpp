@@ -1,4 +1,41 @@
 #include "query.hpp"
+#include <sstream>
+#include <numeric>
+#include <random>
+
+namespace test {
+namespace memory {
+
+/// Counted by replaced global operator new, to check that queries do not allocate
+size_t allocations = 0;
+/// Allocation with this number fails, to check exception safety; 0 never fails
+size_t failing     = 0;
+
+void* allocate(size_t size) noexcept {
+  if (++allocations == failing) {
+    return nullptr;
+  }
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+/// Not inlined into operator delete, otherwise GCC warns about free of pointer from operator new
+[[gnu::noinline]] void deallocate(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+} // namespace memory
+} // namespace test
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return test::memory::allocate(size); }
+void* operator new(size_t size) {
+  if (void* pointer = test::memory::allocate(size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+void  operator delete(void* pointer) noexcept { test::memory::deallocate(pointer); }
+void  operator delete(void* pointer, size_t) noexcept { test::memory::deallocate(pointer); }
+void  operator delete(void* pointer, const std::nothrow_t&) noexcept { test::memory::deallocate(pointer); }
 
 namespace test {
 namespace container_traits {
@@ -98,6 +135,45 @@ void test_ass_to_string() {
   assert(cv == assert);
 }
 
+void test_float_to_string() {
+  const std::vector<double> v = { 0.5, -1.25, 3 };
+  const std::string assert = "0.5 -1.25 3";
+  query::cast<decltype(v), std::string> cast;
+  assert(cast(v) == assert);
+}
+
+void test_write_to_sink() {
+  std::vector<int> v;
+  for (int i = -5000; i < 5000; ++i) {
+    v.push_back(i * 7);
+  }
+  const std::string assert = query::from(v).to(std::string{});
+  std::ostringstream stream;
+  query::from(v).write_to(stream);
+  assert(stream.str() == assert);
+  std::string collected;
+  size_t chunks = 0;
+  query::from(v).write_to([&](std::string_view chunk) { collected += chunk; ++chunks; });
+  assert(collected == assert);
+  assert(chunks > 1 && chunks < v.size());
+
+  // Throwing sink propagates exception instead of terminating in destructor
+  bool thrown = false;
+  try {
+    query::from(std::vector<int>{ 1, 2 }).write_to([](std::string_view) { throw std::runtime_error("sink"); });
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void test_write_ass_to_sink() {
+  const std::map<int, std::string> v = { {1, "a"}, {2, "b"} };
+  std::ostringstream stream;
+  query::from(v).write_to(stream);
+  assert(stream.str() == "(1, a)(2, b)");
+}
+
 template <typename Container>
 void test_ass_to_ass_impl() {
   const std::map<int, int> v = { {1, 1}, {2, 2}, {3, 3} };
@@ -174,6 +250,9 @@ void test_convert() {
   test_seq_to_seq();
   test_seq_to_string();
   test_ass_to_string();
+  test_float_to_string();
+  test_write_to_sink();
+  test_write_ass_to_sink();
   test_ass_to_ass();
   test_ass_to_seq();
 }
@@ -562,6 +641,1664 @@ void order_tests() {
 
 } // namespace order
 
+namespace ownership {
+
+struct copy_counter {
+  static inline size_t copies = 0;
+  int value;
+  copy_counter(int v) : value(v) {}
+  copy_counter(const copy_counter& other) : value(other.value) { ++copies; }
+  copy_counter(copy_counter&&) noexcept = default;
+  copy_counter& operator=(const copy_counter& other) { value = other.value; ++copies; return *this; }
+  copy_counter& operator=(copy_counter&&) noexcept = default;
+  bool operator==(const copy_counter&) const = default;
+};
+
+void owning_source_test() {
+  std::vector<copy_counter> values = { 1, 2, 3 };
+  copy_counter::copies = 0;
+  const std::vector<copy_counter> moved = query::from(std::move(values)).to();
+  assert(copy_counter::copies == 0);
+  assert(moved == std::vector<copy_counter>({ 1, 2, 3 }));
+}
+
+void owning_source_to_other_buffer_test() {
+  std::vector<copy_counter> values = { 1, 2, 3 };
+  copy_counter::copies = 0;
+  const std::list<copy_counter> moved =
+    query::from<std::vector<copy_counter>, std::deque<copy_counter>>(std::move(values)).to<std::list<copy_counter>>();
+  assert(copy_counter::copies == 0);
+  assert(moved == std::list<copy_counter>({ 1, 2, 3 }));
+}
+
+void move_merge_test() {
+  const std::vector<copy_counter> values = { 1, 2 };
+  std::vector<copy_counter> to_merge = { 3, 4 };
+  copy_counter::copies = 0;
+  const std::vector<copy_counter> merged = query::from(values).merge(std::move(to_merge)).to();
+  assert(copy_counter::copies == 2 + 4); // buffer population and final cast, merged values are moved
+  assert(merged == std::vector<copy_counter>({ 1, 2, 3, 4 }));
+
+  // Query over lvalue source keeps its buffer, owning one moves it out and is consumed
+  auto borrowed = query::from(values).where([](const copy_counter&) { return true; });
+  assert(borrowed.to() == values);
+  assert(borrowed.to() == values);
+  auto owned = query::from(std::vector<copy_counter>(values)).where([](const copy_counter&) { return true; });
+  copy_counter::copies = 0;
+  assert(owned.to() == values);
+  assert(copy_counter::copies == 0);
+  bool thrown = false;
+  try {
+    owned.to();
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void empty_selection_test() {
+  const std::vector<int> values = { 1, 2, 3 };
+  const std::vector<int> select =
+    query::from(values).where(query::gate(std::greater<>{}, 100)).to(std::vector<int>{});
+  assert(select.empty());
+}
+
+void ownership_tests() {
+  owning_source_test();
+  owning_source_to_other_buffer_test();
+  move_merge_test();
+  empty_selection_test();
+}
+
+} // namespace ownership
+
+namespace binary {
+
+template <typename Container>
+void round_trip_impl(const Container& values) {
+  const std::vector<std::byte> bytes = query::from(values).to_binary();
+  const std::optional<Container> decoded = query::from_binary<Container>(bytes);
+  assert(decoded.has_value());
+  assert(*decoded == values);
+}
+
+void round_trip_test() {
+  round_trip_impl(std::vector<int>{ 1, 2, 3 });
+  round_trip_impl(std::deque<double>{ 0.5, 1.5 });
+  round_trip_impl(std::list<int>{});
+  round_trip_impl(std::set<long>{ 5, 6, 7 });
+  round_trip_impl(std::vector<std::string>{ "", "abc", "de" });
+  round_trip_impl(std::map<int, std::string>{ {1, "one"}, {2, "two"} });
+  round_trip_impl(std::unordered_map<std::string, int>{ {"one", 1}, {"two", 2} });
+}
+
+void view_test() {
+  const std::vector<int> values = { 1, 2, 3, 4, 5, 6 };
+  const std::vector<std::byte> bytes = query::from(values).where([](int v) { return v % 2 == 0; }).to_binary();
+  const auto view = query::binary::view<int>(bytes);
+  assert(view.has_value());
+  const std::vector<int> assert = { 2, 4, 6 };
+  const std::vector<int> select = query::from<std::span<const int>, std::vector<int>>(*view).to(std::vector<int>{});
+  assert(select == assert);
+}
+
+void malformed_test() {
+  const std::vector<std::byte> bytes = query::from(std::vector<int>{ 1, 2, 3 }).to_binary();
+  assert(!query::from_binary<std::vector<long>>(bytes).has_value());
+  assert(!query::from_binary<std::vector<std::string>>(bytes).has_value());
+  assert(!query::from_binary<std::vector<int>>(std::span(bytes).first(bytes.size() / 2)).has_value());
+  assert(!query::binary::view<short>(bytes).has_value());
+}
+
+void binary_tests() {
+  round_trip_test();
+  view_test();
+  malformed_test();
+}
+
+} // namespace binary
+
+namespace profile {
+
+void stage_statistics_test() {
+  const std::vector<int> values = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  query::profiled_from<std::vector<int>> query(values);
+  const std::vector<int> select =
+    query.where([](int v) { return v % 2 == 0; }).merge({ 10, 12 }).to(std::vector<int>{});
+  assert(select == std::vector<int>({ 2, 4, 6, 8, 10, 12 }));
+  const auto& stages = query.profiler().stages();
+  assert(stages.size() == 4);
+  assert(std::string_view(stages[0].name) == "where");
+  assert(stages[0].rows_in == 9 && stages[0].rows_out == 9 && stages[0].buffer_rebuilds == 0);
+  assert(std::string_view(stages[1].name) == "merge");
+  assert(std::string_view(stages[2].name) == "materialize");
+  assert(stages[2].rows_in == 9 && stages[2].rows_out == 6 && stages[2].buffer_rebuilds == 1);
+  assert(std::string_view(stages[3].name) == "to");
+  std::ostringstream plan;
+  query.explain(plan);
+  assert(plan.str().starts_with("to (rows 6 -> 6"));
+  assert(plan.str().find("`- materialize (rows 9 -> 6") != std::string::npos);
+  assert(plan.str().ends_with("`- source\n"));
+}
+
+void disabled_profiler_test() {
+  static_assert(std::is_empty_v<query::null_profiler>);
+  static_assert(sizeof(query::from<std::vector<int>>) < sizeof(query::profiled_from<std::vector<int>>));
+}
+
+void profile_tests() {
+  stage_statistics_test();
+  disabled_profiler_test();
+}
+
+} // namespace profile
+
+namespace plan {
+
+void fuse_filters_test() {
+  const std::vector<int> values = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  query::from query(values);
+  query.where([](int v) { return v % 2 == 0; }).where(query::gate(std::greater<>{}, 4));
+  assert(query.plan() == "scan source | where | where");
+  assert(query.rewrites().fused_filters == 1);
+  assert(query.to() == std::vector<int>({ 6, 8 }));
+  assert(query.plan().empty());
+}
+
+void filter_below_merge_test() {
+  const std::vector<int> values   = { 1, 2, 3, 4 };
+  const std::list<int>   to_merge = { 5, 6, 7, 8 };
+  query::from query(values);
+  query.where([](int v) { return v != 1; }).merge(to_merge).where([](int v) { return v % 2 == 0; });
+  assert(query.plan() == "scan source | where | where\nscan merge | where");
+  assert(query.rewrites().filters_below_merge == 1);
+  assert(query.to() == std::vector<int>({ 2, 4, 6, 8 }));
+}
+
+void filter_before_sort_test() {
+  const std::vector<int> values = { 9, 1, 8, 2, 7, 3 };
+  query::from query(values);
+  query.sort().where(query::gate(std::greater<>{}, 2));
+  assert(query.plan() == "scan source | where\nsort");
+  assert(query.rewrites().filters_before_sort == 1);
+  assert(query.to() == std::vector<int>({ 3, 7, 8, 9 }));
+}
+
+void limit_after_sort_test() {
+  const std::vector<int> values = { 9, 1, 8, 2, 7, 3 };
+  const std::vector<int> select =
+    query::from(values).sort().take(2).where(query::gate(std::greater<>{}, 2)).to(std::vector<int>{});
+  assert(select == std::vector<int>({ 3, 7 }));
+}
+
+void limit_pushdown_test() {
+  const std::vector<int> values(1000, 1);
+  size_t calls = 0;
+  query::from query(values);
+  const std::vector<int> select = query.take(3).where([&](int v) { ++calls; return v == 1; }).to(std::vector<int>{});
+  assert(select == std::vector<int>({ 1, 1, 1 }));
+  assert(calls == 3);
+  assert(query.rewrites().limits_pushed_down == 1);
+}
+
+void limit_across_merge_test() {
+  const std::vector<int> values   = { 1, 2, 3, 4 };
+  const std::vector<int> to_merge = { 6, 8, 10 };
+  const std::vector<int> select =
+    query::from(values)
+      .take(2)
+      .where(query::gate(std::greater<>{}, 1))
+      .merge(to_merge)
+      .where([](int v) { return v % 2 == 0; })
+      .to(std::vector<int>{});
+  assert(select == std::vector<int>({ 2, 6 }));
+}
+
+void elide_sort_test() {
+  const std::set<int> ordered = { 3, 1, 2 };
+  {
+    query::from<std::set<int>, std::vector<int>> query(ordered);
+    query.where(query::gate(std::greater<>{}, 1)).sort();
+    assert(query.rewrites().elided_sorts == 1);
+    assert(query.to() == std::vector<int>({ 2, 3 }));
+  } {
+    query::from query(ordered);
+    assert(query.sort().rewrites().elided_sorts == 1);
+  } {
+    const std::vector<int> values = { 3, 1, 2 };
+    query::from query(values);
+    query.reverse_sort().sort();
+    assert(query.rewrites().elided_sorts == 1);
+    assert(query.to() == std::vector<int>({ 1, 2, 3 }));
+  }
+}
+
+void plan_tests() {
+  fuse_filters_test();
+  filter_below_merge_test();
+  filter_before_sort_test();
+  limit_after_sort_test();
+  limit_pushdown_test();
+  limit_across_merge_test();
+  elide_sort_test();
+}
+
+} // namespace plan
+
+namespace view {
+
+void filter_sum_test() {
+  std::vector<int> events = { 1, 2, 3, 4 };
+  query::incremental_view view(events);
+  view.where([](int v) { return v % 2 == 0; });
+  assert(view.refresh() == 2);
+  assert(view.sum() == 6 && view.count() == 2);
+  events.insert(events.end(), { 5, 6, 8 });
+  assert(view.refresh() == 2);
+  assert(view.sum() == 20 && view.count() == 4);
+  assert(view.rows() == std::vector<int>({ 2, 4, 6, 8 }));
+  assert(view.min() == 2 && view.max() == 8);
+  assert(view.refresh() == 0);
+}
+
+void merge_sorted_test() {
+  std::vector<int> left  = { 5, 1 };
+  std::vector<int> right = { 4 };
+  query::incremental_view view(left);
+  view.merge(right).where(query::gate(std::greater<>{}, 1)).sort();
+  view.refresh();
+  assert(view.rows() == std::vector<int>({ 4, 5 }));
+  left.push_back(3);
+  right.push_back(9);
+  right.push_back(0);
+  view.refresh();
+  assert(view.rows() == std::vector<int>({ 3, 4, 5, 9 }));
+}
+
+void shrink_test() {
+  std::vector<int> events = { 1, 2, 3 };
+  query::incremental_view view(events);
+  view.aggregates_only().refresh();
+  assert(view.sum() == 6 && view.rows().empty());
+  events = { 10 };
+  view.refresh();
+  assert(view.sum() == 10 && view.count() == 1);
+}
+
+void string_rows_test() {
+  std::vector<std::string> events = { "b", "a" };
+  query::incremental_view view(events);
+  view.refresh();
+  events.push_back("c");
+  view.refresh();
+  assert(view.count() == 3 && view.min() == "a" && view.max() == "c");
+}
+
+void view_tests() {
+  filter_sum_test();
+  merge_sorted_test();
+  shrink_test();
+  string_rows_test();
+}
+
+} // namespace view
+
+namespace cache {
+
+void hit_miss_test() {
+  query::versioned<std::vector<int>> source({ 1, 2, 3, 4, 5 });
+  query::result_cache cache(1 << 20);
+  const auto first  = query::from(source).where(query::gate(std::greater<>{}, 2)).cached_to(cache);
+  const auto second = query::from(source).where(query::gate(std::greater<>{}, 2)).cached_to(cache);
+  assert(*first == std::vector<int>({ 3, 4, 5 }));
+  assert(first == second);
+  const auto other = query::from(source).where(query::gate(std::greater<>{}, 3)).cached_to(cache);
+  assert(*other == std::vector<int>({ 4, 5 }));
+  assert(query::from(source).cached_sum(cache) == 15);
+  assert(query::from(source).cached_sum(cache) == 15);
+  const auto stats = cache.stats();
+  assert(stats.hits == 2 && stats.misses == 3 && stats.entries == 3);
+}
+
+void collision_test() {
+  query::result_cache cache(1 << 20);
+  const query::result_cache::key first  = { 1, 0, 42, typeid(int), "where 2" };
+  const query::result_cache::key second = { 1, 0, 42, typeid(int), "where 3" };
+  assert(*cache.get_or_compute<int>(first, [] { return 2; }) == 2);
+  assert(*cache.get_or_compute<int>(second, [] { return 3; }) == 3);
+  assert(cache.stats().hits == 0 && cache.stats().entries == 2);
+
+  const query::versioned<std::vector<int>> source({ 1, 2 });
+  const auto structure = [&](int threshold) {
+    return query::from(source).where(query::gate(std::equal_to<>{}, threshold)).fingerprint().structure();
+  };
+  assert(structure(1) == structure(1));
+  assert(structure(1) != structure(2));
+}
+
+void unversioned_test() {
+  const std::vector<int> values = { 1, 2 };
+  auto select = query::from(values);
+  select.where(query::gate(std::equal_to<>{}, 1)).take(1);
+  assert(select.fingerprint().structure().empty() && !select.fingerprint().cacheable());
+  query::result_cache cache(1 << 20);
+  assert(*select.cached_to(cache) == std::vector<int>({ 1 }));
+  assert(cache.stats().uncacheable == 1 && cache.stats().entries == 0);
+}
+
+void version_test() {
+  query::versioned<std::vector<int>> source({ 1, 2, 3 });
+  query::result_cache cache(1 << 20);
+  assert(query::from(source).cached_max(cache) == 3);
+  source.modify().push_back(10);
+  assert(query::from(source).cached_max(cache) == 10);
+  assert(cache.stats().hits == 0);
+  const query::versioned<std::vector<int>> copy = source;
+  assert(query::from(copy).cached_max(cache) == 10);
+  assert(cache.stats().hits == 0);
+}
+
+void uncacheable_test() {
+  query::versioned<std::vector<int>> source({ 1, 2, 3 });
+  query::result_cache cache(1 << 20);
+  int threshold = 1;
+  const auto select = [&] {
+    return *query::from(source).where([&](int v) { return v > threshold; }).cached_to(cache);
+  };
+  assert(select() == std::vector<int>({ 2, 3 }));
+  threshold = 2;
+  assert(select() == std::vector<int>({ 3 }));
+  assert(cache.stats().uncacheable == 2 && cache.stats().entries == 0);
+}
+
+void capturing_field_test() {
+  query::versioned<std::vector<int>> source({ 1, 2, 3, 4, 5, 6 });
+  query::result_cache cache(1 << 20);
+  int modulo = 2;
+  const auto distinct_modulo = [&] {
+    return *query::from(source).distinct([&modulo](int v) { return v % modulo; }).cached_to(cache);
+  };
+  assert(distinct_modulo() == std::vector<int>({ 1, 2 }));
+  modulo = 3;
+  assert(distinct_modulo() == std::vector<int>({ 1, 2, 3 }));
+  assert(cache.stats().uncacheable == 2 && cache.stats().entries == 0);
+}
+
+void eviction_test() {
+  query::versioned<std::vector<int>> source(std::vector<int>(100, 1));
+  query::result_cache cache(1000);
+  for (ssize_t take = 1; take <= 3; ++take) {
+    query::from(source).take(take * 50).where(query::gate(std::equal_to<>{}, 1)).cached_to(cache);
+  }
+  const auto stats = cache.stats();
+  assert(stats.bytes <= 1000 && stats.evictions > 0);
+  query::from(source).take(150).where(query::gate(std::equal_to<>{}, 1)).cached_to(cache);
+  assert(cache.stats().hits == 1);
+}
+
+void cache_tests() {
+  hit_miss_test();
+  collision_test();
+  unversioned_test();
+  version_test();
+  uncacheable_test();
+  capturing_field_test();
+  eviction_test();
+}
+
+} // namespace cache
+
+namespace index {
+
+using where::human;
+
+const std::vector<human> people = {
+  { "John", 42 },
+  {  "Rob", 48 },
+  { "Alex", 33 },
+  {  "Leo", 41 },
+  {  "Max", 42 }
+};
+
+template <typename Comparator>
+void sorted_index_impl() {
+  const query::sorted_index by_age(people, &human::age);
+  const std::vector<human> assert = query::from(people).where(&human::age, query::gate(Comparator{}, 42)).to();
+  query::from query(people);
+  const std::vector<human> select = query.with_index(by_age).where(&human::age, query::gate(Comparator{}, 42)).to();
+  assert(query.rewrites().index_lookups == 1);
+  assert(select == assert);
+}
+
+void sorted_index_test() {
+  sorted_index_impl<std::equal_to<>>();
+  sorted_index_impl<std::less<>>();
+  sorted_index_impl<std::less_equal<>>();
+  sorted_index_impl<std::greater<>>();
+  sorted_index_impl<std::greater_equal<>>();
+}
+
+void hash_index_test() {
+  const query::hash_index by_name(people, &human::name);
+  query::from query(people);
+  const auto selected = query.with_index(by_name).where(&human::name, query::gate(std::equal_to<>{}, std::string("Leo"))).to();
+  assert(selected == std::vector<human>({ { "Leo", 41 } }));
+  assert(query.rewrites().index_lookups == 1);
+  query::from unsupported(people);
+  unsupported.with_index(by_name).where(&human::name, query::gate(std::less<>{}, std::string("Leo"))).to();
+  assert(unsupported.rewrites().index_lookups == 0);
+}
+
+void index_take_test() {
+  const query::sorted_index by_age(people, &human::age);
+  query::from query(people);
+  const auto selected = query.with_index(by_age).take(1).where(&human::age, query::gate(std::equal_to<>{}, 42)).to();
+  assert(selected == std::vector<human>({ { "John", 42 } }));
+}
+
+void stale_index_test() {
+  std::vector<int> values = { 3, 1, 2 };
+  const query::sorted_index index(values);
+  values.push_back(5);
+  query::from query(values);
+  const auto selected = query.with_index(index).where(query::gate(std::greater<>{}, 1)).to();
+  assert(selected == std::vector<int>({ 3, 2, 5 }));
+  assert(query.rewrites().index_lookups == 0);
+
+  // Same size after reallocation, index points into freed storage
+  std::vector<int> moved = { 3, 1, 2 };
+  moved.shrink_to_fit();
+  const query::hash_index moved_index(moved);
+  moved.push_back(4);
+  moved.pop_back();
+  query::from moved_query(moved);
+  assert(moved_query.with_index(moved_index).where(query::gate(std::equal_to<>{}, 1)).to() == std::vector<int>({ 1 }));
+  assert(moved_query.rewrites().index_lookups == 0);
+
+  // In-place edit seen through version of versioned source
+  query::versioned<std::vector<int>> tracked(std::vector<int>{ 3, 1, 2 });
+  const query::sorted_index tracked_index(tracked);
+  query::from fresh(tracked);
+  assert(fresh.with_index(tracked_index).where(query::gate(std::equal_to<>{}, 1)).to() == std::vector<int>({ 1 }));
+  assert(fresh.rewrites().index_lookups == 1);
+  tracked.modify()[1] = 7;
+  query::from edited(tracked);
+  assert(edited.with_index(tracked_index).where(query::gate(std::equal_to<>{}, 1)).to().empty());
+  assert(edited.rewrites().index_lookups == 0);
+}
+
+void converting_comparator_test() {
+  // std::equal_to<int> truncates keys before comparing, index over double keys cannot answer it
+  const std::vector<double> values = { 1.5, 2.0, 2.5 };
+  const query::sorted_index index(values);
+  query::from query(values);
+  assert(query.with_index(index).where(query::gate(std::equal_to<int>{}, 2)).to() == std::vector<double>({ 2.0, 2.5 }));
+  assert(query.rewrites().index_lookups == 0);
+}
+
+void index_tests() {
+  sorted_index_test();
+  hash_index_test();
+  index_take_test();
+  stale_index_test();
+  converting_comparator_test();
+}
+
+} // namespace index
+
+namespace range {
+
+template <typename Comparator>
+void set_range_impl() {
+  const std::multiset<int> values = { 1, 3, 3, 5, 7, 9 };
+  const std::multiset<int> assert = query::from(values).where([](int v) { return Comparator{}(v, 3); }).to();
+  query::from query(values);
+  const std::multiset<int> select = query.where(query::gate(Comparator{}, 3)).to();
+  assert(query.rewrites().range_selections == 1);
+  assert(select == assert);
+}
+
+void set_range_test() {
+  set_range_impl<std::equal_to<>>();
+  set_range_impl<std::less<>>();
+  set_range_impl<std::less_equal<>>();
+  set_range_impl<std::greater<>>();
+  set_range_impl<std::greater_equal<>>();
+}
+
+void map_key_range_test() {
+  const std::map<int, std::string> values = { { 1, "a" }, { 2, "b" }, { 3, "c" }, { 4, "d" } };
+  query::from query(values);
+  const std::map<int, std::string> select = query.where_key(query::gate(std::greater_equal<>{}, 3)).to();
+  const std::map<int, std::string> assert = { { 3, "c" }, { 4, "d" } };
+  assert(select == assert);
+  assert(query.rewrites().range_selections == 1);
+}
+
+void sorted_buffer_range_test() {
+  const std::vector<int> values = { 5, 1, 4, 2, 3 };
+  query::from query(values);
+  const std::vector<int> select = query.sort().take(2).where(query::gate(std::greater<>{}, 1)).to();
+  assert(select == std::vector<int>({ 2, 3 }));
+  assert(query.rewrites().range_selections == 1);
+}
+
+void unordered_source_test() {
+  const std::vector<int> values = { 5, 1, 4, 2, 3 };
+  query::from query(values);
+  const std::vector<int> select = query.where(query::gate(std::less<>{}, 3)).to();
+  assert(select == std::vector<int>({ 1, 2 }));
+  assert(query.rewrites().range_selections == 0);
+}
+
+void converting_comparator_test() {
+  const std::map<double, char> values = { { 1.5, 'a' }, { 2.0, 'b' }, { 2.5, 'c' }, { 3.0, 'd' } };
+  query::from converting(values);
+  const std::map<double, char> select = converting.where_key(query::gate(std::equal_to<int>{}, 2)).to();
+  assert((select == std::map<double, char>{ { 2.0, 'b' }, { 2.5, 'c' } }));
+  assert(converting.rewrites().range_selections == 0);
+
+  query::from exact(values);
+  assert(exact.where_key(query::gate(std::less<double>{}, 2.5)).to().size() == 2);
+  assert(exact.rewrites().range_selections == 1);
+
+  const std::vector<double> sorted = { 2.5, 1.5, 2.0 };
+  query::from buffer(sorted);
+  assert(buffer.sort().where(query::gate(std::equal_to<int>{}, 2)).to() == std::vector<double>({ 2.0, 2.5 }));
+  assert(buffer.rewrites().range_selections == 0);
+}
+
+void range_tests() {
+  set_range_test();
+  map_key_range_test();
+  sorted_buffer_range_test();
+  unordered_source_test();
+  converting_comparator_test();
+}
+
+} // namespace range
+
+namespace bloom {
+
+template <typename Container>
+using prefiltered_from = query::from<Container, Container, query::where, query::prefiltered_set_operation>;
+
+template <typename Container>
+Container make_sorted(size_t size, int step, int repeat) {
+  Container container;
+  for (size_t i = 0; i < size; ++i) {
+    query::container_traits::any_push(container, static_cast<int>(i / repeat) * step);
+  }
+  return container;
+}
+
+void no_false_negatives_test() {
+  const auto values = make_sorted<std::vector<int>>(10000, 7, 1);
+  const auto filter = query::blocked_bloom_filter<int>::of(values);
+  assert(std::all_of(values.begin(), values.end(), std::cref(filter)));
+  size_t false_positives = 0;
+  for (int i = 0; i < 70000; i += 7) {
+    false_positives += filter.may_contain(i + 1);
+  }
+  assert(false_positives < 500);
+}
+
+template <typename Container>
+void set_operation_impl(size_t large, size_t small) {
+  const auto stream    = make_sorted<Container>(large, 3, 2);
+  const auto exclusion = make_sorted<Container>(small, 5, 1);
+  const Container difference_assert   = query::from(stream).difference_with(exclusion).to();
+  const Container intersection_assert = query::from(stream).intersect_with(exclusion).to();
+  const Container difference_select   = prefiltered_from<Container>(stream).difference_with(exclusion).to();
+  const Container intersection_select = prefiltered_from<Container>(stream).intersect_with(exclusion).to();
+  assert(difference_select == difference_assert);
+  assert(intersection_select == intersection_assert);
+}
+
+void set_operation_test() {
+  set_operation_impl<std::vector<int>>(20000, 1000);
+  set_operation_impl<std::vector<int>>(1000, 20000);
+  set_operation_impl<std::multiset<int>>(20000, 1000);
+  set_operation_impl<std::multiset<int>>(1000, 20000);
+  set_operation_impl<std::vector<int>>(100, 10);
+}
+
+void semi_join_test() {
+  using where::human;
+  const std::vector<human> people = { { "John", 42 }, { "Rob", 48 }, { "Alex", 33 } };
+  const std::vector<int> ages = { 33, 42 };
+  const auto filter = query::blocked_bloom_filter<int>::of(ages);
+  const std::vector<human> select = query::from(people).where(&human::age, std::cref(filter)).to();
+  assert(select.size() >= 2);
+  assert(std::find(select.begin(), select.end(), human{ "Alex", 33 }) != select.end());
+}
+
+void bloom_tests() {
+  no_false_negatives_test();
+  set_operation_test();
+  semi_join_test();
+}
+
+} // namespace bloom
+
+namespace distinct {
+
+using where::human;
+
+const std::vector<human> people = {
+  { "John", 42 },
+  {  "Rob", 48 },
+  { "John", 33 },
+  {  "Leo", 42 },
+  {  "Rob", 48 }
+};
+
+template <typename Container>
+void distinct_impl() {
+  const Container values = { 3, 1, 3, 2, 1, 5, 3 };
+  const Container assert = { 3, 1, 2, 5 };
+  const Container select = query::from(values).distinct().to();
+  assert(select == assert);
+  assert(query::from(values).count_distinct() == 4);
+}
+
+void distinct_test() {
+  distinct_impl<std::vector<int>>();
+  distinct_impl<std::deque<int>>();
+  distinct_impl<std::list<int>>();
+}
+
+void distinct_field_test() {
+  const std::vector<human> assert = { { "John", 42 }, { "Rob", 48 }, { "Leo", 42 } };
+  const std::vector<human> select = query::from(people).distinct(&human::name).to();
+  assert(select == assert);
+  assert(query::from(people).count_distinct(&human::age) == 3);
+  assert(query::from(people).where([](const human& h) { return h.age > 40; }).count_distinct(&human::name) == 3);
+}
+
+void distinct_after_sort_test() {
+  const std::vector<int> values = { 5, 1, 5, 3, 1 };
+  query::from query(values);
+  const std::vector<int> select = query.sort().distinct().take(2).where(query::gate(std::greater<>{}, 0)).to();
+  assert(select == std::vector<int>({ 1, 3 }));
+}
+
+void parallel_distinct_test() {
+  std::vector<int> values;
+  for (int i = 0; i < 100000; ++i) {
+    values.push_back((i * 7919) % 1000);
+  }
+  const std::vector<int> assert = query::from(values).distinct().to();
+  const std::vector<int> select = query::from(values).distinct(query::parallel{ 4 }).to();
+  assert(select == assert);
+  assert(assert.size() == 1000);
+  assert(query::from(values).count_distinct(query::parallel{ 4 }) == 1000);
+  const std::vector<human> by_name = query::from(people).distinct(&human::name, query::parallel{ 2 }).to();
+  assert(by_name == query::from(people).distinct(&human::name).to());
+  assert(query::from(people).count_distinct(&human::name, query::parallel{ 2 }) == 3);
+}
+
+void distinct_tests() {
+  distinct_test();
+  distinct_field_test();
+  distinct_after_sort_test();
+  parallel_distinct_test();
+}
+
+} // namespace distinct
+
+namespace window {
+
+struct trade {
+  std::string symbol;
+  int         price;
+};
+
+const std::vector<trade> trades = {
+  { "A", 10 },
+  { "B", 20 },
+  { "A", 30 },
+  { "B", 40 },
+  { "A", 50 }
+};
+
+void running_sum_test() {
+  const std::vector<int> values = { 4, 1, 3, 2 };
+  const std::vector<int> select = query::from(values).sort().window_sum();
+  assert(select == std::vector<int>({ 1, 3, 6, 10 }));
+}
+
+void moving_average_test() {
+  const std::vector<int> values = { 1, 2, 3, 4, 5 };
+  const std::vector<double> select = query::from(values).window_average(query::over(2));
+  assert(select == std::vector<double>({ 1.0, 1.5, 2.5, 3.5, 4.5 }));
+  const std::vector<int> sums = query::from(trades).window_sum(query::over(&trade::symbol, 2), &trade::price);
+  assert(sums == std::vector<int>({ 10, 20, 40, 60, 80 }));
+}
+
+void lag_lead_test() {
+  const std::vector<std::optional<int>> lag = query::from(trades).lag(1, query::over(&trade::symbol), &trade::price);
+  assert(lag == std::vector<std::optional<int>>({ std::nullopt, std::nullopt, 10, 20, 30 }));
+  const std::vector<std::optional<int>> lead = query::from(trades).lead(2, query::over(), &trade::price);
+  assert(lead == std::vector<std::optional<int>>({ 30, 40, 50, std::nullopt, std::nullopt }));
+}
+
+void rank_test() {
+  const std::vector<int> values = { 3, 1, 3, 2, 1 };
+  const std::vector<size_t> select = query::from(values).sort().rank();
+  assert(select == std::vector<size_t>({ 1, 1, 3, 4, 4 }));
+  const std::set<std::pair<int, int>> grouped = { { 1, 5 }, { 1, 5 }, { 1, 7 }, { 2, 1 } };
+  const std::vector<size_t> by_group = query::from(grouped).rank(query::over(&std::pair<int, int>::first), &std::pair<int, int>::second);
+  assert(by_group == std::vector<size_t>({ 1, 2, 1 }));
+}
+
+void window_tests() {
+  running_sum_test();
+  moving_average_test();
+  lag_lead_test();
+  rank_test();
+}
+
+} // namespace window
+
+namespace batch {
+
+template <typename Container>
+void batch_impl(size_t batch_size) {
+  Container values;
+  for (int i = 0; i < 5000; ++i) {
+    query::container_traits::any_push(values, (i * 37) % 101);
+  }
+  const auto run = [&](size_t rows) {
+    return query::from(values).batch(rows)
+      .where([](int v) { return v % 3 != 0; })
+      .merge(values)
+      .where(query::gate(std::greater<>{}, 20))
+      .distinct()
+      .to();
+  };
+  assert(run(batch_size) == run(0));
+  const Container limited = query::from(values).batch(batch_size).take(7).where([](int v) { return v > 50; }).to();
+  const Container assert  = query::from(values).take(7).where([](int v) { return v > 50; }).to();
+  assert(limited == assert);
+}
+
+void batch_test() {
+  batch_impl<std::vector<int>>(1024);
+  batch_impl<std::vector<int>>(3);
+  batch_impl<std::list<int>>(64);
+  batch_impl<std::multiset<int>>(5);
+}
+
+void batch_associative_test() {
+  std::map<int, int> values;
+  for (int i = 0; i < 3000; ++i) {
+    values.emplace(i, i % 17);
+  }
+  const std::map<int, int> assert = query::from(values).where_value(query::gate(std::less<>{}, 5)).to();
+  const std::map<int, int> select = query::from(values).batch(128).where_value(query::gate(std::less<>{}, 5)).to();
+  assert(select == assert);
+}
+
+void batch_mixed_test() {
+  // Source is scanned in batches, merged vector<short> element at a time, both feed one distinct state
+  const std::vector<int>   values = { 1, 2, 3 };
+  const std::vector<short> others = { 1, 2, 3 };
+  const std::vector<int> assert = query::from(values).merge(others).distinct().to();
+  const std::vector<int> select = query::from(values).batch(16).merge(others).distinct().to();
+  assert(select == assert);
+  assert((select == std::vector<int>{ 1, 2, 3 }));
+
+  std::vector<int> many(4000);
+  std::iota(many.begin(), many.end(), 0);
+  std::vector<short> more(many.begin(), many.end());
+  const size_t sampled = query::from(many).batch(64).merge(more).sample_fraction(0.5, 7).to().size();
+  assert(sampled == query::from(many).merge(more).sample_fraction(0.5, 7).to().size());
+}
+
+void copied_filter_test() {
+  // Small filters are stored inline in the query, sampler is big enough to be stored on heap
+  const std::vector<int> values = { 3, 1, 3, 2, 1 };
+  auto distinct = query::from(values).distinct();
+  auto distinct_copy = distinct;
+  assert((distinct.to() == std::vector<int>{ 3, 1, 2 }));
+  assert((distinct_copy.to() == std::vector<int>{ 3, 1, 2 }));
+
+  std::vector<int> many(1000);
+  std::iota(many.begin(), many.end(), 0);
+  auto sampled = query::from(many).sample_fraction(0.5, 7);
+  auto sampled_copy = sampled;
+  auto sampled_moved = std::move(sampled_copy);
+  assert(sampled.to() == sampled_moved.to());
+}
+
+void batch_tests() {
+  batch_test();
+  batch_associative_test();
+  batch_mixed_test();
+  copied_filter_test();
+}
+
+} // namespace batch
+
+namespace small_buffer {
+
+using small = query::small_vector<int, 4>;
+
+void small_vector_test() {
+  small values = { 3, 1, 2 };
+  assert(values.is_inline());
+  values.push_back(4);
+  values.push_back(5);
+  assert(!values.is_inline());
+  assert(values == small({ 3, 1, 2, 4, 5 }));
+  values.erase(values.begin() + 1, values.begin() + 3);
+  values.insert(values.begin(), 7);
+  assert(values == small({ 7, 3, 4, 5 }));
+  small moved = std::move(values);
+  assert(values.empty() && values.is_inline());
+  values = moved;
+  assert(values == moved);
+
+  // Heap to heap assignment releases previous storage
+  const std::vector<int> ones(10, 1);
+  const std::vector<int> twos(10, 2);
+  small heap_left(ones.begin(), ones.end());
+  const small heap_right(twos.begin(), twos.end());
+  heap_left = heap_right;
+  assert(heap_left == heap_right && !heap_left.is_inline());
+  heap_left = small({ 1 });
+  assert(heap_left.is_inline() && heap_left.size() == 1);
+
+  query::small_vector<std::string, 2> strings = { "a", "b" };
+  strings.emplace_back(strings.front());
+  const auto copy = strings;
+  assert(copy.size() == 3 && copy.back() == "a");
+}
+
+void small_buffer_test() {
+  const std::vector<int> values = { 5, 3, 8, 1, 9, 2 };
+  using query_type = query::from<std::vector<int>, small>;
+  const small assert = { 1, 2, 3 };
+  const small select = query_type(values).where([](int v) { return v < 4; }).sort().to();
+  assert(select == assert);
+  assert(query_type(values).where([](int v) { return v > 4; }).sum() == 22);
+  assert(query_type(values).where([](int v) { return v > 4; }).min() == 5);
+  assert(query_type(values).reverse_sort().take(2).where([](int) { return true; }).to(std::vector<int>{}) == std::vector<int>({ 9, 8 }));
+  assert(query_type(values).sort().where(query::gate(std::greater_equal<>{}, 8)).to(std::string{}) == "8 9");
+  const small others = { 2, 3, 4 };
+  assert(query_type(values).sort().intersect_with(others).to() == small({ 2, 3 }));
+}
+
+void allocation_test() {
+  // Queries with few rows selected into inline buffer do not touch heap at all
+  const std::vector<int> values = { 5, 3, 8, 1, 9, 2 };
+  using query_type = query::from<std::vector<int>, small>;
+  const size_t before = memory::allocations;
+  const small single = query_type(values).where(query::gate(std::less<>{}, 4)).to();
+  const int chained = query_type(values).where([](int v) { return v > 4; }).take(2).where(query::gate(std::less<>{}, 9)).sum();
+  const int merged = query_type(values).merge(single).where([](int v) { return v % 2 == 0; }).max();
+  assert(memory::allocations == before);
+  assert(single == small({ 3, 1, 2 }));
+  assert(chained == 13);
+  assert(merged == 8);
+}
+
+void small_buffer_tests() {
+  small_vector_test();
+  small_buffer_test();
+  allocation_test();
+}
+
+} // namespace small_buffer
+
+namespace flat {
+
+using flat_map      = query::flat_map<int, std::string>;
+using flat_multimap = query::flat_multimap<int, std::string>;
+
+void construction_test() {
+  const flat_map map = { { 3, "c" }, { 1, "a" }, { 3, "x" }, { 2, "b" } };
+  assert(map.size() == 3);
+  assert(std::vector<int>(map.keys().begin(), map.keys().end()) == std::vector<int>({ 1, 2, 3 }));
+  assert(map.at(3) == "c");
+  const flat_multimap multimap = { { 3, "c" }, { 1, "a" }, { 3, "x" } };
+  assert(multimap.size() == 3 && multimap.count(3) == 2);
+  assert((*std::next(multimap.begin(), 2)).second == "x");
+
+  flat_map edited = map;
+  edited[0] = "z";
+  edited.emplace(4, "d");
+  edited.erase(edited.find(2));
+  const std::map<int, std::string> assert = { { 0, "z" }, { 1, "a" }, { 3, "c" }, { 4, "d" } };
+  assert(edited == flat_map(assert.begin(), assert.end()));
+}
+
+void query_test() {
+  const flat_map map = { { 1, "a" }, { 2, "b" }, { 3, "c" }, { 4, "d" } };
+  const std::map<int, std::string> other = { { 0, "o" }, { 2, "x" }, { 5, "e" } };
+
+  query::from by_key(map);
+  const flat_map selected = by_key.where_key(query::gate(std::greater<>{}, 2)).to();
+  assert(selected == flat_map({ { 3, "c" }, { 4, "d" } }));
+  assert(by_key.rewrites().range_selections == 1);
+
+  const std::map<int, std::string> assert = { { 0, "o" }, { 1, "a" }, { 2, "b" }, { 3, "c" }, { 5, "e" } };
+  const std::map<int, std::string> merged = query::from(map).merge(other).where_value(query::gate(std::not_equal_to<>{}, std::string("d"))).to(std::map<int, std::string>{});
+  assert(merged == assert);
+
+  const flat_map from_map = query::from<std::map<int, std::string>, flat_map>(other).merge(map).to();
+  assert(from_map == flat_map({ { 0, "o" }, { 1, "a" }, { 2, "x" }, { 3, "c" }, { 4, "d" }, { 5, "e" } }));
+
+  assert(query::from(map).where([](const auto& entry) { return entry.first % 2 == 0; }).to(std::string{}) == "(2, b)(4, d)");
+  assert(query::from(map).union_with(flat_map({ { 9, "z" } })).to().size() == 5);
+  const auto decoded = query::from_binary<flat_map>(query::from(map).to_binary());
+  assert(decoded && *decoded == map);
+}
+
+void flat_tests() {
+  construction_test();
+  query_test();
+}
+
+} // namespace flat
+
+namespace node_reuse {
+
+size_t allocations = 0;
+
+template <typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  counting_allocator() = default;
+  template <typename U>
+  counting_allocator(const counting_allocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    ++allocations;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* pointer, size_t n) noexcept {
+    std::allocator<T>().deallocate(pointer, n);
+  }
+
+  bool operator==(const counting_allocator&) const noexcept = default;
+};
+
+using list = std::list<int, counting_allocator<int>>;
+using map  = std::map<int, int, std::less<int>, counting_allocator<std::pair<const int, int>>>;
+
+void list_test() {
+  list values = { 5, 1, 4, 2, 3 };
+  list others = { 7, 6 };
+  allocations = 0;
+  const list select = query::from(std::move(values)).where([](int v) { return v > 2; }).merge(std::move(others)).to();
+  assert(allocations == 0);
+  assert(select == list({ 5, 4, 3, 7, 6 }));
+}
+
+void map_test() {
+  map values = { { 1, 10 }, { 2, 20 }, { 3, 30 } };
+  map others = { { 3, 0 }, { 4, 40 }, { 5, 50 } };
+  allocations = 0;
+  const map select = query::from(std::move(values)).merge(std::move(others)).where_value(query::gate(std::greater<>{}, 10)).to();
+  assert(allocations == 0);
+  assert(select == map({ { 2, 20 }, { 3, 30 }, { 4, 40 }, { 5, 50 } }));
+}
+
+void filtered_merge_test() {
+  map values = { { 1, 10 } };
+  map others = { { 1, 0 }, { 2, 20 }, { 3, 30 } };
+  allocations = 0;
+  const map select = query::from(std::move(values)).merge(std::move(others)).where_key(query::gate(std::less<>{}, 3)).to();
+  assert(allocations == 0);
+  assert(select == map({ { 1, 10 }, { 2, 20 } }));
+}
+
+void node_reuse_tests() {
+  list_test();
+  map_test();
+  filtered_merge_test();
+}
+
+} // namespace node_reuse
+
+namespace shared {
+
+using where::human;
+
+void shared_scan_test() {
+  std::vector<human> people;
+  for (int i = 0; i < 3000; ++i) {
+    people.push_back({ "Person" + std::to_string(i % 7), static_cast<size_t>(20 + i % 50) });
+  }
+  std::vector<human>  old;
+  size_t              young = 0;
+  size_t              ages  = 0;
+  std::optional<size_t> oldest;
+  std::set<std::string> names;
+  query::shared_scan(people, 100)
+    .add(&human::age, query::gate(std::greater<>{}, size_t{60}), query::collect_into(old))
+    .add([](const human& h) { return h.age < 30; }, query::count_into(young))
+    .add([](const human&) { return true; }, query::sum_into(ages, &human::age))
+    .add(&human::name, query::gate(std::not_equal_to<>{}, std::string("Person0")), query::max_into(oldest, &human::age))
+    .add(&human::age, [](size_t age) { return age == 42; }, [&](const human& h) { names.insert(h.name); })
+    .run();
+  const std::vector<human> assert = query::from(people).where(&human::age, query::gate(std::greater<>{}, size_t{60})).to();
+  assert(old == assert);
+  assert(young == query::from(people).where([](const human& h) { return h.age < 30; }).to().size());
+  assert(ages == std::accumulate(people.begin(), people.end(), size_t{0}, [](size_t sum, const human& h) { return sum + h.age; }));
+  assert(oldest == size_t{69});
+  assert(names.size() == 7);
+}
+
+void shared_pipeline_test() {
+  std::vector<int> values(10000);
+  std::iota(values.begin(), values.end(), 0);
+  auto even_small = query::from(values).where([](int v) { return v % 2 == 0; }).where(query::gate(std::less<>{}, 100));
+  auto first_odd  = query::from(values).take(3).where([](int v) { return v % 2 == 1; });
+  std::vector<int> evens;
+  std::vector<int> odds;
+  int sum = 0;
+  query::shared_scan(values, 64)
+    .add(even_small, query::collect_into(evens))
+    .add(first_odd, query::collect_into(odds))
+    .add(query::gate(std::greater_equal<>{}, 9990), query::sum_into(sum))
+    .run();
+  assert(evens == query::from(values).where([](int v) { return v % 2 == 0; }).where(query::gate(std::less<>{}, 100)).to());
+  assert((odds == std::vector<int>{ 1, 3, 5 }));
+  assert(sum == 99945);
+
+  // Take counters of shared pipeline were used up by the scan, it cannot be run again
+  bool consumed = false;
+  try {
+    first_odd.to();
+  } catch (const std::logic_error&) {
+    consumed = true;
+  }
+  assert(consumed);
+
+  auto merged = query::from(values).merge(values);
+  size_t count = 0;
+  bool thrown = false;
+  try {
+    query::shared_scan(values).add(merged, query::count_into(count));
+  } catch (const std::invalid_argument&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void shared_tests() {
+  shared_scan_test();
+  shared_pipeline_test();
+}
+
+} // namespace shared
+
+namespace sketch {
+
+void hyperloglog_test() {
+  std::vector<int> values;
+  for (int i = 0; i < 200000; ++i) {
+    values.push_back(i % 50000);
+  }
+  const uint64_t estimate = query::from(values).approx_count_distinct();
+  assert(estimate > 48500 && estimate < 51500);
+  assert(query::from(std::vector<int>{ 1, 2, 2, 3 }).approx_count_distinct() == 3);
+
+  query::hyperloglog<int> lhs, rhs;
+  for (int i = 0; i < 10000; ++i) {
+    lhs.add(i);
+    rhs.add(i + 5000);
+  }
+  lhs.merge(rhs);
+  assert(lhs.estimate() > 14500 && lhs.estimate() < 15500);
+
+  bool thrown = false;
+  try {
+    lhs.merge(query::hyperloglog<int>(10));
+  } catch (const std::invalid_argument&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void quantile_test() {
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  std::shuffle(values.begin(), values.end(), std::mt19937(7));
+  const auto median = query::from(values).approx_quantile(0.5);
+  assert(median && *median > 48000 && *median < 52000);
+  const auto high = query::from(values).where([](int v) { return v % 2 == 0; }).approx_quantile(0.9);
+  assert(high && *high > 88000 && *high < 92000 && *high % 2 == 0);
+  assert(!query::from(std::vector<int>{}).approx_quantile(0.5));
+
+  const std::vector<int> lower(values.begin(), values.begin() + 50000);
+  const std::vector<int> upper(values.begin() + 50000, values.end());
+  auto merged = query::from(lower).sketch(query::kll_sketch<int>());
+  merged.merge(query::from(upper).sketch(query::kll_sketch<int>()));
+  assert(merged.count() == 100000);
+  assert(*merged.quantile(0.25) > 23000 && *merged.quantile(0.25) < 27000);
+}
+
+void top_k_test() {
+  std::vector<int> values;
+  for (int i = 0; i < 1000; ++i) {
+    values.push_back(i);
+    values.insert(values.end(), { 7, 7, 7, 13, 13 });
+  }
+  const auto top = query::from(values).approx_top_k(2);
+  assert(top.size() == 2);
+  assert(top[0].first == 7  && top[0].second >= 3001);
+  assert(top[1].first == 13 && top[1].second >= 2001);
+
+  // Zipf-like stream with late risers, candidates are evicted and updated through the heap
+  query::top_k_sketch<int> lhs(5), rhs(5);
+  std::mt19937 random(11);
+  for (int i = 0; i < 200000; ++i) {
+    const int value = static_cast<int>(1000.0 / (1 + random() % 1000));
+    (i % 2 == 0 ? lhs : rhs).add(i < 100000 ? value : value + 2000 * (value > 300));
+  }
+  lhs.merge(rhs);
+  const auto merged = lhs.top();
+  assert(merged.size() == 5);
+  for (int rank = 0; rank < 5; ++rank) {
+    assert(merged[rank].first == rank + 1);
+  }
+  assert(std::is_sorted(merged.begin(), merged.end(), [](const auto& l, const auto& r) { return l.second > r.second; }));
+}
+
+void parallel_sketch_test() {
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  const auto sketch = query::from(values).sketch(query::hyperloglog<int>(), query::parallel{ 4 });
+  const auto single = query::from(values).sketch(query::hyperloglog<int>());
+  assert(sketch.estimate() == single.estimate());
+}
+
+void sketch_tests() {
+  hyperloglog_test();
+  quantile_test();
+  top_k_test();
+  parallel_sketch_test();
+}
+
+} // namespace sketch
+
+namespace sample {
+
+void reservoir_test() {
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  const std::vector<int> sampled = query::from(values).sample(1000).to();
+  assert(sampled.size() == 1000);
+  assert(std::is_sorted(sampled.begin(), sampled.end()));
+  assert(std::adjacent_find(sampled.begin(), sampled.end()) == sampled.end());
+  const double mean = std::accumulate(sampled.begin(), sampled.end(), 0.0) / 1000;
+  assert(mean > 45000 && mean < 55000);
+
+  const std::vector<int> same = query::from(values).sample(1000).to();
+  assert(sampled == same);
+  const std::vector<int> other = query::from(values).sample(1000, 1).to();
+  assert(sampled != other);
+
+  const std::vector<int> small = query::from(std::vector<int>{ 3, 1, 2 }).sample(10).to();
+  const std::vector<int> assert = { 3, 1, 2 };
+  assert(small == assert);
+
+  const std::list<int> filtered = query::from(std::list<int>(values.begin(), values.end()))
+    .where([](int v) { return v % 2 == 0; })
+    .sample(100)
+    .to();
+  assert(filtered.size() == 100);
+  assert(std::all_of(filtered.begin(), filtered.end(), [](int v) { return v % 2 == 0; }));
+}
+
+void merge_test() {
+  query::reservoir<int> lhs(100, 1), rhs(100, 2);
+  for (int i = 0; i < 90000; ++i) {
+    lhs.add(i);
+  }
+  for (int i = 90000; i < 100000; ++i) {
+    rhs.add(i);
+  }
+  lhs.merge(rhs);
+  assert(lhs.seen() == 100000 && lhs.items().size() == 100);
+  const auto from_rhs = std::count_if(lhs.items().begin(), lhs.items().end(), [](int v) { return v >= 90000; });
+  assert(from_rhs < 30);
+
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  const std::vector<int> sampled = query::from(values).sample(500, query::parallel{ 4 }).to();
+  assert(sampled.size() == 500);
+  assert(std::count_if(sampled.begin(), sampled.end(), [](int v) { return v < 50000; }) > 200);
+  assert(std::count_if(sampled.begin(), sampled.end(), [](int v) { return v >= 50000; }) > 200);
+}
+
+template <typename Weight>
+concept parallel_weight = requires (query::from<std::vector<int>>& query, Weight weight) {
+  query.sample(1, weight, query::parallel{ 2 });
+};
+
+void weighted_test() {
+  std::vector<int> values(10000);
+  std::iota(values.begin(), values.end(), 0);
+  const auto weight = [](int v) { return v < 100 ? 1000.0 : v % 2 == 0 ? 1.0 : 0.0; };
+  const std::vector<int> sampled = query::from(values).sample(100, weight).to();
+  assert(sampled.size() == 100);
+  assert(std::count_if(sampled.begin(), sampled.end(), [](int v) { return v < 100; }) > 80);
+  assert(std::none_of(sampled.begin(), sampled.end(), [](int v) { return v >= 100 && v % 2 == 1; }));
+
+  const std::vector<int> parallel = query::from(values).sample(100, weight, query::parallel{ 2 }).to();
+  assert(parallel.size() == 100);
+  assert(std::count_if(parallel.begin(), parallel.end(), [](int v) { return v < 100; }) > 80);
+
+  // Stateful weight is accepted only by sequential sample, threads would call it concurrently
+  const auto counted = [calls = size_t{0}](int v) mutable { ++calls; return static_cast<double>(v); };
+  assert(query::from(values).sample(10, counted).to().size() == 10);
+  static_assert(parallel_weight<decltype(weight)> && !parallel_weight<decltype(counted)>);
+}
+
+void fraction_test() {
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  const size_t kept = query::from(values).sample_fraction(0.1).to().size();
+  assert(kept > 9000 && kept < 11000);
+  assert(query::from(values).sample_fraction(1).to().size() == values.size());
+  assert(query::from(values).sample_fraction(0).to().empty());
+  const std::vector<int> even = query::from(values).where([](int v) { return v % 2 == 0; }).sample_fraction(0.5).to();
+  assert(std::all_of(even.begin(), even.end(), [](int v) { return v % 2 == 0; }));
+}
+
+void sample_tests() {
+  reservoir_test();
+  merge_test();
+  weighted_test();
+  fraction_test();
+}
+
+} // namespace sample
+
+namespace partition {
+
+using where::human;
+
+void partition_by_test() {
+  std::vector<human> people;
+  for (int i = 0; i < 10000; ++i) {
+    people.push_back({ "Person" + std::to_string(i % 97), static_cast<size_t>(i) });
+  }
+  const auto parts = query::from(people).where(&human::age, query::gate(std::less<>{}, size_t{9000})).partition_by(&human::name, 4);
+  assert(parts.size() == 4);
+  std::map<std::string, size_t> owner;
+  size_t total = 0;
+  for (size_t index = 0; index < parts.size(); ++index) {
+    assert(!parts[index].empty());
+    assert(std::is_sorted(parts[index].begin(), parts[index].end(), [](const human& lhs, const human& rhs) { return lhs.age < rhs.age; }));
+    for (const human& h : parts[index]) {
+      assert(owner.try_emplace(h.name, index).first->second == index);
+    }
+    total += parts[index].size();
+  }
+  assert(total == 9000);
+  assert(owner.size() == 97);
+
+  const auto parallel = query::from(people).partition_by(&human::name, 4, query::parallel{ 3 });
+  const auto single   = query::from(people).partition_by(&human::name, 4);
+  assert(parallel == single);
+
+  // Buffers without random access are filled per chunk and joined
+  const std::list<human> listed(people.begin(), people.end());
+  const auto parallel_list = query::from(listed).partition_by(&human::name, 5, query::parallel{ 4 });
+  const auto single_list   = query::from(listed).partition_by(&human::name, 5);
+  assert(parallel_list == single_list);
+
+  auto owned = query::from(std::vector<human>(people)).where(&human::age, query::gate(std::less<>{}, size_t{100})).partition_by(&human::name, 2);
+  assert(owned[0].size() + owned[1].size() == 100);
+
+  // Owned rows were moved into partitions, query cannot be used afterwards
+  auto moved = query::from(std::vector<int>{ 1, 2, 3 });
+  assert(moved.partition_by(2).size() == 2);
+  bool thrown = false;
+  try {
+    moved.to();
+  } catch (const std::logic_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void partition_associative_test() {
+  std::map<int, std::string> source;
+  for (int i = 0; i < 100; ++i) {
+    source.emplace(i, std::to_string(i % 5));
+  }
+  const auto parts = query::from(source).partition_by([](const auto& entry) { return entry.second; }, 3);
+  size_t total = 0;
+  for (const auto& part : parts) {
+    std::set<std::string> values;
+    for (const auto&[key, value] : part) {
+      values.insert(value);
+    }
+    for (const auto& other : parts) {
+      if (&other != &part) {
+        assert(std::none_of(other.begin(), other.end(), [&](const auto& entry) { return values.contains(entry.second); }));
+      }
+    }
+    total += part.size();
+  }
+  assert(total == 100);
+  const auto whole = query::from(std::vector<int>{ 1, 2, 3, 1, 2, 3 }).partition_by(1);
+  const std::vector<int> assert = { 1, 2, 3, 1, 2, 3 };
+  assert(whole.size() == 1 && whole[0] == assert);
+}
+
+void partition_tests() {
+  partition_by_test();
+  partition_associative_test();
+}
+
+} // namespace partition
+
+namespace external {
+
+void spill_test() {
+  std::vector<int> values(200000);
+  std::mt19937 random(3);
+  for (int& value : values) {
+    value = static_cast<int>(random() % 100000);
+  }
+  query::external_sorter<int> sorter(query::external{ 64 << 10 });
+  for (int value : values) {
+    sorter.add(value);
+  }
+  assert(sorter.runs() > 10);
+  std::vector<int> sorted;
+  sorter.drain([&](int&& value) { sorted.push_back(value); });
+  std::vector<int> assert = values;
+  std::sort(assert.begin(), assert.end());
+  assert(sorted == assert);
+}
+
+void strings_test() {
+  std::vector<std::string> values;
+  for (int i = 0; i < 20000; ++i) {
+    values.push_back(std::string(static_cast<size_t>(i % 17), 'a') + std::to_string(i * 7919 % 20000));
+  }
+  std::vector<std::string> sorted;
+  query::from(values).sort_to([&](std::string&& value) { sorted.push_back(std::move(value)); }, query::external{ 16 << 10 });
+  std::vector<std::string> assert = values;
+  std::sort(assert.begin(), assert.end());
+  assert(sorted == assert);
+}
+
+void filtered_test() {
+  std::vector<int> values(100000);
+  std::iota(values.begin(), values.end(), 0);
+  std::shuffle(values.begin(), values.end(), std::mt19937(5));
+  std::vector<int> sorted;
+  query::from(values)
+    .where([](int v) { return v % 3 == 0; })
+    .reverse_sort_to([&](int&& value) { sorted.push_back(value); }, query::external{ 32 << 10 });
+  assert(sorted.size() == 33334);
+  assert(std::is_sorted(sorted.rbegin(), sorted.rend()));
+  assert(sorted.front() == 99999 && sorted.back() == 0);
+
+  std::vector<int> merged;
+  query::from(std::vector<int>{ 5, 1, 4 }).merge(std::vector<int>{ 3, 2 }).sort_to([&](int&& value) { merged.push_back(value); });
+  const std::vector<int> assert = { 1, 2, 3, 4, 5 };
+  assert(merged == assert);
+
+  std::vector<int> in_memory;
+  query::external_sorter<int> sorter;
+  for (int value : { 3, 1, 2 }) {
+    sorter.add(value);
+  }
+  sorter.drain([&](int&& value) { in_memory.push_back(value); });
+  assert(sorter.runs() == 0);
+  assert((in_memory == std::vector<int>{ 1, 2, 3 }));
+}
+
+void consumed_test() {
+  const std::vector<int> values = { 3, 1, 2 };
+  const auto reuse_throws = [](auto& query) {
+    try {
+      query.to();
+    } catch (const std::logic_error&) {
+      return true;
+    }
+    return false;
+  };
+  // Filters streamed straight from source
+  auto direct = query::from(values).where([](int v) { return v > 1; });
+  std::vector<int> sorted;
+  direct.sort_to([&](int&& value) { sorted.push_back(value); });
+  assert((sorted == std::vector<int>{ 2, 3 }));
+  assert(reuse_throws(direct));
+  // Materialized buffer
+  auto merged = query::from(values).merge(std::vector<int>{ 0 });
+  merged.reverse_sort_to([](int&&) {});
+  assert(reuse_throws(merged));
+}
+
+void external_tests() {
+  spill_test();
+  strings_test();
+  filtered_test();
+  consumed_test();
+}
+
+} // namespace external
+
+namespace strings {
+
+using where::human;
+
+const std::vector<human> people = {
+  { "Peter", 31 }, { "Petra", 44 }, { "Max", 45 }, { "Leo", 41 }, { "PETER", 23 }, { "Alexander", 52 }
+};
+
+void prefix_suffix_test() {
+  const std::vector<human> assert = { { "Peter", 31 }, { "Petra", 44 } };
+  const std::vector<human> select = query::from(people).where(&human::name, query::starts_with("Pet")).to();
+  assert(select == assert);
+
+  const std::vector<std::string> names = { "peter", "alexander", "er", "r", "" };
+  const std::vector<std::string> suffixed = query::from(names).where(query::ends_with("er")).to();
+  assert((suffixed == std::vector<std::string>{ "peter", "alexander", "er" }));
+  const std::vector<std::string> empty_prefix = query::from(names).where(query::starts_with("")).to();
+  assert(empty_prefix == names);
+}
+
+void contains_test() {
+  const std::vector<human> select = query::from(people).where(&human::name, query::contains("xan")).to();
+  assert((select == std::vector<human>{ { "Alexander", 52 } }));
+
+  // Long values exercise vector blocks and scalar tail, matches placed around block borders
+  std::vector<std::string> values;
+  for (size_t length = 0; length < 100; ++length) {
+    std::string value(length, 'a');
+    for (size_t position = 0; position + 3 <= length; position += 13) {
+      std::string match = value;
+      match.replace(position, 3, "abc");
+      values.push_back(match);
+    }
+    values.push_back(value + "ab");
+    values.push_back("bc" + value);
+  }
+  std::vector<std::string> assert;
+  std::copy_if(values.begin(), values.end(), std::back_inserter(assert),
+    [](const std::string& value) { return value.find("abc") != std::string::npos; });
+  const std::vector<std::string> select_long = query::from(values).where(query::contains("abc")).to();
+  assert(select_long == assert);
+  const std::vector<std::string> select_byte = query::from(values).where(query::contains("b")).to();
+  assert(select_byte.size() ==
+    static_cast<size_t>(std::count_if(values.begin(), values.end(), [](const std::string& value) { return value.find('b') != std::string::npos; })));
+}
+
+void equals_ci_test() {
+  const std::vector<human> assert = { { "Peter", 31 }, { "PETER", 23 } };
+  const std::vector<human> select = query::from(people).where(&human::name, query::equals_ci("pEtEr")).to();
+  assert(select == assert);
+
+  const std::string upper = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG @[`{ 0123456789";
+  const std::string lower = "the quick brown fox jumps over the lazy dog @[`{ 0123456789";
+  assert(query::text::equals_ci{}(upper, lower));
+  assert(!query::text::equals_ci{}(upper, lower + "!"));
+  // '@' and '`', '[' and '{' differ only in 0x20 bit but are not letters
+  assert(!query::text::equals_ci{}("@[@[@[@[@[@[@[@[@[", "`{`{`{`{`{`{`{`{`{"));
+}
+
+void in_set_test() {
+  const std::vector<human> assert = { { "Max", 45 }, { "Leo", 41 } };
+  const std::vector<human> select = query::from(people).where(&human::name, query::in_set({ "Leo", "Max", "Tom" })).to();
+  assert(select == assert);
+
+  // Gate is copied into the filter, set must not keep views into the original
+  auto deferred = query::from(people);
+  deferred.where(&human::name, query::in_set({ "Leo", "Max" }));
+  assert(deferred.to() == assert);
+  const query::string_set names({ "Leo", "Max" });
+  query::string_set copy = names;
+  copy = query::string_set(names);
+  assert(copy.contains("Leo") && copy.size() == 2);
+
+  const std::vector<std::string> codes = { "DE", "FR", "PL" };
+  const std::map<std::string, int> population = { { "DE", 83 }, { "ES", 48 }, { "FR", 68 }, { "IT", 59 } };
+  const std::map<std::string, int> selected = query::from(population).where_key(query::in_set(codes)).to();
+  assert((selected == std::map<std::string, int>{ { "DE", 83 }, { "FR", 68 } }));
+}
+
+void strings_tests() {
+  prefix_suffix_test();
+  contains_test();
+  equals_ci_test();
+  in_set_test();
+}
+
+} // namespace strings
+
+namespace dictionary {
+
+const std::vector<std::string> statuses = {
+  "open", "closed", "open", "pending", "reopened", "closed", "open", "pending", "archived"
+};
+
+void encode_test() {
+  query::dictionary_column<> column(statuses);
+  assert((column.dictionary() == std::vector<std::string>{ "archived", "closed", "open", "pending", "reopened" }));
+  assert(column.decode(column.codes()) == statuses);
+  assert(column.size() == statuses.size() && column[3] == "pending");
+  assert(column.code_of("open") == 2u && !column.code_of("lost"));
+
+  // New values keep dictionary sorted, existing codes are remapped
+  const std::vector<std::string> more = { "blocked", "open", "active" };
+  column.append(more);
+  column.push_back("closed");
+  std::vector<std::string> assert = statuses;
+  assert.insert(assert.end(), more.begin(), more.end());
+  assert.push_back("closed");
+  assert(column.decode(column.codes()) == assert);
+  assert(std::is_sorted(column.dictionary().begin(), column.dictionary().end()));
+  assert(column.code_of("active") == 0u && column.code_of("open") == 4u);
+
+  std::vector<std::string> many;
+  for (int i = 0; i < 300; ++i) {
+    many.push_back(std::to_string(i));
+  }
+  query::dictionary_column<uint8_t> narrow(std::vector<std::string>{ "x" });
+  bool thrown = false;
+  try {
+    narrow.append(many);
+  } catch (const std::length_error&) {
+    thrown = true;
+  }
+  assert(thrown && narrow.size() == 1 && narrow.dictionary().size() == 1);
+
+  // Full dictionary, range end is one past the largest code
+  std::vector<std::string> full;
+  for (int i = 0; i < 256; ++i) {
+    full.push_back(std::to_string(1000 + i));
+  }
+  const query::dictionary_column<uint8_t> wide(full);
+  const std::vector<uint8_t> all = query::from(wide.codes()).where(wide.translate(query::gate(std::greater_equal<>{}, std::string("")))).to();
+  assert(all.size() == 256);
+  const std::vector<uint8_t> last = query::from(wide.codes()).where(wide.translate(query::gate(std::greater<>{}, std::string("1254")))).to();
+  assert(wide.decode(last) == std::vector<std::string>{ "1255" });
+}
+
+template <typename Gate>
+void translate_test(Gate&& string_gate) {
+  const query::dictionary_column<> column(statuses);
+  const std::vector<std::string> assert = query::from(statuses).where(Gate(string_gate)).to();
+  const std::vector<std::string> select =
+    column.decode(query::from(column.codes()).where(column.translate(string_gate)).to());
+  assert(select == assert);
+}
+
+void where_test() {
+  translate_test(query::gate(std::equal_to<>{}, std::string("open")));
+  translate_test(query::gate(std::equal_to<>{}, std::string("lost")));
+  translate_test(query::gate(std::greater_equal<>{}, std::string("op")));
+  translate_test(query::gate(std::less<>{}, std::string("open")));
+  translate_test(query::gate(std::greater<>{}, std::string("zzz")));
+  translate_test(query::starts_with("re"));
+  translate_test(query::contains("en"));
+  translate_test(query::in_set({ "archived", "pending" }));
+}
+
+void sort_group_test() {
+  const query::dictionary_column<> column(statuses);
+  std::vector<std::string> assert = statuses;
+  std::sort(assert.begin(), assert.end());
+  const std::vector<std::string> sorted = column.decode(query::from(column.codes()).sort().to());
+  assert(sorted == assert);
+
+  const std::vector<std::string> distinct = column.decode(query::from(column.codes()).distinct().to());
+  assert((distinct == std::vector<std::string>{ "open", "closed", "pending", "reopened", "archived" }));
+
+  const std::vector<uint32_t> not_open = query::from(column.codes()).where(column.translate(query::gate(std::greater<>{}, std::string("open")))).to();
+  const auto groups = column.count_by(not_open);
+  const std::vector<std::pair<std::string, size_t>> expected = { { "pending", 2 }, { "reopened", 1 } };
+  assert(groups == expected);
+  const std::set<std::string> as_set = column.decode<std::set<std::string>>(column.codes());
+  assert(as_set.size() == 5);
+}
+
+void failed_append_test() {
+  // Every allocation of append fails in turn, column is left as before the call
+  query::dictionary_column<> column(std::vector<std::string>{ "d", "b", "d" });
+  const std::vector<std::string> values = { "c", "b", "a", "e" };
+  const std::vector<uint32_t>    codes  = column.codes();
+  for (size_t failing = 1;; ++failing) {
+    memory::failing = memory::allocations + failing;
+    try {
+      column.append(values);
+      memory::failing = 0;
+      break;
+    } catch (const std::bad_alloc&) {
+      memory::failing = 0;
+      assert(column.codes() == codes);
+      assert((column.dictionary() == std::vector<std::string>{ "b", "d" }));
+      assert(!column.code_of("a") && column.code_of("d") == 1u);
+    }
+  }
+  assert((column.decode(column.codes()) == std::vector<std::string>{ "d", "b", "d", "c", "b", "a", "e" }));
+  assert(column.code_of("a") == 0u && column.code_of("e") == 4u);
+}
+
+void dictionary_tests() {
+  encode_test();
+  failed_append_test();
+  where_test();
+  sort_group_test();
+}
+
+} // namespace dictionary
+
 void complex_test() {
   const std::vector<int> values_1 = { 9,  7,  5,  3,  1 };
   const std::vector<int> values_2 = { 2,  4,  6,  8, 10 };
@@ -592,5 +2329,27 @@ int main() {
   test::set::set_tests();
   test::numeric::numeric_tests();
   test::order::order_tests();
+  test::ownership::ownership_tests();
+  test::binary::binary_tests();
+  test::profile::profile_tests();
+  test::plan::plan_tests();
+  test::view::view_tests();
+  test::cache::cache_tests();
+  test::index::index_tests();
+  test::range::range_tests();
+  test::bloom::bloom_tests();
+  test::distinct::distinct_tests();
+  test::window::window_tests();
+  test::batch::batch_tests();
+  test::small_buffer::small_buffer_tests();
+  test::flat::flat_tests();
+  test::node_reuse::node_reuse_tests();
+  test::shared::shared_tests();
+  test::sketch::sketch_tests();
+  test::sample::sample_tests();
+  test::partition::partition_tests();
+  test::external::external_tests();
+  test::strings::strings_tests();
+  test::dictionary::dictionary_tests();
   test::complex_test();
 }